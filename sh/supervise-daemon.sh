@@ -20,6 +20,8 @@ supervise_start()
 		return 1
 	fi
 
+	local shared
+	yesno "${supervise_daemon_shared}" && shared=--shared
 	ebegin "Starting ${name:-$RC_SVCNAME}"
 	# The eval call is necessary for cases like:
 	# command_args="this \"is a\" test"
@@ -36,14 +38,20 @@ supervise_start()
 		${respawn_delay:+--respawn-delay} $respawn_delay \
 		${respawn_max:+--respawn-max} $respawn_max \
 		${respawn_period:+--respawn-period} $respawn_period \
+		${respawn_delay_max:+--respawn-delay-max} $respawn_delay_max \
+		${respawn_jitter:+--respawn-jitter} $respawn_jitter \
+		${respawn_reset:+--respawn-reset} $respawn_reset \
+		${respawn_park:+--respawn-park} $respawn_park \
 		${healthcheck_delay:+--healthcheck-delay} $healthcheck_delay \
 		${healthcheck_timer:+--healthcheck-timer} $healthcheck_timer \
+		${healthcheck_probe:+--healthcheck-probe} $healthcheck_probe \
 		${capabilities+--capabilities} "$capabilities" \
 		${secbits:+--secbits} "$secbits" \
 		${no_new_privs:+--no-new-privs} \
 		${command_user+--user} $command_user \
 		${umask+--umask} $umask \
 		${ready+--ready} $ready \
+		${shared} \
 		${supervise_daemon_args-${start_stop_daemon_args}} \
 		$command \
 		-- $command_args $command_args_foreground
@@ -99,6 +107,11 @@ supervise_status()
 			eerror "status: crashed"
 			return 32
 		fi
+		local parked="$(service_get_value "parked")"
+		if [ -n "${parked}" ]; then
+			ewarn "status: parked until ${parked}"
+			return 0
+		fi
 		einfo "status: started"
 		return 0
 	else
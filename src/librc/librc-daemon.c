@@ -33,86 +33,298 @@
 
 #if defined(__linux__) || (defined (__FreeBSD_kernel__) && defined(__GLIBC__)) \
 	|| defined(__GNU__)
-static bool
-pid_is_exec(pid_t pid, const char *exec)
+
+/* What we have read about a process so far, and what we found */
+#define PROC_COMM	0x01
+#define PROC_UID	0x02
+#define PROC_NS		0x04
+#define PROC_ARGV	0x08
+#define PROC_ENVID	0x10
+
+struct rc_proc {
+	pid_t pid;
+	unsigned int have;
+	char *comm;
+	uid_t uid;
+	bool other_ns;
+	char *cmdline;
+	size_t cmdlen;
+	bool container;
+};
+
+struct rc_procs {
+	struct rc_proc *procs;
+	size_t count;
+};
+
+/* /proc stays open for the life of the process, as start-stop-daemon and
+ * supervise-daemon look through it every time they poll for a daemon */
+static DIR *procdir;
+
+static int
+proc_fd(void)
 {
-	char *buffer = NULL;
-	FILE *fp;
-	int c;
-	bool retval = false;
+	if (!procdir)
+		procdir = opendir("/proc");
+	return procdir ? dirfd(procdir) : -1;
+}
 
-	exec = basename_c(exec);
-	xasprintf(&buffer, "/proc/%d/stat", pid);
-	if ((fp = fopen(buffer, "r"))) {
-		while ((c = getc(fp)) != EOF && c != '(')
-			;
-		if (c == '(') {
-			while ((c = getc(fp)) != EOF && c == *exec)
-				exec++;
-			if (c == ')' && *exec == '\0')
-				retval = true;
+/* Reads the start of /proc/pid/file in one go */
+static ssize_t
+proc_read(pid_t pid, const char *file, char *buffer, size_t size)
+{
+	char path[64];
+	ssize_t bytes;
+	int fd;
+
+	snprintf(path, sizeof(path), "%d/%s", pid, file);
+	if ((fd = openat(proc_fd(), path, O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+	bytes = pread(fd, buffer, size - 1, 0);
+	close(fd);
+	if (bytes == -1)
+		return -1;
+	buffer[bytes] = '\0';
+	return bytes;
+}
+
+/* The comm field of /proc/pid/stat, kept up to the last ) as a name can
+ * have one in it too */
+static bool
+proc_is_exec(struct rc_proc *proc, const char *exec)
+{
+	char buffer[1024];
+	char *start, *end;
+	size_t len;
+
+	if (!(proc->have & PROC_COMM)) {
+		proc->have |= PROC_COMM;
+		if (proc_read(proc->pid, "stat", buffer, sizeof(buffer)) > 0 &&
+		    (start = strchr(buffer, '(')) &&
+		    (end = strrchr(++start, ')')))
+		{
+			*end = '\0';
+			proc->comm = xstrdup(start);
 		}
-		fclose(fp);
 	}
-	free(buffer);
-	return retval;
+	if (!proc->comm)
+		return false;
+
+	/* Whatever follows exec has to be the ) that ends comm */
+	len = strlen(exec);
+	return strncmp(proc->comm, exec, len) == 0 &&
+	    (proc->comm[len] == '\0' || proc->comm[len] == ')');
 }
 
 static bool
-pid_is_argv(pid_t pid, const char *const *argv)
+proc_is_uid(struct rc_proc *proc, uid_t uid)
+{
+	struct stat sb;
+	char path[32];
+
+	if (!(proc->have & PROC_UID)) {
+		snprintf(path, sizeof(path), "%d", proc->pid);
+		if (fstatat(proc_fd(), path, &sb, 0) != 0)
+			return false;
+		proc->have |= PROC_UID;
+		proc->uid = sb.st_uid;
+	}
+	return proc->uid == uid;
+}
+
+/* Processes in another pid namespace, such as a container, are not ours */
+static bool
+proc_in_ns(struct rc_proc *proc)
+{
+	static char my_ns[30];
+	static bool have_ns;
+	char proc_ns[30];
+	char path[32];
+	ssize_t rc;
+
+	if (!have_ns) {
+		have_ns = true;
+		rc = readlink("/proc/self/ns/pid", my_ns, sizeof(my_ns) - 1);
+		my_ns[rc > 0 ? rc : 0] = '\0';
+	}
+	if (!*my_ns)
+		return true;
+
+	if (!(proc->have & PROC_NS)) {
+		proc->have |= PROC_NS;
+		snprintf(path, sizeof(path), "%d/ns/pid", proc->pid);
+		rc = readlinkat(proc_fd(), path, proc_ns, sizeof(proc_ns) - 1);
+		proc_ns[rc > 0 ? rc : 0] = '\0';
+		proc->other_ns = *proc_ns && strcmp(my_ns, proc_ns) != 0;
+	}
+	return !proc->other_ns;
+}
+
+static bool
+proc_is_argv(struct rc_proc *proc, const char *const *argv)
 {
-	char *cmdline = NULL;
-	int fd;
 	char buffer[PATH_MAX];
 	char *p;
 	ssize_t bytes;
 
-	xasprintf(&cmdline, "/proc/%u/cmdline", pid);
-	if ((fd = open(cmdline, O_RDONLY)) < 0) {
-		free(cmdline);
-		return false;
+	if (!(proc->have & PROC_ARGV)) {
+		proc->have |= PROC_ARGV;
+		if ((bytes = proc_read(proc->pid, "cmdline",
+			    buffer, sizeof(buffer))) != -1)
+		{
+			proc->cmdline = xmalloc(bytes + 1);
+			memcpy(proc->cmdline, buffer, bytes + 1);
+			proc->cmdlen = bytes;
+		}
 	}
-	bytes = read(fd, buffer, sizeof(buffer) - 1);
-	close(fd);
-	free(cmdline);
-	if (bytes == -1)
+	if (!proc->cmdline)
 		return false;
 
-	buffer[bytes] = '\0';
-	p = buffer;
+	p = proc->cmdline;
 	while (*argv) {
-		if (strcmp(*argv, p) != 0)
+		if ((size_t)(p - proc->cmdline) > proc->cmdlen ||
+		    strcmp(*argv, p) != 0)
 			return false;
 		argv++;
 		p += strlen(p) + 1;
-		if ((unsigned)(p - buffer) > sizeof(buffer))
-			return false;
 	}
 	return true;
 }
 
-RC_PIDLIST *
-rc_find_pids(const char *exec, const char *const *argv, uid_t uid, pid_t pid)
+/*
+If /proc/self/status contains EnvID: 0, then we are an OpenVZ host,
+and we will need to filter out processes that are inside containers
+from our list of pids.
+*/
+static bool
+openvz_host(void)
 {
-	DIR *procdir;
-	struct dirent *entry;
+	static int host = -1;
+	char *line = NULL;
+	size_t len = 0;
 	FILE *fp;
-	int rc;
-	bool container_pid = false;
-	bool openvz_host = false;
+
+	if (host != -1)
+		return host;
+	host = 0;
+	if ((fp = fopen("/proc/self/status", "r"))) {
+		while (xgetline(&line, &len, fp) != -1) {
+			if (strncmp(line, "envID:\t0", 8) == 0) {
+				host = 1;
+				break;
+			}
+		}
+		fclose(fp);
+	}
+	free(line);
+	return host;
+}
+
+static bool
+proc_in_container(struct rc_proc *proc)
+{
 	char *line = NULL;
-	char my_ns[30];
-	char proc_ns[30];
 	size_t len = 0;
+	char path[32];
+	FILE *fp;
+	int fd;
+
+	if (!(proc->have & PROC_ENVID)) {
+		proc->have |= PROC_ENVID;
+		snprintf(path, sizeof(path), "%d/status", proc->pid);
+		if ((fd = openat(proc_fd(), path, O_RDONLY | O_CLOEXEC)) == -1)
+			return false;
+		if (!(fp = fdopen(fd, "r"))) {
+			close(fd);
+			proc->container = true;
+			return true;
+		}
+		while (xgetline(&line, &len, fp) != -1) {
+			if (strncmp(line, "envID:", 6) == 0) {
+				proc->container = strncmp(line, "envID:\t0", 8) != 0;
+				break;
+			}
+		}
+		fclose(fp);
+		free(line);
+	}
+	return proc->container;
+}
+
+/* /proc only lists processes, but /proc/tid works for any thread, so
+ * check that a pid we were given is a process before we look at it */
+static bool
+proc_is_process(pid_t pid)
+{
+	char buffer[1024];
+	char *p;
+
+	if (proc_read(pid, "status", buffer, sizeof(buffer)) == -1)
+		return false;
+	if (!(p = strstr(buffer, "\nTgid:")))
+		return true;
+	return strtol(p + 6, NULL, 10) == pid;
+}
+
+static void
+procs_add(RC_PROCS *procs, pid_t pid)
+{
+	if ((procs->count & (procs->count - 1)) == 0)
+		procs->procs = xrealloc(procs->procs, sizeof(*procs->procs) *
+		    (procs->count ? procs->count * 2 : 1));
+	memset(&procs->procs[procs->count], 0, sizeof(*procs->procs));
+	procs->procs[procs->count++].pid = pid;
+}
+
+/* Only the pids are read here. Everything else is read the first time a
+ * search needs it and kept for the next one. */
+static RC_PROCS *
+procs_load(pid_t pid)
+{
+	RC_PROCS *procs;
+	struct dirent *entry;
 	pid_t p;
-	char *buffer = NULL;
-	struct stat sb;
-	pid_t openrc_pid = 0;
-	char *pp;
+
+	if (proc_fd() == -1)
+		return NULL;
+
+	procs = xmalloc(sizeof(*procs));
+	procs->procs = NULL;
+	procs->count = 0;
+
+	/* A pid to look for saves us reading the whole of /proc */
+	if (pid != 0) {
+		if (proc_is_process(pid))
+			procs_add(procs, pid);
+		return procs;
+	}
+
+	rewinddir(procdir);
+	while ((entry = readdir(procdir)) != NULL) {
+		if (sscanf(entry->d_name, "%d", &p) == 1)
+			procs_add(procs, p);
+	}
+	return procs;
+}
+
+RC_PROCS *
+rc_procs_load(void)
+{
+	return procs_load(0);
+}
+
+RC_PIDLIST *
+rc_procs_find(RC_PROCS *procs, const char *exec, const char *const *argv,
+    uid_t uid, pid_t pid)
+{
 	RC_PIDLIST *pids = NULL;
 	RC_PID *pi;
+	struct rc_proc *proc;
+	pid_t openrc_pid = 0;
+	char *pp;
+	size_t i;
 
-	if ((procdir = opendir("/proc")) == NULL)
+	if (!procs)
 		return NULL;
 
 	/*
@@ -131,92 +343,59 @@ rc_find_pids(const char *exec, const char *const *argv, uid_t uid, pid_t pid)
 			openrc_pid = 0;
 	}
 
-	/*
-	If /proc/self/status contains EnvID: 0, then we are an OpenVZ host,
-	and we will need to filter out processes that are inside containers
-	from our list of pids.
-	*/
-
-	if (exists("/proc/self/status")) {
-		fp = fopen("/proc/self/status", "r");
-		if (fp) {
-			while (xgetline(&line, &len, fp) != -1) {
-				if (strncmp(line, "envID:\t0", 8) == 0) {
-					openvz_host = true;
-					break;
-				}
-			}
-			fclose(fp);
-		}
-	}
-
-	memset(my_ns, 0, sizeof(my_ns));
-	memset(proc_ns, 0, sizeof(proc_ns));
-	if (exists("/proc/self/ns/pid")) {
-		rc = readlink("/proc/self/ns/pid", my_ns, sizeof(my_ns)-1);
-		if (rc <= 0)
-			my_ns[0] = '\0';
-	}
+	if (exec)
+		exec = basename_c(exec);
 
-	while ((entry = readdir(procdir)) != NULL) {
-		if (sscanf(entry->d_name, "%d", &p) != 1)
+	/* The cheapest and most telling checks go first */
+	for (i = 0; i < procs->count; i++) {
+		proc = &procs->procs[i];
+		if (openrc_pid != 0 && openrc_pid == proc->pid)
 			continue;
-		if (openrc_pid != 0 && openrc_pid == p)
+		if (pid != 0 && pid != proc->pid)
 			continue;
-		if (pid != 0 && pid != p)
+		if (exec && !proc_is_exec(proc, exec))
 			continue;
-		xasprintf(&buffer, "/proc/%d/ns/pid", p);
-		if (exists(buffer)) {
-			rc = readlink(buffer, proc_ns, sizeof(proc_ns)-1);
-			if (rc <= 0)
-				proc_ns[0] = '\0';
-		}
-		free(buffer);
-		if (pid == 0 && strlen(my_ns) && strlen (proc_ns) && strcmp(my_ns, proc_ns))
+		if (uid && !proc_is_uid(proc, uid))
 			continue;
-		if (uid) {
-			xasprintf(&buffer, "/proc/%d", p);
-			if (stat(buffer, &sb) != 0 || sb.st_uid != uid) {
-				free(buffer);
-				continue;
-			}
-			free(buffer);
-		}
-		if (exec && !pid_is_exec(p, exec))
+		if (pid == 0 && !proc_in_ns(proc))
 			continue;
-		if (argv &&
-		    !pid_is_argv(p, (const char *const *)argv))
+		if (argv && !proc_is_argv(proc, argv))
 			continue;
-		/* If this is an OpenVZ host, filter out container processes */
-		if (openvz_host) {
-			xasprintf(&buffer, "/proc/%d/status", p);
-			if (exists(buffer)) {
-				fp = fopen(buffer, "r");
-				free(buffer);
-				if (!fp)
-					continue;
-				while (xgetline(&line, &len, fp) != -1) {
-					if (strncmp(line, "envID:", 6) == 0) {
-						container_pid = !(strncmp(line, "envID:\t0", 8) == 0);
-						break;
-					}
-				}
-				fclose(fp);
-			}
-		}
-		if (container_pid)
+		if (openvz_host() && proc_in_container(proc))
 			continue;
 		if (!pids) {
 			pids = xmalloc(sizeof(*pids));
 			LIST_INIT(pids);
 		}
 		pi = xmalloc(sizeof(*pi));
-		pi->pid = p;
+		pi->pid = proc->pid;
 		LIST_INSERT_HEAD(pids, pi, entries);
 	}
-	if (line != NULL)
-		free(line);
-	closedir(procdir);
+	return pids;
+}
+
+void
+rc_procs_free(RC_PROCS *procs)
+{
+	size_t i;
+
+	if (!procs)
+		return;
+	for (i = 0; i < procs->count; i++) {
+		free(procs->procs[i].comm);
+		free(procs->procs[i].cmdline);
+	}
+	free(procs->procs);
+	free(procs);
+}
+
+RC_PIDLIST *
+rc_find_pids(const char *exec, const char *const *argv, uid_t uid, pid_t pid)
+{
+	RC_PROCS *procs = procs_load(pid);
+	RC_PIDLIST *pids = rc_procs_find(procs, exec, argv, uid, pid);
+
+	rc_procs_free(procs);
 	return pids;
 }
 
@@ -250,43 +429,67 @@ rc_find_pids(const char *exec, const char *const *argv, uid_t uid, pid_t pid)
 #  define _KVM_FLAGS O_RDONLY
 # endif
 
-RC_PIDLIST *
-rc_find_pids(const char *exec, const char *const *argv, uid_t uid, pid_t pid)
+struct rc_procs {
+	kvm_t *kd;
+	struct _KINFO_PROC *kp;
+	int processes;
+};
+
+/* kvm hands us every process at once, so we keep it open until the
+ * searches are done as they may need argv from it */
+RC_PROCS *
+rc_procs_load(void)
 {
-	static kvm_t *kd = NULL;
 	char errbuf[_POSIX2_LINE_MAX];
-	struct _KINFO_PROC *kp;
-	int i;
-	int processes = 0;
-	int pargc = 0;
-	char **pargv;
-	RC_PIDLIST *pids = NULL;
-	RC_PID *pi;
-	pid_t p;
-	const char *const *arg;
-	int match;
+	RC_PROCS *procs = xmalloc(sizeof(*procs));
 
-	if ((kd = kvm_openfiles(_KVM_PATH, _KVM_PATH,
+	procs->processes = 0;
+	if ((procs->kd = kvm_openfiles(_KVM_PATH, _KVM_PATH,
 		    NULL, _KVM_FLAGS, errbuf)) == NULL)
 	{
 		fprintf(stderr, "kvm_open: %s\n", errbuf);
+		free(procs);
 		return NULL;
 	}
 
 #ifdef _KVM_GETPROC2
-	kp = kvm_getproc2(kd, KERN_PROC_ALL, 0, sizeof(*kp), &processes);
+	procs->kp = kvm_getproc2(procs->kd, KERN_PROC_ALL, 0,
+	    sizeof(*procs->kp), &procs->processes);
 #else
-	kp = kvm_getprocs(kd, KERN_PROC_PROC, 0, &processes);
+	procs->kp = kvm_getprocs(procs->kd, KERN_PROC_PROC, 0, &procs->processes);
 #endif
-	if ((kp == NULL && processes > 0) || (kp != NULL && processes < 0)) {
-		fprintf(stderr, "kvm_getprocs: %s\n", kvm_geterr(kd));
-		kvm_close(kd);
+	if ((procs->kp == NULL && procs->processes > 0) ||
+	    (procs->kp != NULL && procs->processes < 0))
+	{
+		fprintf(stderr, "kvm_getprocs: %s\n", kvm_geterr(procs->kd));
+		kvm_close(procs->kd);
+		free(procs);
 		return NULL;
 	}
+	return procs;
+}
 
+RC_PIDLIST *
+rc_procs_find(RC_PROCS *procs, const char *exec, const char *const *argv,
+    uid_t uid, pid_t pid)
+{
+	struct _KINFO_PROC *kp;
+	int i;
+	int pargc = 0;
+	char **pargv;
+	RC_PIDLIST *pids = NULL;
+	RC_PID *pi;
+	pid_t p;
+	const char *const *arg;
+	int match;
+
+	if (!procs)
+		return NULL;
+
+	kp = procs->kp;
 	if (exec)
 		exec = basename_c(exec);
-	for (i = 0; i < processes; i++) {
+	for (i = 0; i < procs->processes; i++) {
 		p = _GET_KINFO_PID(kp[i]);
 		if (pid != 0 && pid != p)
 			continue;
@@ -298,7 +501,7 @@ rc_find_pids(const char *exec, const char *const *argv, uid_t uid, pid_t pid)
 				continue;
 		}
 		if (argv && *argv) {
-			pargv = _KVM_GETARGV(kd, &kp[i], pargc);
+			pargv = _KVM_GETARGV(procs->kd, &kp[i], pargc);
 			if (!pargv || !*pargv)
 				continue;
 			arg = argv;
@@ -319,11 +522,29 @@ rc_find_pids(const char *exec, const char *const *argv, uid_t uid, pid_t pid)
 		pi->pid = p;
 		LIST_INSERT_HEAD(pids, pi, entries);
 	}
-	kvm_close(kd);
 
 	return pids;
 }
 
+void
+rc_procs_free(RC_PROCS *procs)
+{
+	if (!procs)
+		return;
+	kvm_close(procs->kd);
+	free(procs);
+}
+
+RC_PIDLIST *
+rc_find_pids(const char *exec, const char *const *argv, uid_t uid, pid_t pid)
+{
+	RC_PROCS *procs = rc_procs_load();
+	RC_PIDLIST *pids = rc_procs_find(procs, exec, argv, uid, pid);
+
+	rc_procs_free(procs);
+	return pids;
+}
+
 #else
 #  error "Platform not supported!"
 #endif
@@ -529,6 +750,7 @@ rc_service_daemons_crashed(const char *service)
 	char *name = NULL;
 	char *pidfile = NULL;
 	pid_t pid = 0;
+	RC_PROCS *procs = NULL;
 	RC_PIDLIST *pids;
 	RC_PID *p1;
 	RC_PID *p2;
@@ -636,11 +858,15 @@ rc_service_daemons_crashed(const char *service)
 			}
 		}
 
+		/* Each daemon without a pidfile is looked for in the
+		 * same list of processes */
+		if (!retval && pid == 0 && !procs)
+			procs = rc_procs_load();
 		if (!retval) {
 			if (pid != 0) {
 				if (kill(pid, 0) == -1 && errno == ESRCH)
 					retval = true;
-			} else if ((pids = rc_find_pids(exec,
+			} else if ((pids = rc_procs_find(procs, exec,
 				    (const char *const *)argv,
 				    0, pid)))
 			{
@@ -667,6 +893,7 @@ rc_service_daemons_crashed(const char *service)
 	}
 	closedir(dp);
 	free(line);
+	rc_procs_free(procs);
 
 	return retval;
 }
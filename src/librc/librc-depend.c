@@ -15,12 +15,21 @@
  *    except according to the terms contained in the LICENSE file.
  */
 
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/utsname.h>
+#include <sys/wait.h>
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,6 +44,8 @@
 
 #define GENDEP          RC_LIBEXECDIR "/sh/gendepends.sh"
 
+extern char **environ;
+
 static const char *bootlevel = NULL;
 
 static char *
@@ -61,6 +72,88 @@ get_shell_value(char *string)
 	return NULL;
 }
 
+static const char *const deptype_names[RC_DEPTYPE_MAX] = {
+	[RC_DEPTYPE_INEED]      = "ineed",
+	[RC_DEPTYPE_NEEDSME]    = "needsme",
+	[RC_DEPTYPE_IUSE]       = "iuse",
+	[RC_DEPTYPE_USESME]     = "usesme",
+	[RC_DEPTYPE_IWANT]      = "iwant",
+	[RC_DEPTYPE_WANTSME]    = "wantsme",
+	[RC_DEPTYPE_IAFTER]     = "iafter",
+	[RC_DEPTYPE_IBEFORE]    = "ibefore",
+	[RC_DEPTYPE_IPROVIDE]   = "iprovide",
+	[RC_DEPTYPE_PROVIDEDBY] = "providedby",
+	[RC_DEPTYPE_KEYWORD]    = "keyword",
+	[RC_DEPTYPE_BROKEN]     = "broken",
+};
+
+#define DEPTREE_HASH_SIZE	64
+
+/* The binary deptree cache sits next to the text one and can be used
+ * straight from a read only mapping. All integers are in host byte order,
+ * so a cache from a different architecture fails the magic check.
+ * The file is laid out as
+ *   header
+ *   service records
+ *   type records
+ *   entries, each an offset into the string table
+ *   string table of NUL terminated strings
+ * Bump the version whenever the layout or RC_DEPTYPE_ID changes. */
+#define DEPTREE_BIN_MAGIC	0x54444352	/* RCDT */
+#define DEPTREE_BIN_VERSION	1
+
+struct deptree_bin_header {
+	uint32_t magic;
+	uint32_t version;
+	/* FNV-1a of everything after the header */
+	uint32_t checksum;
+	uint32_t services;
+	uint32_t types;
+	uint32_t entries;
+	/* size of the string table in bytes */
+	uint32_t strings;
+	uint32_t reserved;
+};
+
+struct deptree_bin_service {
+	uint32_t name;
+	/* index of the first type record and how many there are */
+	uint32_t type;
+	uint32_t ntypes;
+};
+
+struct deptree_bin_type {
+	uint32_t name;
+	uint32_t id;
+	/* index of the first entry and how many there are */
+	uint32_t entry;
+	uint32_t nentries;
+};
+
+static RC_DEPTYPE_ID
+deptype_id(const char *type)
+{
+	int i;
+
+	for (i = 0; i < RC_DEPTYPE_MAX; i++)
+		if (strcmp(deptype_names[i], type) == 0)
+			return i;
+	return RC_DEPTYPE_OTHER;
+}
+
+/* FNV-1a, which is plenty for service names */
+static size_t
+hash_service(const char *service)
+{
+	size_t hash = 2166136261U;
+
+	for (; *service; service++) {
+		hash ^= (unsigned char)*service;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
 void
 rc_deptree_free(RC_DEPTREE *deptree)
 {
@@ -72,28 +165,92 @@ rc_deptree_free(RC_DEPTREE *deptree)
 	if (!deptree)
 		return;
 
-	TAILQ_FOREACH_SAFE(di, deptree, entries, di_save) {
+	/* Trees loaded from the binary cache point into the mapping */
+	if (deptree->arena) {
+		free(deptree->arena);
+		munmap(deptree->map, deptree->map_size);
+		free(deptree->hash);
+		free(deptree);
+		return;
+	}
+
+	TAILQ_FOREACH_SAFE(di, &deptree->services, entries, di_save) {
 		TAILQ_FOREACH_SAFE(dt, &di->depends, entries, dt_save) {
 			TAILQ_REMOVE(&di->depends, dt, entries);
 			rc_stringlist_free(dt->services);
 			free(dt->type);
 			free(dt);
 		}
-		TAILQ_REMOVE(deptree, di, entries);
+		TAILQ_REMOVE(&deptree->services, di, entries);
 		free(di->service);
 		free(di);
 	}
 
 	/* Use free() here since rc_deptree_free should not call itself */
+	free(deptree->hash);
 	free(deptree);
 }
 
+/* Services with the same name keep the order they were added in, so a
+ * lookup always finds the first one, just like walking the list would. */
+static void
+hash_depinfo(RC_DEPINFO **hash, size_t hash_size, RC_DEPINFO *depinfo)
+{
+	RC_DEPINFO **slot = &hash[hash_service(depinfo->service) & (hash_size - 1)];
+
+	while (*slot)
+		slot = &(*slot)->hash_next;
+	depinfo->hash_next = NULL;
+	*slot = depinfo;
+}
+
+static void
+unhash_depinfo(RC_DEPTREE *deptree, RC_DEPINFO *depinfo)
+{
+	RC_DEPINFO **slot = &deptree->hash[hash_service(depinfo->service) &
+	    (deptree->hash_size - 1)];
+
+	for (; *slot; slot = &(*slot)->hash_next) {
+		if (*slot == depinfo) {
+			*slot = depinfo->hash_next;
+			break;
+		}
+	}
+}
+
+static void
+rehash_deptree(RC_DEPTREE *deptree, size_t size)
+{
+	RC_DEPINFO *di;
+
+	free(deptree->hash);
+	deptree->hash = xmalloc(sizeof(*deptree->hash) * size);
+	memset(deptree->hash, 0, sizeof(*deptree->hash) * size);
+	deptree->hash_size = size;
+	TAILQ_FOREACH(di, &deptree->services, entries)
+		hash_depinfo(deptree->hash, size, di);
+}
+
+static void
+add_depinfo(RC_DEPTREE *deptree, RC_DEPINFO *depinfo)
+{
+	depinfo->index = deptree->count++;
+	TAILQ_INSERT_TAIL(&deptree->services, depinfo, entries);
+
+	if (deptree->count > deptree->hash_size)
+		rehash_deptree(deptree, deptree->hash_size * 2);
+	else
+		hash_depinfo(deptree->hash, deptree->hash_size, depinfo);
+}
+
 static RC_DEPINFO *
 get_depinfo(const RC_DEPTREE *deptree, const char *service)
 {
 	RC_DEPINFO *di;
+
 	if (deptree) {
-		TAILQ_FOREACH(di, deptree, entries)
+		di = deptree->hash[hash_service(service) & (deptree->hash_size - 1)];
+		for (; di; di = di->hash_next)
 			if (strcmp(di->service, service) == 0)
 				return di;
 	}
@@ -105,17 +262,30 @@ make_depinfo(RC_DEPTREE *deptree, const char *service)
 {
 	RC_DEPINFO *depinfo = xmalloc(sizeof(*depinfo));
 	TAILQ_INIT(&depinfo->depends);
+	memset(depinfo->types, 0, sizeof(depinfo->types));
 	depinfo->service = xstrdup(service);
-	TAILQ_INSERT_TAIL(deptree, depinfo, entries);
+	add_depinfo(deptree, depinfo);
 
 	return depinfo;
 }
 
+static RC_DEPTYPE *
+get_deptype_id(const RC_DEPINFO *depinfo, RC_DEPTYPE_ID id)
+{
+	if (depinfo && id != RC_DEPTYPE_OTHER)
+		return depinfo->types[id];
+	return NULL;
+}
+
 static RC_DEPTYPE *
 get_deptype(const RC_DEPINFO *depinfo, const char *type)
 {
+	RC_DEPTYPE_ID id = deptype_id(type);
 	RC_DEPTYPE *dt;
 
+	if (id != RC_DEPTYPE_OTHER)
+		return get_deptype_id(depinfo, id);
+
 	if (depinfo) {
 		TAILQ_FOREACH(dt, &depinfo->depends, entries)
 			if (strcmp(dt->type, type) == 0)
@@ -129,29 +299,301 @@ make_deptype(RC_DEPINFO *depinfo, const char *type)
 {
 	RC_DEPTYPE *deptype = xmalloc(sizeof(*deptype));
 	deptype->type = xstrdup(type);
+	deptype->id = deptype_id(type);
 	deptype->services = rc_stringlist_new();
 	TAILQ_INSERT_TAIL(&depinfo->depends, deptype, entries);
+	if (deptype->id != RC_DEPTYPE_OTHER)
+		depinfo->types[deptype->id] = deptype;
 
 	return deptype;
 }
 
+static RC_DEPTYPE *
+make_deptype_id(RC_DEPINFO *depinfo, RC_DEPTYPE_ID id)
+{
+	return make_deptype(depinfo, deptype_names[id]);
+}
+
 #ifdef HAVE_MALLOC_EXTENDED_ATTRIBUTE
 __attribute__ ((malloc (rc_deptree_free, 1)))
 #endif
 static RC_DEPTREE *
 make_deptree(void) {
 	RC_DEPTREE *deptree = xmalloc(sizeof(*deptree));
-	TAILQ_INIT(deptree);
+	TAILQ_INIT(&deptree->services);
+	deptree->hash_size = DEPTREE_HASH_SIZE;
+	deptree->hash = xmalloc(sizeof(*deptree->hash) * deptree->hash_size);
+	memset(deptree->hash, 0, sizeof(*deptree->hash) * deptree->hash_size);
+	deptree->count = 0;
+	deptree->map = NULL;
+	deptree->map_size = 0;
+	deptree->arena = NULL;
+	return deptree;
+}
+
+/* Check the mapped cache is sane before we point anything into it */
+static bool
+check_binary(const unsigned char *map, size_t size)
+{
+	const struct deptree_bin_header *hdr = (const void *)map;
+	const struct deptree_bin_service *svcs;
+	const struct deptree_bin_type *types;
+	const uint32_t *entries;
+	const char *strings;
+	uint64_t len;
+	uint32_t i;
+
+	if (size < sizeof(*hdr) ||
+	    hdr->magic != DEPTREE_BIN_MAGIC ||
+	    hdr->version != DEPTREE_BIN_VERSION)
+		return false;
+
+	len = sizeof(*hdr) +
+	    (uint64_t)hdr->services * sizeof(*svcs) +
+	    (uint64_t)hdr->types * sizeof(*types) +
+	    (uint64_t)hdr->entries * sizeof(*entries) +
+	    hdr->strings;
+	if (len != size)
+		return false;
+	if (checksum_update(2166136261U, map + sizeof(*hdr),
+		    size - sizeof(*hdr)) != hdr->checksum)
+		return false;
+
+	svcs = (const void *)(map + sizeof(*hdr));
+	types = (const void *)(svcs + hdr->services);
+	entries = (const void *)(types + hdr->types);
+	strings = (const char *)(entries + hdr->entries);
+	if (hdr->strings == 0 || strings[hdr->strings - 1] != '\0')
+		return false;
+
+	for (i = 0; i < hdr->services; i++)
+		if (svcs[i].name >= hdr->strings ||
+		    (uint64_t)svcs[i].type + svcs[i].ntypes > hdr->types)
+			return false;
+	for (i = 0; i < hdr->types; i++)
+		if (types[i].name >= hdr->strings ||
+		    types[i].id > RC_DEPTYPE_OTHER ||
+		    (uint64_t)types[i].entry + types[i].nentries > hdr->entries)
+			return false;
+	for (i = 0; i < hdr->entries; i++)
+		if (entries[i] >= hdr->strings)
+			return false;
+	return true;
+}
+
+/* Build a deptree on top of the binary cache.
+ * Every node lives in one allocation and every string points into the
+ * mapping, so there is nothing to parse or copy per entry. */
+static RC_DEPTREE *
+load_binary(int fd)
+{
+	const struct deptree_bin_header *hdr;
+	const struct deptree_bin_service *svcs;
+	const struct deptree_bin_type *types;
+	const uint32_t *entries;
+	char *strings;
+	RC_DEPTREE *deptree;
+	RC_DEPINFO *depinfos;
+	RC_DEPTYPE *deptypes;
+	RC_STRINGLIST *lists;
+	RC_STRING *values;
+	RC_DEPINFO *di;
+	RC_DEPTYPE *dt;
+	struct stat st;
+	unsigned char *map;
+	size_t size, hash_size;
+	uint32_t i, j, k;
+
+	if (fstat(fd, &st) != 0 || st.st_size <= 0)
+		return NULL;
+	size = st.st_size;
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+	if (!check_binary(map, size)) {
+		munmap(map, size);
+		return NULL;
+	}
+
+	hdr = (const void *)map;
+	svcs = (const void *)(map + sizeof(*hdr));
+	types = (const void *)(svcs + hdr->services);
+	entries = (const void *)(types + hdr->types);
+	strings = UNCONST(entries + hdr->entries);
+
+	deptree = make_deptree();
+	deptree->map = map;
+	deptree->map_size = size;
+	deptree->arena = xmalloc(sizeof(*depinfos) * hdr->services +
+	    sizeof(*deptypes) * hdr->types +
+	    sizeof(*lists) * hdr->types +
+	    sizeof(*values) * hdr->entries + 1);
+	depinfos = deptree->arena;
+	deptypes = (RC_DEPTYPE *)(depinfos + hdr->services);
+	lists = (RC_STRINGLIST *)(deptypes + hdr->types);
+	values = (RC_STRING *)(lists + hdr->types);
+
+	for (hash_size = deptree->hash_size; hash_size < hdr->services;)
+		hash_size *= 2;
+	if (hash_size != deptree->hash_size)
+		rehash_deptree(deptree, hash_size);
+
+	for (i = 0; i < hdr->services; i++) {
+		di = &depinfos[i];
+		di->service = strings + svcs[i].name;
+		TAILQ_INIT(&di->depends);
+		memset(di->types, 0, sizeof(di->types));
+		for (j = svcs[i].type; j < svcs[i].type + svcs[i].ntypes; j++) {
+			dt = &deptypes[j];
+			dt->type = strings + types[j].name;
+			dt->id = types[j].id;
+			dt->services = &lists[j];
+			TAILQ_INIT(dt->services);
+			for (k = types[j].entry; k < types[j].entry + types[j].nentries; k++) {
+				values[k].value = strings + entries[k];
+				TAILQ_INSERT_TAIL(dt->services, &values[k], entries);
+			}
+			TAILQ_INSERT_TAIL(&di->depends, dt, entries);
+			if (dt->id != RC_DEPTYPE_OTHER)
+				di->types[dt->id] = dt;
+		}
+		add_depinfo(deptree, di);
+	}
+
 	return deptree;
 }
 
+/* Write the binary cache for deptree to file.
+ * Service names are stored once and shared by every entry naming them. */
+static bool
+save_binary(const RC_DEPTREE *deptree, const char *file)
+{
+	struct deptree_bin_header hdr;
+	struct deptree_bin_service *svcs;
+	struct deptree_bin_type *types;
+	uint32_t *entries, *names, type_names[RC_DEPTYPE_MAX];
+	struct strtab strtab = { NULL, 0, 0 };
+	RC_DEPINFO *depinfo, *di;
+	RC_DEPTYPE *deptype;
+	RC_STRING *s;
+	size_t nsvcs = 0, ntypes = 0, nentries = 0;
+	size_t i = 0, t = 0, e = 0;
+	char *tmp;
+	FILE *fp;
+	bool failed;
+	bool retval = false;
+
+	TAILQ_FOREACH(depinfo, &deptree->services, entries) {
+		nsvcs++;
+		TAILQ_FOREACH(deptype, &depinfo->depends, entries) {
+			ntypes++;
+			TAILQ_FOREACH(s, deptype->services, entries)
+				nentries++;
+		}
+	}
+
+	svcs = xmalloc(sizeof(*svcs) * (nsvcs + 1));
+	types = xmalloc(sizeof(*types) * (ntypes + 1));
+	entries = xmalloc(sizeof(*entries) * (nentries + 1));
+	names = xmalloc(sizeof(*names) * (deptree->count + 1));
+
+	for (i = 0; i < RC_DEPTYPE_MAX; i++)
+		type_names[i] = strtab_add(&strtab, deptype_names[i]);
+	TAILQ_FOREACH(depinfo, &deptree->services, entries)
+		names[depinfo->index] = strtab_add(&strtab, depinfo->service);
+
+	i = 0;
+	TAILQ_FOREACH(depinfo, &deptree->services, entries) {
+		svcs[i].name = names[depinfo->index];
+		svcs[i].type = t;
+		svcs[i].ntypes = 0;
+		TAILQ_FOREACH(deptype, &depinfo->depends, entries) {
+			if (deptype->id != RC_DEPTYPE_OTHER)
+				types[t].name = type_names[deptype->id];
+			else
+				types[t].name = strtab_add(&strtab, deptype->type);
+			types[t].id = deptype->id;
+			types[t].entry = e;
+			types[t].nentries = 0;
+			TAILQ_FOREACH(s, deptype->services, entries) {
+				if ((di = get_depinfo(deptree, s->value)))
+					entries[e] = names[di->index];
+				else
+					entries[e] = strtab_add(&strtab, s->value);
+				types[t].nentries++;
+				e++;
+			}
+			svcs[i].ntypes++;
+			t++;
+		}
+		i++;
+	}
+
+	if (strtab.len > UINT32_MAX) {
+		errno = EFBIG;
+		goto out;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = DEPTREE_BIN_MAGIC;
+	hdr.version = DEPTREE_BIN_VERSION;
+	hdr.services = nsvcs;
+	hdr.types = ntypes;
+	hdr.entries = nentries;
+	hdr.strings = strtab.len;
+	hdr.checksum = checksum_update(2166136261U, svcs, sizeof(*svcs) * nsvcs);
+	hdr.checksum = checksum_update(hdr.checksum, types, sizeof(*types) * ntypes);
+	hdr.checksum = checksum_update(hdr.checksum, entries, sizeof(*entries) * nentries);
+	hdr.checksum = checksum_update(hdr.checksum, strtab.buf, strtab.len);
+
+	/* Readers may map the cache at any time, so replace it atomically */
+	xasprintf(&tmp, "%s.tmp", file);
+	if ((fp = fopen(tmp, "w"))) {
+		fwrite(&hdr, sizeof(hdr), 1, fp);
+		fwrite(svcs, sizeof(*svcs), nsvcs, fp);
+		fwrite(types, sizeof(*types), ntypes, fp);
+		fwrite(entries, sizeof(*entries), nentries, fp);
+		fwrite(strtab.buf, 1, strtab.len, fp);
+		failed = ferror(fp);
+		if (fclose(fp) != 0 || failed || rename(tmp, file) != 0)
+			unlink(tmp);
+		else
+			retval = true;
+	}
+	free(tmp);
+
+out:
+	free(strtab.buf);
+	free(names);
+	free(entries);
+	free(types);
+	free(svcs);
+	return retval;
+}
+
 RC_DEPTREE *
 rc_deptree_load(void) {
-	char *deptree_cache;
-	RC_DEPTREE *deptree;
+	char *deptree_cache, *deptree_bin;
+	RC_DEPTREE *deptree = NULL;
+	struct stat text, bin;
+	int fd;
 
 	xasprintf(&deptree_cache, "%s/deptree", rc_svcdir());
-	deptree = rc_deptree_load_file(deptree_cache);
+	xasprintf(&deptree_bin, "%s/deptree.bin", rc_svcdir());
+
+	/* Only trust the binary cache if the text one has not been
+	 * written since */
+	if ((fd = open(deptree_bin, O_RDONLY | O_CLOEXEC)) != -1) {
+		if (fstat(fd, &bin) == 0 &&
+		    stat(deptree_cache, &text) == 0 &&
+		    bin.st_mtime >= text.st_mtime)
+			deptree = load_binary(fd);
+		close(fd);
+	}
+	if (!deptree)
+		deptree = rc_deptree_load_file(deptree_cache);
+
+	free(deptree_bin);
 	free(deptree_cache);
 
 	return deptree;
@@ -170,10 +612,20 @@ rc_deptree_load_file(const char *deptree_file)
 	char *p;
 	char *e;
 	int i;
+	uint32_t magic;
 
 	if (!(fp = fopen(deptree_file, "r")))
 		return NULL;
 
+	if (fread(&magic, sizeof(magic), 1, fp) == 1 &&
+	    magic == DEPTREE_BIN_MAGIC)
+	{
+		deptree = load_binary(fileno(fp));
+		fclose(fp);
+		return deptree;
+	}
+	rewind(fp);
+
 	deptree = make_deptree();
 	while (xgetline(&line, &size, fp) != -1) {
 		p = line;
@@ -212,15 +664,15 @@ rc_deptree_load_file(const char *deptree_file)
 }
 
 static bool
-valid_service(const char *runlevel, const char *service, const char *type)
+valid_service(const char *runlevel, const char *service, RC_DEPTYPE_ID type)
 {
 	RC_SERVICE state;
 
 	if (!runlevel ||
-	    strcmp(type, "ineed") == 0 ||
-	    strcmp(type, "needsme") == 0  ||
-	    strcmp(type, "iwant") == 0 ||
-	    strcmp(type, "wantsme") == 0)
+	    type == RC_DEPTYPE_INEED ||
+	    type == RC_DEPTYPE_NEEDSME ||
+	    type == RC_DEPTYPE_IWANT ||
+	    type == RC_DEPTYPE_WANTSME)
 		return true;
 
 	if (rc_service_in_runlevel(service, runlevel))
@@ -228,7 +680,7 @@ valid_service(const char *runlevel, const char *service, const char *type)
 	if (strcmp(runlevel, RC_LEVEL_SYSINIT) == 0)
 		    return false;
 	if (strcmp(runlevel, RC_LEVEL_SHUTDOWN) == 0 &&
-	    strcmp(type, "iafter") == 0)
+	    type == RC_DEPTYPE_IAFTER)
 		    return false;
 	if (strcmp(runlevel, bootlevel) != 0) {
 		if (rc_service_in_runlevel(service, bootlevel))
@@ -306,7 +758,7 @@ get_provided(const RC_DEPINFO *depinfo, const char *runlevel, int options)
 	RC_STRINGLIST *providers = rc_stringlist_new();
 	RC_STRING *service;
 
-	dt = get_deptype(depinfo, "providedby");
+	dt = get_deptype_id(depinfo, RC_DEPTYPE_PROVIDEDBY);
 	if (!dt)
 		return providers;
 
@@ -390,11 +842,39 @@ get_provided(const RC_DEPINFO *depinfo, const char *runlevel, int options)
 	return providers;
 }
 
+/* Resolve a list of type names to their slots once, so we don't have
+ * to compare strings for every service we visit */
+static RC_DEPTYPE_ID *
+get_deptype_ids(const RC_STRINGLIST *types)
+{
+	const RC_STRING *type;
+	RC_DEPTYPE_ID *ids;
+	size_t i = 0;
+
+	TAILQ_FOREACH(type, types, entries)
+		i++;
+	ids = xmalloc(sizeof(*ids) * (i + 1));
+	i = 0;
+	TAILQ_FOREACH(type, types, entries)
+		ids[i++] = deptype_id(type->value);
+	return ids;
+}
+
+static bool *
+make_visited(const RC_DEPTREE *deptree)
+{
+	bool *visited = xmalloc(sizeof(*visited) * (deptree->count + 1));
+
+	memset(visited, 0, sizeof(*visited) * (deptree->count + 1));
+	return visited;
+}
+
 static void
 visit_service(const RC_DEPTREE *deptree,
 	      const RC_STRINGLIST *types,
+	      const RC_DEPTYPE_ID *type_ids,
 	      RC_STRINGLIST *sorted,
-	      RC_STRINGLIST *visited,
+	      bool *visited,
 	      const RC_DEPINFO *depinfo,
 	      const char *runlevel, int options)
 {
@@ -405,22 +885,28 @@ visit_service(const RC_DEPTREE *deptree,
 	RC_STRINGLIST *provided;
 	RC_STRING *p;
 	const char *svcname;
+	size_t i = 0;
 
 	/* Check if we have already visited this service or not */
-	TAILQ_FOREACH(type, visited, entries)
-		if (strcmp(type->value, depinfo->service) == 0)
-			return;
+	if (visited[depinfo->index])
+		return;
 	/* Add ourselves as a visited service */
-	rc_stringlist_add(visited, depinfo->service);
+	visited[depinfo->index] = true;
 
 	TAILQ_FOREACH(type, types, entries)
 	{
-		if (!(dt = get_deptype(depinfo, type->value)))
+		RC_DEPTYPE_ID id = type_ids[i++];
+
+		if (id != RC_DEPTYPE_OTHER)
+			dt = get_deptype_id(depinfo, id);
+		else
+			dt = get_deptype(depinfo, type->value);
+		if (!dt)
 			continue;
 
 		TAILQ_FOREACH(service, dt->services, entries) {
 			if (!(options & RC_DEP_TRACE) ||
-			    strcmp(type->value, "iprovide") == 0)
+			    id == RC_DEPTYPE_IPROVIDE)
 			{
 				rc_stringlist_add(sorted, service->value);
 				continue;
@@ -433,14 +919,15 @@ visit_service(const RC_DEPTREE *deptree,
 			if (TAILQ_FIRST(provided)) {
 				TAILQ_FOREACH(p, provided, entries) {
 					di = get_depinfo(deptree, p->value);
-					if (di && valid_service(runlevel, di->service, type->value))
-						visit_service(deptree, types, sorted, visited, di,
-							      runlevel, options | RC_DEP_TRACE);
+					if (di && valid_service(runlevel, di->service, id))
+						visit_service(deptree, types, type_ids, sorted,
+							      visited, di, runlevel,
+							      options | RC_DEP_TRACE);
 				}
 			}
-			else if (di && valid_service(runlevel, service->value, type->value))
-				visit_service(deptree, types, sorted, visited, di,
-					      runlevel, options | RC_DEP_TRACE);
+			else if (di && valid_service(runlevel, service->value, id))
+				visit_service(deptree, types, type_ids, sorted, visited,
+					      di, runlevel, options | RC_DEP_TRACE);
 
 			rc_stringlist_free(provided);
 		}
@@ -448,7 +935,7 @@ visit_service(const RC_DEPTREE *deptree,
 
 	/* Now visit the stuff we provide for */
 	if (options & RC_DEP_TRACE &&
-	    (dt = get_deptype(depinfo, "iprovide")))
+	    (dt = get_deptype_id(depinfo, RC_DEPTYPE_IPROVIDE)))
 	{
 		TAILQ_FOREACH(service, dt->services, entries) {
 			if (!(di = get_depinfo(deptree, service->value)))
@@ -456,8 +943,9 @@ visit_service(const RC_DEPTREE *deptree,
 			provided = get_provided(di, runlevel, options);
 			TAILQ_FOREACH(p, provided, entries)
 				if (strcmp(p->value, depinfo->service) == 0) {
-					visit_service(deptree, types, sorted, visited, di,
-						       runlevel, options | RC_DEP_TRACE);
+					visit_service(deptree, types, type_ids, sorted,
+						      visited, di, runlevel,
+						      options | RC_DEP_TRACE);
 					break;
 				}
 			rc_stringlist_free(provided);
@@ -468,7 +956,7 @@ visit_service(const RC_DEPTREE *deptree,
 	   are also the service calling us or we are provided by something */
 	svcname = getenv("RC_SVCNAME");
 	if (!svcname || strcmp(svcname, depinfo->service) != 0) {
-		if (!get_deptype(depinfo, "providedby"))
+		if (!get_deptype_id(depinfo, RC_DEPTYPE_PROVIDEDBY))
 			rc_stringlist_add(sorted, depinfo->service);
 	}
 }
@@ -503,23 +991,29 @@ rc_deptree_depends(const RC_DEPTREE *deptree,
 		   const char *runlevel, int options)
 {
 	RC_STRINGLIST *sorted = rc_stringlist_new();
-	RC_STRINGLIST *visited = rc_stringlist_new();
+	RC_DEPTYPE_ID *type_ids = NULL;
+	bool *visited = NULL;
 	RC_DEPINFO *di;
 	const RC_STRING *service;
 
 	bootlevel = getenv("RC_BOOTLEVEL");
 	if (!bootlevel)
 		bootlevel = RC_LEVEL_BOOT;
+	if (types && deptree) {
+		type_ids = get_deptype_ids(types);
+		visited = make_visited(deptree);
+	}
 	TAILQ_FOREACH(service, services, entries) {
 		if (!(di = get_depinfo(deptree, service->value))) {
 			errno = ENOENT;
 			continue;
 		}
 		if (types)
-			visit_service(deptree, types, sorted, visited,
+			visit_service(deptree, types, type_ids, sorted, visited,
 				      di, runlevel, options);
 	}
-	rc_stringlist_free(visited);
+	free(visited);
+	free(type_ids);
 	return sorted;
 }
 
@@ -579,6 +1073,104 @@ rc_deptree_order(const RC_DEPTREE *deptree, const char *runlevel, int options)
 }
 
 
+/* How many gendepends.sh or tree walks to run at once, rc_depend_jobs or
+ * one per CPU */
+static size_t
+depend_jobs(void)
+{
+	const char *value = rc_conf_value("rc_depend_jobs");
+	long jobs = 0;
+
+	if (value)
+		jobs = strtol(value, NULL, 10);
+	if (jobs <= 0)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	return jobs > 0 ? (size_t)jobs : 1;
+}
+
+/* A walk of one tree for files older (or newer) than a time, as
+ * deep_mtime_check does */
+struct mtime_walk {
+	const char *target;
+	bool newer;
+	time_t rel;
+	bool found;
+	char file[PATH_MAX];
+	/* Where we are, which we only need to say which file it was */
+	char path[PATH_MAX];
+	size_t len;
+	/* Symlinks followed to get there, which stat() would stop at */
+	int links;
+};
+
+#ifndef MAXSYMLINKS
+#  define MAXSYMLINKS 40
+#endif
+
+static void
+mtime_walk_at(struct mtime_walk *walk, int at, const char *name)
+{
+	struct stat buf;
+	struct dirent *d;
+	DIR *dp;
+	size_t len = walk->len, n;
+	int fd;
+
+	/* If target does not exist, carry on to mimic shell test */
+	if (walk->links > MAXSYMLINKS || fstatat(at, name, &buf, 0) != 0)
+		return;
+
+	if (walk->newer ? walk->rel < buf.st_mtime : walk->rel > buf.st_mtime) {
+		walk->found = true;
+		walk->rel = buf.st_mtime;
+		memcpy(walk->file, walk->path, len + 1);
+	}
+
+	if (!S_ISDIR(buf.st_mode))
+		return;
+	fd = openat(at, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		return;
+	if (!(dp = fdopendir(fd))) {
+		close(fd);
+		return;
+	}
+
+	/* Check all the entries in the dir */
+	while ((d = readdir(dp))) {
+		if (d->d_name[0] == '.')
+			continue;
+		n = strlen(d->d_name);
+		if (len + 1 + n >= sizeof(walk->path))
+			continue;
+		walk->path[len] = '/';
+		memcpy(walk->path + len + 1, d->d_name, n + 1);
+		walk->len = len + 1 + n;
+		if (d->d_type == DT_LNK)
+			walk->links++;
+		mtime_walk_at(walk, dirfd(dp), d->d_name);
+		if (d->d_type == DT_LNK)
+			walk->links--;
+	}
+	walk->path[len] = '\0';
+	walk->len = len;
+	closedir(dp);
+}
+
+static void
+mtime_walk_init(struct mtime_walk *walk, const char *target, bool newer,
+    time_t rel)
+{
+	walk->target = target;
+	walk->newer = newer;
+	walk->rel = rel;
+	walk->found = false;
+	walk->len = strlcpy(walk->path, target, sizeof(walk->path));
+	if (walk->len >= sizeof(walk->path))
+		walk->len = sizeof(walk->path) - 1;
+	walk->links = 0;
+}
+
 /* Given a time, recurse the target path to find out if there are
    any older (or newer) files.   If false, sets the time to the
    oldest (or newest) found.
@@ -587,51 +1179,100 @@ static bool
 deep_mtime_check(const char *target, bool newer,
 	    time_t *rel, char *file)
 {
-	struct stat buf;
-	bool retval = true;
-	DIR *dp;
-	struct dirent *d;
-	char path[PATH_MAX];
+	struct mtime_walk walk;
 	int serrno = errno;
 
-	/* If target does not exist, return true to mimic shell test */
-	if (stat(target, &buf) != 0)
+	mtime_walk_init(&walk, target, newer, *rel);
+	mtime_walk_at(&walk, AT_FDCWD, target);
+	errno = serrno;
+	if (!walk.found)
 		return true;
+	if (file)
+		strlcpy(file, walk.file, PATH_MAX);
+	*rel = walk.rel;
+	return false;
+}
 
-	if (newer) {
-		if (*rel < buf.st_mtime) {
-			retval = false;
-
-			if (file)
-				strlcpy(file, target, PATH_MAX);
-			*rel = buf.st_mtime;
-		}
-	} else {
-		if (*rel > buf.st_mtime) {
-			retval = false;
+/* Workers take the next walk until there are none left */
+struct mtime_pool {
+	pthread_mutex_t lock;
+	struct mtime_walk *walks;
+	size_t count;
+	size_t next;
+};
 
-			if (file)
-				strlcpy(file, target, PATH_MAX);
-			*rel = buf.st_mtime;
-		}
+static void *
+mtime_worker(void *arg)
+{
+	struct mtime_pool *pool = arg;
+	struct mtime_walk *walk;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		walk = pool->next < pool->count ? &pool->walks[pool->next++] : NULL;
+		pthread_mutex_unlock(&pool->lock);
+		if (!walk)
+			return NULL;
+		mtime_walk_at(walk, AT_FDCWD, walk->target);
 	}
+}
 
-	/* If not a dir then reset errno */
-	if (!(dp = opendir(target))) {
-		errno = serrno;
-		return retval;
-	}
+/* deep_mtime_check each of targets, as many at once as depend_jobs says.
+ * Every walk starts from the time we were given and we take the first to
+ * beat all those before it, which is what checking them in order finds. */
+static bool
+deep_mtime_check_list(RC_STRINGLIST *targets, bool newer,
+	    time_t *rel, char *file)
+{
+	struct mtime_pool pool;
+	pthread_t *threads;
+	sigset_t all, old;
+	RC_STRING *s;
+	size_t jobs, started, i;
+	bool retval = true;
+	int serrno = errno;
 
-	/* Check all the entries in the dir */
-	while ((d = readdir(dp))) {
-		if (d->d_name[0] == '.')
+	pool.count = pool.next = 0;
+	TAILQ_FOREACH(s, targets, entries)
+		pool.count++;
+	if (pool.count == 0)
+		return true;
+	pool.walks = xmalloc(sizeof(*pool.walks) * pool.count);
+	i = 0;
+	TAILQ_FOREACH(s, targets, entries)
+		mtime_walk_init(&pool.walks[i++], s->value, newer, *rel);
+	pthread_mutex_init(&pool.lock, NULL);
+
+	jobs = depend_jobs();
+	if (jobs > pool.count)
+		jobs = pool.count;
+	threads = xmalloc(sizeof(*threads) * jobs);
+	/* Signals are for the thread that called us */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (started = 1; started < jobs; started++)
+		if (pthread_create(&threads[started], NULL, mtime_worker,
+			    &pool) != 0)
+			break;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	/* We work too, so we get through them even if no thread started */
+	mtime_worker(&pool);
+	for (i = 1; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&pool.lock);
+
+	for (i = 0; i < pool.count; i++) {
+		if (!pool.walks[i].found || (newer ?
+			    pool.walks[i].rel <= *rel : pool.walks[i].rel >= *rel))
 			continue;
-		snprintf(path, sizeof(path), "%s/%s", target, d->d_name);
-		if (!deep_mtime_check(path, newer, rel, file)) {
-			retval = false;
-		}
+		retval = false;
+		*rel = pool.walks[i].rel;
+		if (file)
+			strlcpy(file, pool.walks[i].file, PATH_MAX);
 	}
-	closedir(dp);
+	free(pool.walks);
+	errno = serrno;
 	return retval;
 }
 
@@ -676,18 +1317,17 @@ rc_older_than(const char *source, const char *target,
 
 typedef struct deppair
 {
-	const char *depend;
-	const char *addto;
+	RC_DEPTYPE_ID depend;
+	RC_DEPTYPE_ID addto;
 } DEPPAIR;
 
 static const DEPPAIR deppairs[] = {
-	{ "ineed",	"needsme" },
-	{ "iuse",	"usesme" },
-	{ "iwant",	"wantsme" },
-	{ "iafter",	"ibefore" },
-	{ "ibefore",	"iafter" },
-	{ "iprovide",	"providedby" },
-	{ NULL, NULL }
+	{ RC_DEPTYPE_INEED,	RC_DEPTYPE_NEEDSME },
+	{ RC_DEPTYPE_IUSE,	RC_DEPTYPE_USESME },
+	{ RC_DEPTYPE_IWANT,	RC_DEPTYPE_WANTSME },
+	{ RC_DEPTYPE_IAFTER,	RC_DEPTYPE_IBEFORE },
+	{ RC_DEPTYPE_IBEFORE,	RC_DEPTYPE_IAFTER },
+	{ RC_DEPTYPE_IPROVIDE,	RC_DEPTYPE_PROVIDEDBY },
 };
 
 static const char *const depdirs[] =
@@ -704,24 +1344,77 @@ static const char *const depdirs[] =
 	"options",
 	"exclusive",
 	"scheduled",
+	"state",
 	"init.d",
 	"tmp",
 	NULL
 };
 
+/* While rc-stated watches everything the deptree is built from, it keeps
+ * RC_DEPTREE_DIRTY empty until one of them changes, and then writes what
+ * did. Whoever is about to look at every file empties it first, so that
+ * any change made while they look is noted again. When the stamp is
+ * missing nobody is watching and we look at every file each time.
+ * rc-stated holds a lock on the stamp while it runs, so one we can lock
+ * was left behind by an rc-stated which died, and nobody is watching. */
+static bool
+deptree_dirty_watched(const char *stamp)
+{
+	struct stat ours, named;
+	int fd;
+	bool watched;
+
+	if ((fd = open(stamp, O_RDONLY | O_CLOEXEC)) == -1)
+		return false;
+	watched = flock(fd, LOCK_SH | LOCK_NB) == -1 && errno == EWOULDBLOCK;
+	/* Unless a new rc-stated has just put its own in place */
+	if (!watched && fstat(fd, &ours) == 0 && stat(stamp, &named) == 0 &&
+	    ours.st_dev == named.st_dev && ours.st_ino == named.st_ino)
+		unlink(stamp);
+	close(fd);
+	return watched;
+}
+
+static bool
+deptree_dirty_clear(const char *stamp)
+{
+	return truncate(stamp, 0) == 0;
+}
+
+static void
+deptree_dirty_mark(const char *stamp, const char *why)
+{
+	int fd;
+
+	/* Only rc-stated creates it, as only it knows when it can */
+	if ((fd = open(stamp, O_WRONLY | O_APPEND | O_CLOEXEC)) == -1)
+		return;
+	if (write(fd, why, strlen(why)) == -1 || write(fd, "\n", 1) == -1)
+		fprintf(stderr, "write `%s': %s\n", stamp, strerror(errno));
+	close(fd);
+}
+
 bool
 rc_deptree_update_needed(time_t *newest, char *file)
 {
-	bool newer = false;
-	RC_STRINGLIST *config;
-	RC_STRING *s;
+	bool newer = false, dirty = false;
+	RC_STRINGLIST *config, *targets;
 	int i;
 	struct stat buf;
 	time_t mtime;
 	char *path;
-	char *deptree_cache, *depconfig;
+	char *deptree_cache, *depconfig, *stamp;
 	const char *service_dir = rc_svcdir();
 
+	xasprintf(&stamp, "%s/%s", service_dir, RC_DEPTREE_DIRTY);
+	if (stat(stamp, &buf) == 0 && deptree_dirty_watched(stamp)) {
+		if (buf.st_size == 0) {
+			free(stamp);
+			return false;
+		}
+		dirty = deptree_dirty_clear(stamp);
+	}
+
 	/* Create base directories if needed */
 	for (i = 0; depdirs[i]; i++) {
 		xasprintf(&path, "%s/%s", service_dir, depdirs[i]);
@@ -746,22 +1439,23 @@ rc_deptree_update_needed(time_t *newest, char *file)
 	}
 	free(deptree_cache);
 
+	targets = rc_stringlist_new();
 	for (const char * const *dirs = rc_scriptdirs(); *dirs; dirs++) {
 		static const char *subdirs[] = { "init.d", "conf.d", NULL };
 		for (const char **subdir = subdirs; *subdir; subdir++) {
 			xasprintf(&path, "%s/%s", *dirs, *subdir);
-			newer |= !deep_mtime_check(path, true, &mtime, file);
+			rc_stringlist_add(targets, path);
 			free(path);
 		}
 	}
 
 	xasprintf(&path, "%s/rc.conf", rc_sysconfdir());
-	newer |= !deep_mtime_check(path, true, &mtime, file);
+	rc_stringlist_add(targets, path);
 	free(path);
 
 	if (rc_is_user()) {
 		xasprintf(&path, "%s/rc.conf", rc_usrconfdir());
-		newer |= !deep_mtime_check(path, true, &mtime, file);
+		rc_stringlist_add(targets, path);
 		free(path);
 	}
 
@@ -769,17 +1463,23 @@ rc_deptree_update_needed(time_t *newest, char *file)
 	 * outside of baselayout, like syslog-ng, so we check those too. */
 	xasprintf(&depconfig, "%s/depconfig", service_dir);
 	config = rc_config_list(depconfig);
-	TAILQ_FOREACH(s, config, entries) {
-		newer |= !deep_mtime_check(s->value, true, &mtime, file);
-	}
+	TAILQ_CONCAT(targets, config, entries);
 	rc_stringlist_free(config);
 	free(depconfig);
 
+	newer |= !deep_mtime_check_list(targets, true, &mtime, file);
+	rc_stringlist_free(targets);
+
 	/* Return newest file time, if requested */
 	if ((newer) && (newest != NULL)) {
 	    *newest = mtime;
 	}
 
+	/* It is up to rc_deptree_update to clear it, should it be called */
+	if (dirty && newer)
+		deptree_dirty_mark(stamp, file && *file ? file : "deptree");
+	free(stamp);
+
 	return newer;
 }
 
@@ -812,121 +1512,1202 @@ setup_environment(void) {
 		setenv("RC_UNAME", uts.sysname, 1);
 }
 
-/* This is a 7 phase operation
-   Phase 1 is a shell script which loads each init script and config in turn
-   and echos their dependency info to stdout
-   Phase 2 takes that and populates a depinfo object with that data
-   Phase 3 adds any provided services to the depinfo object
-   Phase 4 scans that depinfo object and puts in backlinks
-   Phase 5 removes broken before dependencies
-   Phase 6 looks for duplicate services indicating a real and virtual service
-   with the same names
-   Phase 7 saves the depinfo object to disk
-   */
-bool
-rc_deptree_update(void)
+/* Most init scripts only call need, use, after and friends with literal
+ * arguments from depend(), so we can read those directly instead of
+ * sourcing every script in a shell. Anything we don't fully understand,
+ * and any script whose config could add to its dependencies, is still
+ * handed to gendepends.sh so the resulting deptree is the same. */
+struct depscript {
+	char *path;
+	const char *name;
+	char *key;
+	RC_STRINGLIST *lines;
+	bool shell;
+	bool source;
+};
+
+/* Functions depend() can call and the deptree type they add */
+static const char *const depend_funcs[][2] = {
+	{ "config",  "config" },
+	{ "need",    "ineed" },
+	{ "use",     "iuse" },
+	{ "want",    "iwant" },
+	{ "after",   "iafter" },
+	{ "before",  "ibefore" },
+	{ "provide", "iprovide" },
+	{ "keyword", "keyword" },
+};
+
+static const char *
+depend_func_type(const char *name, size_t len)
 {
+	size_t i;
 
-	FILE *fp;
-	RC_DEPTREE *deptree, *providers;
-	RC_DEPINFO *depinfo = NULL, *depinfo_np, *di;
-	RC_DEPTYPE *deptype = NULL, *dt_np, *dt, *provide;
-	RC_STRINGLIST *config, *dupes, *types, *sorted, *visited;
-	RC_STRING *s, *s2, *s2_np, *s3, *s4;
-	char *line = NULL;
-	size_t size;
-	char *depend, *depends, *service, *type;
-	char *deptree_cache, *depconfig;
+	for (i = 0; i < ARRAY_SIZE(depend_funcs); i++)
+		if (strlen(depend_funcs[i][0]) == len &&
+		    strncmp(depend_funcs[i][0], name, len) == 0)
+			return depend_funcs[i][1];
+	return NULL;
+}
+
+/* True for the rc_need, rc_foo_use, RC_AFTER ... variables _depend uses */
+static bool
+is_depvar(const char *name, size_t len)
+{
 	size_t i, l;
-	bool retval = true;
-	const char *sys = rc_sys();
-	int serrno;
 
-	/* Phase 1 - source all init scripts and print dependencies */
-	setup_environment();
-	if (!(fp = popen(GENDEP, "r")))
+	if (len < 3 || strncasecmp(name, "rc_", 3) != 0)
 		return false;
+	for (i = 0; i < ARRAY_SIZE(depend_funcs); i++) {
+		l = strlen(depend_funcs[i][0]);
+		if (len >= l + 3 && name[len - l - 1] == '_' &&
+		    strncasecmp(name + len - l, depend_funcs[i][0], l) == 0)
+			return true;
+	}
+	return false;
+}
 
-	config = rc_stringlist_new();
-
-	deptree = make_deptree();
-	while (xgetline(&line, &size, fp) != -1) {
-		depends = line;
-		service = strsep(&depends, " ");
-		if (!service || !*service)
-			continue;
+static bool
+is_name_char(char c)
+{
+	return isalnum((unsigned char)c) || c == '_';
+}
 
-		type = strsep(&depends, " ");
-		if (!depinfo || strcmp(depinfo->service, service) != 0) {
-			deptype = NULL;
-			depinfo = get_depinfo(deptree, service);
-			if (!depinfo)
-				depinfo = make_depinfo(deptree, service);
+/* Scan shell text that gets sourced before an init script for anything
+ * which could change what its depend() prints. */
+static bool
+affects_depend(const char *p)
+{
+	const char *start, *e;
+	char quote = '\0';
+	bool word = true;
+	size_t len;
+
+	while (*p) {
+		if (quote) {
+			if (*p == quote)
+				quote = '\0';
+		} else if (*p == '\'' || *p == '"') {
+			quote = *p;
+		} else if (*p == '#' && word) {
+			while (*p && *p != '\n')
+				p++;
+			continue;
 		}
+		if (is_name_char(*p) && !isdigit((unsigned char)*p)) {
+			start = p;
+			while (is_name_char(*p))
+				p++;
+			len = (size_t)(p - start);
+			if (is_depvar(start, len) ||
+			    (len == 3 && strncmp(start, "IFS", 3) == 0))
+				return true;
+			/* Replacing depend() or one of its helpers */
+			e = p + strspn(p, " \t");
+			if (*e == '(' &&
+			    (depend_func_type(start, len) ||
+			     (len == 6 && strncmp(start, "depend", 6) == 0) ||
+			     (len == 7 && strncmp(start, "_depend", 7) == 0)))
+				return true;
+			word = false;
+			continue;
+		}
+		word = (isspace((unsigned char)*p) || strchr(";&|()", *p));
+		p++;
+	}
+	return false;
+}
+
+static bool
+file_affects_depend(const char *file)
+{
+	char *buffer = NULL;
+	size_t len;
+	bool retval;
+
+	if (!exists(file))
+		return false;
+	/* If we cannot read it, the shell has to */
+	if (!rc_getfile(file, &buffer, &len))
+		return true;
+	retval = strlen(buffer) != len - 1 || affects_depend(buffer);
+	free(buffer);
+	return retval;
+}
 
-		/* We may not have any depends */
-		if (!type || !depends)
+/* gendepends.sh sources rc.conf for every script, and they all inherit
+ * our environment, so check those once up front. */
+static bool
+native_depends_allowed(void)
+{
+	DIR *dp;
+	struct dirent *d;
+	char *path;
+	size_t i, len;
+	bool retval = true;
+
+	for (i = 0; environ && environ[i]; i++) {
+		len = strcspn(environ[i], "=");
+		if (is_depvar(environ[i], len) ||
+		    strncmp(environ[i], "BASH_FUNC_", 10) == 0)
+			return false;
+	}
+
+	if (file_affects_depend(RC_CONF))
+		return false;
+
+	if (!(dp = opendir(RC_CONF_D)))
+		return true;
+	while (retval && (d = readdir(dp))) {
+		len = strlen(d->d_name);
+		if (d->d_name[0] == '.' || len < 5 ||
+		    strcmp(d->d_name + len - 5, ".conf") != 0)
 			continue;
+		xasprintf(&path, "%s/%s", RC_CONF_D, d->d_name);
+		retval = !file_affects_depend(path);
+		free(path);
+	}
+	closedir(dp);
+	return retval;
+}
+
+static bool
+ends_with(const char *s, const char *suffix)
+{
+	size_t l = strlen(s), sl = strlen(suffix);
+
+	return l >= sl && strcmp(s + l - sl, suffix) == 0;
+}
 
-		/* Get the type */
-		if (strcmp(type, "config") != 0) {
-			if (!deptype || strcmp(deptype->type, type) != 0) {
-				deptype = get_deptype(depinfo, type);
-				if (!deptype)
-					deptype = make_deptype(depinfo, type);
+/* Same test as gendepends.sh: the interpreter must be openrc-run */
+static bool
+is_openrc_script(const char *path)
+{
+	FILE *fp;
+	char *line = NULL, *one, *two, *p;
+	size_t size = 0;
+	bool retval = false;
+
+	if (!(fp = fopen(path, "re")))
+		return false;
+	if (xgetline(&line, &size, fp) != -1) {
+		one = line + strspn(line, " \t");
+		p = one + strcspn(one, " \t");
+		if (*p)
+			*p++ = '\0';
+		two = p + strspn(p, " \t");
+		two[strcspn(two, " \t")] = '\0';
+		if (one[0] == '#' &&
+		    (ends_with(one, "/openrc-run") || ends_with(one, "/runscript")))
+			retval = true;
+		else if (strcmp(one, "#!") == 0 &&
+			 (ends_with(two, "/openrc-run") || ends_with(two, "/runscript")))
+			retval = true;
+	}
+	free(line);
+	fclose(fp);
+	return retval;
+}
+
+/* Characters we accept unquoted in a depend() argument */
+static bool
+is_depend_char(char c)
+{
+	return c != '\0' && (isalnum((unsigned char)c) || strchr("._+-@%:,/=", c));
+}
+
+/* Turn the body of a simple depend() into gendepends.sh output lines */
+static bool
+parse_depend(const char *svc, const char *p, const char *end,
+	     RC_STRINGLIST *lines)
+{
+	const char *word, *type;
+	char *line, *l;
+	size_t i, len, nwords;
+
+	while (p < end) {
+		type = NULL;
+		line = NULL;
+		nwords = 0;
+		for (;;) {
+			while (p < end && (*p == ' ' || *p == '\t'))
+				p++;
+			if (p == end || *p == '\n' || *p == ';')
+				break;
+			if (*p == '#') {
+				while (p < end && *p != '\n')
+					p++;
+				break;
+			}
+			word = p;
+			while (p < end && !strchr(" \t\n;", *p))
+				p++;
+			len = (size_t)(p - word);
+			if (nwords++ == 0) {
+				if (len == 1 && *word == ':')
+					continue;
+				if (!(type = depend_func_type(word, len)))
+					goto fail;
+				xasprintf(&line, "%s %s", svc, type);
+				continue;
+			}
+			for (i = (word[0] == '!' && len > 1); i < len; i++)
+				if (!is_depend_char(word[i]))
+					goto fail;
+			/* -containers depends on the system, let the shell do it */
+			if ((len == 11 && strncmp(word, "-containers", len) == 0) ||
+			    (len == 12 && strncmp(word, "!-containers", len) == 0))
+				goto fail;
+			if (line) {
+				l = line;
+				xasprintf(&line, "%s %.*s", l, (int)len, word);
+				free(l);
 			}
 		}
+		/* An empty command followed by a semicolon is a syntax error */
+		if (nwords == 0 && p < end && *p == ';')
+			goto fail;
+		if (line && nwords > 1)
+			rc_stringlist_add(lines, line);
+		free(line);
+		if (p < end)
+			p++;
+	}
+	return true;
 
-		/* Now add each depend to our type.
-		   We do this individually so we handle multiple spaces gracefully */
-		while ((depend = strsep(&depends, " "))) {
-			if (depend[0] == 0)
-				continue;
+fail:
+	free(line);
+	return false;
+}
 
-			if (strcmp(type, "config") == 0) {
-				rc_stringlist_addu(config, depend);
-				continue;
+/* Variables which change what depend() prints */
+static bool
+is_depend_var(const char *name, size_t len)
+{
+	return is_depvar(name, len) ||
+		(len == 3 && strncmp(name, "IFS", len) == 0) ||
+		(len == 10 && strncmp(name, "RC_SVCNAME", len) == 0);
+}
+
+/* ${rc_need:=net} sets the variable as surely as an assignment does */
+static bool
+assigns_depvar(const char *p)
+{
+	const char *name = p + 2, *end;
+
+	for (end = name; is_name_char(*end); end++)
+		;
+	p = end + (*end == ':');
+	return *p == '=' && is_depend_var(name, (size_t)(end - name));
+}
+
+/* Skip a ${...} expansion, refusing ones which can fail, run commands or
+ * set something which changes what depend() prints */
+static const char *
+skip_brace(const char *p)
+{
+	if (assigns_depvar(p))
+		return NULL;
+	for (p += 2; *p != '}'; p++)
+		if (*p == '\0' || strchr("?`'\"", *p) ||
+		    (*p == '$' && p[1] == '(') ||
+		    (*p == '$' && p[1] == '{' && assigns_depvar(p)))
+			return NULL;
+	return p;
+}
+
+/* Skip the value of an assignment, which always succeeds unless it runs a
+ * command or a ${var?} expansion */
+static const char *
+skip_value(const char *p)
+{
+	for (;; p++) {
+		switch (*p) {
+		case '\0':
+		case '\n':
+		case ' ':
+		case '\t':
+		case ';':
+			return p;
+		case '\'':
+			if (!(p = strchr(p + 1, '\'')))
+				return NULL;
+			break;
+		case '"':
+			for (p++; *p != '"'; p++) {
+				if (*p == '\0' || *p == '`')
+					return NULL;
+				if (*p == '\\' && p[1] != '\0')
+					p++;
+				else if (*p == '$' && p[1] == '(')
+					return NULL;
+				else if (*p == '$' && p[1] == '{' && !(p = skip_brace(p)))
+					return NULL;
 			}
+			break;
+		case '\\':
+			if (p[1] != '\0')
+				p++;
+			break;
+		case '$':
+			if (p[1] == '(')
+				return NULL;
+			if (p[1] == '{' && !(p = skip_brace(p)))
+				return NULL;
+			break;
+		case '`':
+		case '|':
+		case '&':
+		case '<':
+		case '>':
+		case '(':
+		case ')':
+			return NULL;
+		default:
+			break;
+		}
+	}
+}
 
-			/* Don't depend on ourself */
-			if (strcmp(depend, service) == 0)
-				continue;
+/* Skip [export] name=value ... returning NULL if it's really a command or
+ * sets something which changes what depend() prints */
+static const char *
+skip_assignments(const char *p, bool export)
+{
+	const char *name;
+
+	for (;;) {
+		p += strspn(p, " \t");
+		if (*p == '\0' || *p == '\n' || *p == ';' || *p == '#')
+			return p;
+		if (!is_name_char(*p) || isdigit((unsigned char)*p))
+			return NULL;
+		name = p;
+		while (is_name_char(*p))
+			p++;
+		if (is_depend_var(name, (size_t)(p - name)))
+			return NULL;
+		if (*p == '=') {
+			if (!(p = skip_value(p + 1)))
+				return NULL;
+		} else if (!export || !strchr(" \t\n;", *p))
+			return NULL;
+	}
+}
 
-			/* .sh files are not init scripts */
-			l = strlen(depend);
-			if (l > 2 &&
-			    depend[l - 3] == '.' &&
-			    depend[l - 2] == 's' &&
-			    depend[l - 1] == 'h')
-				continue;
+/* : ${rc_need:=net} sets the variable as surely as an assignment does,
+ * so we refuse to expand anything we refuse to assign */
+static bool
+expands_depvar(const char *p)
+{
+	const char *name;
+
+	if (*p == '{')
+		p++;
+	name = p;
+	while (is_name_char(*p))
+		p++;
+	return is_depend_var(name, (size_t)(p - name));
+}
+
+static bool
+is_function_start(const char *p)
+{
+	if (!is_name_char(*p) || isdigit((unsigned char)*p))
+		return false;
+	while (is_name_char(*p))
+		p++;
+	p += strspn(p, " \t");
+	return *p == '(';
+}
+
+/* Read the dependencies of an init script without running it.
+ * We only accept comments, assignments and function definitions at the
+ * top level as sourcing those cannot fail or print anything, and only
+ * literal calls to the dependency functions in depend(). */
+static bool
+parse_init_script(struct depscript *script)
+{
+	char *buffer = NULL;
+	const char *p, *e, *t, *name, *body, *end;
+	const char *depend = NULL, *depend_end = NULL;
+	size_t len;
+	bool retval = false;
 
-			/* Remove our dependency if instructed */
-			if (depend[0] == '!') {
-				rc_stringlist_delete(deptype->services, depend + 1);
+	if (!rc_getfile(script->path, &buffer, &len))
+		return false;
+	if (strlen(buffer) != len - 1 || strstr(buffer, "<<"))
+		goto out;
+
+	p = buffer;
+	while (*p) {
+		p += strspn(p, " \t");
+		if (*p == '\n') {
+			p++;
+			continue;
+		}
+		if (*p == '#') {
+			p += strcspn(p, "\n");
+			continue;
+		}
+
+		if (*p == ':' && strchr(" \t\n", p[1])) {
+			e = p + strcspn(p, "\n");
+			for (t = p; t < e; t++)
+				if (strchr("`?;|&<>(\\", *t) ||
+				    (*t == '$' && expands_depvar(t + 1)))
+					goto out;
+			p = e;
+			continue;
+		}
+
+		if (!is_name_char(*p) || isdigit((unsigned char)*p))
+			goto out;
+		name = p;
+		while (is_name_char(*p))
+			p++;
+		len = (size_t)(p - name);
+		e = p + strspn(p, " \t");
+
+		if (*p == '=') {
+			p = skip_assignments(name, false);
+		} else if (len == 6 && strncmp(name, "export", len) == 0 &&
+			   (*p == ' ' || *p == '\t')) {
+			p = skip_assignments(p, true);
+		} else if (e[0] == '(' && e[1] == ')') {
+			/* We find the end of a function by the } at the start
+			 * of a line, so it has to start at one too */
+			if ((name != buffer && name[-1] != '\n') ||
+			    depend_func_type(name, len) ||
+			    (len == 7 && strncmp(name, "_depend", len) == 0))
+				goto out;
+			p = e + 2;
+			p += strspn(p, " \t\n");
+			if (*p++ != '{')
+				goto out;
+			body = p;
+			e = p + strcspn(p, "\n");
+			for (t = e; t > body && (t[-1] == ' ' || t[-1] == '\t'); t--)
+				;
+			if (t > body) {
+				/* name() { foo; } */
+				if (t - body < 2 || t[-1] != '}' ||
+				    !strchr("; \t", t[-2]))
+					goto out;
+				end = t - 1;
+				p = t;
+			} else {
+				end = body;
+				while ((end = strstr(end, "\n}"))) {
+					t = end + 2 + strspn(end + 2, " \t");
+					if (*t == '\0' || strchr("\n;#", *t))
+						break;
+					end++;
+				}
+				if (!end)
+					goto out;
+				/* Another function starting first means we
+				 * did not find the real end */
+				for (t = body; t < end; t++)
+					if (*t == '\n' && is_function_start(t + 1))
+						goto out;
+				end++;
+				p = end + 1;
+			}
+			if (len == 6 && strncmp(name, "depend", len) == 0) {
+				if (depend)
+					goto out;
+				depend = body;
+				depend_end = end;
+			}
+		} else
+			goto out;
+
+		if (!p)
+			goto out;
+		p += strspn(p, " \t");
+		if (*p == ';')
+			p++;
+		else if (*p != '\0' && *p != '\n' && *p != '#')
+			goto out;
+	}
+
+	rc_stringlist_add(script->lines, script->name);
+	if (depend)
+		retval = parse_depend(script->name, depend, depend_end,
+				      script->lines);
+	else
+		retval = true;
+
+out:
+	free(buffer);
+	return retval;
+}
+
+/* The conf.d file for the first len characters of the script name */
+static char *
+confd_file(const struct depscript *script, size_t len)
+{
+	char *path;
+
+	xasprintf(&path, "%.*s../conf.d/%.*s",
+		  (int)(script->name - script->path), script->path,
+		  (int)len, script->name);
+	return path;
+}
+
+/* gendepends.sh sources these before the init script */
+static bool
+conf_affects_depend(const struct depscript *script)
+{
+	char *path;
+	size_t len = strcspn(script->name, ".");
+	bool retval;
+
+	path = confd_file(script, strlen(script->name));
+	retval = file_affects_depend(path);
+	free(path);
+	if (!retval && len > 0 && script->name[len] != '\0') {
+		path = confd_file(script, len);
+		retval = file_affects_depend(path);
+		free(path);
+	}
+	return retval;
+}
+
+static int
+depscript_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct depscript *)a)->name,
+		      ((const struct depscript *)b)->name);
+}
+
+/* List the init scripts in the order gendepends.sh visits them */
+static struct depscript *
+list_init_scripts(size_t *count)
+{
+	RC_STRINGLIST *done = rc_stringlist_new();
+	struct depscript *scripts = NULL;
+	size_t n = 0, first, alloc = 0;
+	DIR *dp;
+	struct dirent *d;
+	struct stat st;
+	char *dir, *path;
+
+	for (const char * const *dirs = rc_scriptdirs(); *dirs; dirs++) {
+		xasprintf(&dir, "%s/init.d", *dirs);
+		if (rc_stringlist_find(done, dir) || !(dp = opendir(dir))) {
+			free(dir);
+			continue;
+		}
+		rc_stringlist_add(done, dir);
+		first = n;
+		while ((d = readdir(dp))) {
+			if (d->d_name[0] == '.')
+				continue;
+			xasprintf(&path, "%s/%s", dir, d->d_name);
+			if (access(path, X_OK) != 0 || stat(path, &st) != 0 ||
+			    !S_ISREG(st.st_mode) || !is_openrc_script(path)) {
+				free(path);
 				continue;
 			}
+			if (n == alloc) {
+				alloc = alloc ? alloc * 2 : 64;
+				scripts = xrealloc(scripts, sizeof(*scripts) * alloc);
+			}
+			scripts[n].path = path;
+			scripts[n].name = basename_c(path);
+			scripts[n].key = NULL;
+			scripts[n].lines = rc_stringlist_new();
+			scripts[n].shell = false;
+			scripts[n].source = false;
+			n++;
+		}
+		closedir(dp);
+		if (n > first)
+			qsort(scripts + first, n - first, sizeof(*scripts),
+			      depscript_cmp);
+		free(dir);
+	}
+	rc_stringlist_free(done);
+	*count = n;
+	return scripts;
+}
+
+/* The test suite runs gendepends.sh from the source tree, as it is not
+ * installed yet */
+static const char *
+gendepends(void)
+{
+	const char *path = getenv("RC_GENDEPENDS");
+
+	return path && *path ? path : GENDEP;
+}
+
+/* A gendepends.sh process sourcing a slice of the scripts */
+struct depworker {
+	pid_t pid;
+	int fd;
+	char *buffer;
+	size_t len;
+	size_t size;
+};
+
+static bool
+spawn_worker(struct depworker *worker, char **argv)
+{
+	posix_spawn_file_actions_t fa;
+	int fds[2], err;
+
+	if (pipe(fds) == -1) {
+		fprintf(stderr, "pipe: %s\n", strerror(errno));
+		return false;
+	}
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, fds[1], STDOUT_FILENO);
+	err = posix_spawn(&worker->pid, argv[0], &fa, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	close(fds[1]);
+	if (err) {
+		fprintf(stderr, "%s: %s\n", argv[0], strerror(err));
+		close(fds[0]);
+		return false;
+	}
+	worker->fd = fds[0];
+	return true;
+}
 
-			rc_stringlist_add(deptype->services, depend);
+/* Read all worker output as it comes so none of them block on a full pipe */
+static void
+read_workers(struct depworker *workers, size_t nworkers)
+{
+	struct pollfd *pfds = xmalloc(sizeof(*pfds) * nworkers);
+	struct depworker *worker;
+	size_t i, open = 0;
+	ssize_t n;
+
+	for (i = 0; i < nworkers; i++) {
+		pfds[i].fd = workers[i].fd;
+		pfds[i].events = POLLIN;
+		if (workers[i].fd != -1)
+			open++;
+	}
 
-			/* We need to allow `after *; before local;` to work.
-			 * Conversely, we need to allow 'before *; after modules' also */
-			/* If we're before something, remove us from the after list */
-			if (strcmp(type, "ibefore") == 0) {
-				if ((dt = get_deptype(depinfo, "iafter")))
-					rc_stringlist_delete(dt->services, depend);
+	while (open > 0) {
+		if (poll(pfds, nworkers, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "poll: %s\n", strerror(errno));
+			break;
+		}
+		for (i = 0; i < nworkers; i++) {
+			if (pfds[i].fd == -1 || !pfds[i].revents)
+				continue;
+			worker = &workers[i];
+			if (worker->size - worker->len < BUFSIZ) {
+				worker->size += BUFSIZ * 4;
+				worker->buffer = xrealloc(worker->buffer, worker->size);
 			}
-			/* If we're after something, remove us from the before list */
-			if (strcmp(type, "iafter") == 0 ||
-			    strcmp(type, "ineed") == 0 ||
-			    strcmp(type, "iwant") == 0 ||
-			    strcmp(type, "iuse") == 0) {
-				if ((dt = get_deptype(depinfo, "ibefore")))
-					rc_stringlist_delete(dt->services, depend);
+			n = read(worker->fd, worker->buffer + worker->len,
+				 worker->size - worker->len - 1);
+			if (n > 0) {
+				worker->len += n;
+				continue;
 			}
+			if (n == -1 && errno == EINTR)
+				continue;
+			pfds[i].fd = -1;
+			open--;
+		}
+	}
+	free(pfds);
+}
+
+/* Source the scripts we could not parse with gendepends.sh.
+ * The scripts are split into one contiguous slice per worker, so reading
+ * the output back worker by worker keeps it in script order and gives
+ * the same result however many workers we use. */
+static bool
+shell_depends(struct depscript *scripts, size_t count, size_t nshell)
+{
+	struct depworker *workers;
+	struct depscript *script = NULL;
+	size_t nworkers = depend_jobs(), i, j, k, w, first, last;
+	char **argv, *line, *eol;
+	bool retval = true;
+
+	if (nworkers > nshell)
+		nworkers = nshell;
+	workers = xmalloc(sizeof(*workers) * nworkers);
+	argv = xmalloc(sizeof(*argv) * (nshell + 2));
+	argv[0] = UNCONST(gendepends());
+
+	for (w = 0, i = 0, k = 0; w < nworkers; w++) {
+		workers[w].fd = -1;
+		workers[w].buffer = NULL;
+		workers[w].len = workers[w].size = 0;
+		first = nshell * w / nworkers;
+		last = nshell * (w + 1) / nworkers;
+		for (j = 1; k < last; i++) {
+			if (!scripts[i].source)
+				continue;
+			if (k++ >= first)
+				argv[j++] = scripts[i].path;
+		}
+		argv[j] = NULL;
+		if (retval && !spawn_worker(&workers[w], argv))
+			retval = false;
+	}
+	free(argv);
+
+	read_workers(workers, nworkers);
+
+	/* Each sourced script starts with a line of just its name, which
+	 * tells us whose dependencies follow */
+	for (w = 0, i = 0; w < nworkers; w++) {
+		if (workers[w].fd == -1)
+			continue;
+		close(workers[w].fd);
+		while (waitpid(workers[w].pid, NULL, 0) == -1 && errno == EINTR)
+			;
+		if (!workers[w].buffer)
+			continue;
+		workers[w].buffer[workers[w].len] = '\0';
+		for (line = workers[w].buffer; *line; line = eol) {
+			eol = line + strcspn(line, "\n");
+			if (*eol)
+				*eol++ = '\0';
+			if (!strchr(line, ' ')) {
+				for (j = i; j < count; j++) {
+					if (scripts[j].source &&
+					    strcmp(scripts[j].name, line) == 0) {
+						script = &scripts[j];
+						i = j + 1;
+						break;
+					}
+				}
+			}
+			if (script)
+				rc_stringlist_add(script->lines, line);
+		}
+		free(workers[w].buffer);
+	}
+	free(workers);
+	return retval;
+}
+
+/* The dependencies found for each script are kept in $svcdir/depcache,
+ * so when only a few scripts change we only read or source those again.
+ * Each record is keyed by the identity of every file it came from. */
+#define DEPCACHE_VERSION	1
+
+/* A script's dependencies as read from the cache */
+struct depcache {
+	char *path;
+	char *key;
+	RC_STRINGLIST *lines;
+	bool shell;
+};
+
+/* Append the identity of a file to a key, so we notice it being edited,
+ * replaced, created or removed */
+static void
+add_file_key(char **key, const char *file)
+{
+	struct stat st;
+	char *k = *key;
+
+	if (stat(file, &st) == 0)
+		xasprintf(key, "%s%s%ju.%jd.%jd.%ld", k ? k : "", k ? "," : "",
+			  (uintmax_t)st.st_ino, (intmax_t)st.st_size,
+			  (intmax_t)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+	else
+		xasprintf(key, "%s%s-", k ? k : "", k ? "," : "");
+	free(k);
+}
+
+/* The key for a script covers the script, its conf.d files and any files
+ * it names with config */
+static char *
+script_key(const struct depscript *script, RC_STRINGLIST *lines)
+{
+	RC_STRING *s;
+	char *key = NULL, *path, *line, *p, *file;
+	size_t len = strcspn(script->name, ".");
+
+	add_file_key(&key, script->path);
+	path = confd_file(script, strlen(script->name));
+	add_file_key(&key, path);
+	free(path);
+	if (len > 0 && script->name[len] != '\0') {
+		path = confd_file(script, len);
+		add_file_key(&key, path);
+		free(path);
+	}
+
+	TAILQ_FOREACH(s, lines, entries) {
+		p = strchr(s->value, ' ');
+		if (!p || strncmp(p, " config ", 8) != 0)
+			continue;
+		line = p = xstrdup(p + 8);
+		while ((file = strsep(&p, " ")))
+			if (*file)
+				add_file_key(&key, file);
+		free(line);
+	}
+	return key;
+}
+
+/* The key for the whole cache covers what every script is read with */
+static char *
+depcache_key(bool native)
+{
+	RC_STRINGLIST *files = rc_stringlist_new();
+	RC_STRING *s;
+	DIR *dp;
+	struct dirent *d;
+	struct utsname uts;
+	char *key = NULL, *k, *path;
+
+	add_file_key(&key, gendepends());
+	add_file_key(&key, RC_CONF);
+	add_file_key(&key, RC_CONF_D);
+	if ((dp = opendir(RC_CONF_D))) {
+		while ((d = readdir(dp)))
+			if (d->d_name[0] != '.')
+				rc_stringlist_add(files, d->d_name);
+		closedir(dp);
+	}
+	rc_stringlist_sort(&files);
+	TAILQ_FOREACH(s, files, entries) {
+		xasprintf(&path, "%s/%s", RC_CONF_D, s->value);
+		add_file_key(&key, path);
+		free(path);
+	}
+	rc_stringlist_free(files);
+
+	k = key;
+	xasprintf(&key, "%s,%s,%s", k, native ? "native" : "shell",
+		  uname(&uts) == 0 ? uts.sysname : "-");
+	free(k);
+	return key;
+}
+
+static int
+depcache_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct depcache *)a)->path,
+		      ((const struct depcache *)b)->path);
+}
+
+static void
+free_depcache(struct depcache *cache, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		free(cache[i].path);
+		free(cache[i].key);
+		rc_stringlist_free(cache[i].lines);
+	}
+	free(cache);
+}
+
+/* Load the records which are still valid for the given keys, sorted by
+ * path. Records of sourced scripts also need the same set of scripts, as
+ * things like `after *` depend on it. */
+static struct depcache *
+load_depcache(const char *file, const char *key, uint32_t names,
+	      size_t *count)
+{
+	FILE *fp;
+	struct depcache *cache = NULL, *entry = NULL;
+	char *line = NULL, *p, *version, *hnames, *hkey, *shell, *ekey;
+	size_t size = 0, n = 0, alloc = 0;
+	bool same_names;
+
+	*count = 0;
+	if (!(fp = fopen(file, "re")))
+		return NULL;
+	if (xgetline(&line, &size, fp) == -1)
+		goto out;
+	p = line;
+	if (strcmp(strsep(&p, " "), "depcache") != 0 ||
+	    !(version = strsep(&p, " ")) || atoi(version) != DEPCACHE_VERSION ||
+	    !(hnames = strsep(&p, " ")) || !(hkey = strsep(&p, " ")) ||
+	    strcmp(hkey, key) != 0)
+		goto out;
+	same_names = strtoul(hnames, NULL, 16) == names;
+
+	while (xgetline(&line, &size, fp) != -1) {
+		if (line[0] == '\t') {
+			if (entry)
+				rc_stringlist_add(entry->lines, line + 1);
+			continue;
 		}
+		entry = NULL;
+		p = line;
+		if (strcmp(strsep(&p, " "), "script") != 0 ||
+		    !(shell = strsep(&p, " ")) || !(ekey = strsep(&p, " ")) ||
+		    !p || !*p)
+			continue;
+		if (*shell == '1' && !same_names)
+			continue;
+		if (n == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			cache = xrealloc(cache, sizeof(*cache) * alloc);
+		}
+		entry = &cache[n++];
+		entry->path = xstrdup(p);
+		entry->key = xstrdup(ekey);
+		entry->lines = rc_stringlist_new();
+		entry->shell = *shell == '1';
 	}
+	if (n > 0)
+		qsort(cache, n, sizeof(*cache), depcache_cmp);
+	*count = n;
+
+out:
 	free(line);
-	pclose(fp);
+	fclose(fp);
+	return cache;
+}
+
+static bool
+save_depcache(const char *file, const char *key, uint32_t names,
+	      struct depscript *scripts, size_t count)
+{
+	FILE *fp;
+	RC_STRING *s;
+	char *tmp;
+	size_t i;
+	bool retval;
+
+	xasprintf(&tmp, "%s.tmp", file);
+	if (!(fp = fopen(tmp, "we"))) {
+		free(tmp);
+		return false;
+	}
+	fprintf(fp, "depcache %d %08x %s\n", DEPCACHE_VERSION,
+		(unsigned int)names, key);
+	for (i = 0; i < count; i++) {
+		fprintf(fp, "script %d %s %s\n", scripts[i].shell ? 1 : 0,
+			scripts[i].key, scripts[i].path);
+		TAILQ_FOREACH(s, scripts[i].lines, entries)
+			fprintf(fp, "\t%s\n", s->value);
+	}
+	retval = fclose(fp) == 0 && rename(tmp, file) == 0;
+	if (!retval)
+		unlink(tmp);
+	free(tmp);
+	return retval;
+}
+
+/* Add a line of gendepends.sh output to the deptree */
+static void
+add_depends(RC_DEPTREE *deptree, RC_STRINGLIST *config, char *line)
+{
+	RC_DEPINFO *depinfo;
+	RC_DEPTYPE *deptype = NULL, *dt;
+	char *depend, *depends = line, *service, *type;
+	size_t l;
+
+	service = strsep(&depends, " ");
+	if (!service || !*service)
+		return;
+
+	type = strsep(&depends, " ");
+	depinfo = get_depinfo(deptree, service);
+	if (!depinfo)
+		depinfo = make_depinfo(deptree, service);
+
+	/* We may not have any depends */
+	if (!type || !depends)
+		return;
+
+	/* Get the type */
+	if (strcmp(type, "config") != 0) {
+		deptype = get_deptype(depinfo, type);
+		if (!deptype)
+			deptype = make_deptype(depinfo, type);
+	}
+
+	/* Now add each depend to our type.
+	   We do this individually so we handle multiple spaces gracefully */
+	while ((depend = strsep(&depends, " "))) {
+		if (depend[0] == 0)
+			continue;
+
+		if (strcmp(type, "config") == 0) {
+			rc_stringlist_addu(config, depend);
+			continue;
+		}
+
+		/* Don't depend on ourself */
+		if (strcmp(depend, service) == 0)
+			continue;
+
+		/* .sh files are not init scripts */
+		l = strlen(depend);
+		if (l > 2 &&
+		    depend[l - 3] == '.' &&
+		    depend[l - 2] == 's' &&
+		    depend[l - 1] == 'h')
+			continue;
+
+		/* Remove our dependency if instructed */
+		if (depend[0] == '!') {
+			rc_stringlist_delete(deptype->services, depend + 1);
+			continue;
+		}
+
+		rc_stringlist_add(deptype->services, depend);
+
+		/* We need to allow `after *; before local;` to work.
+		 * Conversely, we need to allow 'before *; after modules' also */
+		/* If we're before something, remove us from the after list */
+		if (deptype->id == RC_DEPTYPE_IBEFORE) {
+			if ((dt = get_deptype_id(depinfo, RC_DEPTYPE_IAFTER)))
+				rc_stringlist_delete(dt->services, depend);
+		}
+		/* If we're after something, remove us from the before list */
+		if (deptype->id == RC_DEPTYPE_IAFTER ||
+		    deptype->id == RC_DEPTYPE_INEED ||
+		    deptype->id == RC_DEPTYPE_IWANT ||
+		    deptype->id == RC_DEPTYPE_IUSE) {
+			if ((dt = get_deptype_id(depinfo, RC_DEPTYPE_IBEFORE)))
+				rc_stringlist_delete(dt->services, depend);
+		}
+	}
+}
+
+/* Collect the dependencies of all init scripts into the deptree */
+static bool
+gather_depends(RC_DEPTREE *deptree, RC_STRINGLIST *config)
+{
+	struct depscript *scripts;
+	struct depcache *cache, *entry, find;
+	RC_STRING *s;
+	char *file, *key;
+	size_t count, ncache, i, ncached = 0, nshell = 0;
+	uint32_t names = 2166136261U;
+	bool native = native_depends_allowed();
+	bool retval = true;
+
+	scripts = list_init_scripts(&count);
+	for (i = 0; i < count; i++)
+		names = checksum_update(names, scripts[i].path,
+					strlen(scripts[i].path) + 1);
+
+	key = depcache_key(native);
+	xasprintf(&file, "%s/depcache", rc_svcdir());
+	cache = load_depcache(file, key, names, &ncache);
+
+	for (i = 0; i < count; i++) {
+		find.path = scripts[i].path;
+		entry = ncache ? bsearch(&find, cache, ncache, sizeof(*cache),
+					 depcache_cmp) : NULL;
+		if (entry) {
+			scripts[i].key = script_key(&scripts[i], entry->lines);
+			if (strcmp(scripts[i].key, entry->key) == 0) {
+				rc_stringlist_free(scripts[i].lines);
+				scripts[i].lines = entry->lines;
+				scripts[i].shell = entry->shell;
+				entry->lines = NULL;
+				ncached++;
+				continue;
+			}
+			free(scripts[i].key);
+			scripts[i].key = NULL;
+		}
+		if (native && !conf_affects_depend(&scripts[i]) &&
+		    parse_init_script(&scripts[i]))
+			continue;
+		rc_stringlist_free(scripts[i].lines);
+		scripts[i].lines = rc_stringlist_new();
+		scripts[i].shell = scripts[i].source = true;
+		nshell++;
+	}
+	free_depcache(cache, ncache);
+
+	if (nshell > 0)
+		retval = shell_depends(scripts, count, nshell);
+
+	if (rc_yesno(getenv("EINFO_VERBOSE")))
+		fprintf(stderr, "Dependencies of %zu init scripts cached, "
+			"%zu parsed, %zu sourced\n",
+			ncached, count - ncached - nshell, nshell);
+
+	for (i = 0; i < count; i++) {
+		if (!scripts[i].key)
+			scripts[i].key = script_key(&scripts[i], scripts[i].lines);
+	}
+	if (retval && !save_depcache(file, key, names, scripts, count)) {
+		fprintf(stderr, "save '%s': %s\n", file, strerror(errno));
+		unlink(file);
+	}
+	free(file);
+	free(key);
+
+	for (i = 0; i < count; i++) {
+		if (retval)
+			TAILQ_FOREACH(s, scripts[i].lines, entries)
+				add_depends(deptree, config, s->value);
+		rc_stringlist_free(scripts[i].lines);
+		free(scripts[i].key);
+		free(scripts[i].path);
+	}
+	free(scripts);
+	return retval;
+}
+
+/* This is a 7 phase operation
+   Phase 1 reads the dependencies of simple init scripts directly and has a
+   shell script load the rest and their config in turn, echoing their
+   dependency info to stdout
+   Phase 2 takes that and populates a depinfo object with that data
+   Phase 3 adds any provided services to the depinfo object
+   Phase 4 scans that depinfo object and puts in backlinks
+   Phase 5 removes broken before dependencies
+   Phase 6 looks for duplicate services indicating a real and virtual service
+   with the same names
+   Phase 7 saves the depinfo object to disk
+   */
+bool
+rc_deptree_update(void)
+{
+
+	FILE *fp;
+	RC_DEPTREE *deptree, *providers;
+	RC_DEPINFO *depinfo = NULL, *depinfo_np, *di;
+	RC_DEPTYPE *deptype = NULL, *dt_np, *dt, *provide;
+	RC_STRINGLIST *config, *types, *sorted;
+	RC_DEPTYPE_ID *type_ids;
+	RC_STRING *s, *s2, *s2_np, *s3, *s4;
+	bool *visited;
+	char *deptree_cache, *deptree_bin, *depconfig, *stamp;
+	size_t i;
+	bool retval = true, dirty;
+	const char *sys = rc_sys();
+
+	/* Anything that changes from here on may not make it in */
+	xasprintf(&stamp, "%s/%s", rc_svcdir(), RC_DEPTREE_DIRTY);
+	dirty = deptree_dirty_clear(stamp);
+
+	/* Phase 1 - read or source all init scripts for their dependencies */
+	setup_environment();
+	config = rc_stringlist_new();
+	deptree = make_deptree();
+	if (!gather_depends(deptree, config)) {
+		rc_deptree_free(deptree);
+		rc_stringlist_free(config);
+		if (dirty)
+			deptree_dirty_mark(stamp, "rc_deptree_update");
+		free(stamp);
+		return false;
+	}
 
 	/* Phase 2 - if we're a special system, remove services that don't
 	 * work for them. This doesn't stop them from being run directly. */
@@ -947,15 +2728,16 @@ rc_deptree_update(void)
 			onosys[i + 2] = (char)tolower((unsigned char)sys[i]);
 		onosys[i + 2] = '\0';
 
-		TAILQ_FOREACH_SAFE(depinfo, deptree, entries, depinfo_np) {
-			if (!(deptype = get_deptype(depinfo, "keyword")))
+		TAILQ_FOREACH_SAFE(depinfo, &deptree->services, entries, depinfo_np) {
+			if (!(deptype = get_deptype_id(depinfo, RC_DEPTYPE_KEYWORD)))
 				continue;
 			TAILQ_FOREACH(s, deptype->services, entries) {
 				if (strcmp(s->value, nosys) != 0 && strcmp(s->value, onosys) != 0)
 					continue;
-				provide = get_deptype(depinfo, "iprovide");
-				TAILQ_REMOVE(deptree, depinfo, entries);
-				TAILQ_FOREACH(di, deptree, entries) {
+				provide = get_deptype_id(depinfo, RC_DEPTYPE_IPROVIDE);
+				TAILQ_REMOVE(&deptree->services, depinfo, entries);
+				unhash_depinfo(deptree, depinfo);
+				TAILQ_FOREACH(di, &deptree->services, entries) {
 					TAILQ_FOREACH_SAFE(dt, &di->depends, entries, dt_np) {
 						rc_stringlist_delete(dt->services, depinfo->service);
 						if (provide)
@@ -963,6 +2745,8 @@ rc_deptree_update(void)
 								rc_stringlist_delete(dt->services, s2->value);
 						if (!TAILQ_FIRST(dt->services)) {
 							TAILQ_REMOVE(&di->depends, dt, entries);
+							if (dt->id != RC_DEPTYPE_OTHER)
+								di->types[dt->id] = NULL;
 							free(dt->type);
 							free(dt->services);
 							free(dt);
@@ -976,10 +2760,9 @@ rc_deptree_update(void)
 	}
 
 	/* Phase 3 - add our providers to the tree */
-	providers = xmalloc(sizeof(*providers));
-	TAILQ_INIT(providers);
-	TAILQ_FOREACH(depinfo, deptree, entries) {
-		if (!(deptype = get_deptype(depinfo, "iprovide")))
+	providers = make_deptree();
+	TAILQ_FOREACH(depinfo, &deptree->services, entries) {
+		if (!(deptype = get_deptype_id(depinfo, RC_DEPTYPE_IPROVIDE)))
 			continue;
 		TAILQ_FOREACH(s, deptype->services, entries) {
 			di = get_depinfo(providers, s->value);
@@ -987,32 +2770,35 @@ rc_deptree_update(void)
 				di = make_depinfo(providers, s->value);
 		}
 	}
-	TAILQ_CONCAT(deptree, providers, entries);
-	free(providers);
+	TAILQ_FOREACH_SAFE(di, &providers->services, entries, depinfo_np) {
+		TAILQ_REMOVE(&providers->services, di, entries);
+		add_depinfo(deptree, di);
+	}
+	rc_deptree_free(providers);
 
 	/* Phase 4 - backreference our depends */
-	TAILQ_FOREACH(depinfo, deptree, entries) {
-		for (i = 0; deppairs[i].depend; i++) {
-			deptype = get_deptype(depinfo, deppairs[i].depend);
+	TAILQ_FOREACH(depinfo, &deptree->services, entries) {
+		for (i = 0; i < ARRAY_SIZE(deppairs); i++) {
+			deptype = get_deptype_id(depinfo, deppairs[i].depend);
 			if (!deptype)
 				continue;
 			TAILQ_FOREACH(s, deptype->services, entries) {
 				di = get_depinfo(deptree, s->value);
 				if (!di) {
-					if (strcmp(deptype->type, "ineed") == 0) {
+					if (deptype->id == RC_DEPTYPE_INEED) {
 						fprintf(stderr, "Service '%s' needs non existent service '%s'\n",
 							 depinfo->service, s->value);
-						dt = get_deptype(depinfo, "broken");
+						dt = get_deptype_id(depinfo, RC_DEPTYPE_BROKEN);
 						if (!dt)
-							dt = make_deptype(depinfo, "broken");
+							dt = make_deptype_id(depinfo, RC_DEPTYPE_BROKEN);
 						rc_stringlist_addu(dt->services, s->value);
 					}
 					continue;
 				}
 
-				dt = get_deptype(di, deppairs[i].addto);
+				dt = get_deptype_id(di, deppairs[i].addto);
 				if (!dt)
-					dt = make_deptype(di, deppairs[i].addto);
+					dt = make_deptype_id(di, deppairs[i].addto);
 				rc_stringlist_addu(dt->services, depinfo->service);
 			}
 		}
@@ -1024,27 +2810,28 @@ rc_deptree_update(void)
 	rc_stringlist_add(types, "iwant");
 	rc_stringlist_add(types, "iuse");
 	rc_stringlist_add(types, "iafter");
-	TAILQ_FOREACH(depinfo, deptree, entries) {
-		deptype = get_deptype(depinfo, "ibefore");
+	type_ids = get_deptype_ids(types);
+	visited = make_visited(deptree);
+	TAILQ_FOREACH(depinfo, &deptree->services, entries) {
+		deptype = get_deptype_id(depinfo, RC_DEPTYPE_IBEFORE);
 		if (!deptype)
 			continue;
 		sorted = rc_stringlist_new();
-		visited = rc_stringlist_new();
-		visit_service(deptree, types, sorted, visited, depinfo,
-			      NULL, 0);
-		rc_stringlist_free(visited);
+		memset(visited, 0, sizeof(*visited) * (deptree->count + 1));
+		visit_service(deptree, types, type_ids, sorted, visited,
+			      depinfo, NULL, 0);
 		TAILQ_FOREACH_SAFE(s2, deptype->services, entries, s2_np) {
 			TAILQ_FOREACH(s3, sorted, entries) {
 				di = get_depinfo(deptree, s3->value);
 				if (!di)
 					continue;
 				if (strcmp(s2->value, s3->value) == 0) {
-					dt = get_deptype(di, "iafter");
+					dt = get_deptype_id(di, RC_DEPTYPE_IAFTER);
 					if (dt)
 						rc_stringlist_delete(dt->services, depinfo->service);
 					break;
 				}
-				dt = get_deptype(di, "iprovide");
+				dt = get_deptype_id(di, RC_DEPTYPE_IPROVIDE);
 				if (!dt)
 					continue;
 				TAILQ_FOREACH(s4, dt->services, entries) {
@@ -1054,7 +2841,7 @@ rc_deptree_update(void)
 				if (s4) {
 					di = get_depinfo(deptree, s4->value);
 					if (di) {
-						dt = get_deptype(di, "iafter");
+						dt = get_deptype_id(di, RC_DEPTYPE_IAFTER);
 						if (dt)
 							rc_stringlist_delete(dt->services, depinfo->service);
 					}
@@ -1066,33 +2853,33 @@ rc_deptree_update(void)
 		}
 		rc_stringlist_free(sorted);
 	}
+	free(visited);
+	free(type_ids);
 	rc_stringlist_free(types);
 
-	/* Phase 6 - Print errors for duplicate services */
-	dupes = rc_stringlist_new();
-	TAILQ_FOREACH(depinfo, deptree, entries) {
-		serrno = errno;
-		errno = 0;
-		rc_stringlist_addu(dupes,depinfo->service);
-		if (errno == EEXIST) {
+	/* Phase 6 - Print errors for duplicate services
+	 * Lookups always find the first service of a name, so any other
+	 * service with that name is a duplicate. */
+	TAILQ_FOREACH(depinfo, &deptree->services, entries) {
+		if (get_depinfo(deptree, depinfo->service) != depinfo) {
 			fprintf(stderr,
 					"Error: %s is the name of a real and virtual service.\n",
 					depinfo->service);
 		}
-		errno = serrno;
 	}
-	rc_stringlist_free(dupes);
 
 	/* Phase 7 - save to disk
 	   Now that we're purely in C, do we need to keep a shell parseable file?
 	   I think yes as then it stays human readable
 	   This works and should be entirely shell parseable provided that depend
 	   names don't have any non shell variable characters in
+	   We write a binary copy too, which is what rc_deptree_load uses
 	   */
 	xasprintf(&deptree_cache, "%s/deptree", rc_svcdir());
+	xasprintf(&deptree_bin, "%s/deptree.bin", rc_svcdir());
 	if ((fp = fopen(deptree_cache, "w"))) {
 		i = 0;
-		TAILQ_FOREACH(depinfo, deptree, entries) {
+		TAILQ_FOREACH(depinfo, &deptree->services, entries) {
 			fprintf(fp, "depinfo_%zu_service='%s'\n", i, depinfo->service);
 			TAILQ_FOREACH(deptype, &depinfo->depends, entries) {
 				size_t k = 0;
@@ -1104,10 +2891,16 @@ rc_deptree_update(void)
 			i++;
 		}
 		fclose(fp);
+		if (!save_binary(deptree, deptree_bin)) {
+			fprintf(stderr, "save '%s': %s\n", deptree_bin, strerror(errno));
+			unlink(deptree_bin);
+		}
 	} else {
 		fprintf(stderr, "fopen '%s': %s\n", deptree_cache, strerror(errno));
+		unlink(deptree_bin);
 		retval = false;
 	}
+	free(deptree_bin);
 	free(deptree_cache);
 
 	/* Save our external config files to disk */
@@ -1126,6 +2919,10 @@ rc_deptree_update(void)
 	}
 	free(depconfig);
 
+	if (dirty && !retval)
+		deptree_dirty_mark(stamp, "rc_deptree_update");
+	free(stamp);
+
 	rc_stringlist_free(config);
 	rc_deptree_free(deptree);
 	return retval;
@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include "queue.h"
@@ -183,14 +184,111 @@ rc_config_list(const char *file)
 	return list;
 }
 
-static void rc_config_set_value(RC_STRINGLIST *config, char *value)
+uint32_t
+checksum_update(uint32_t sum, const void *data, size_t len)
 {
-	RC_STRING *cline;
+	const unsigned char *p = data;
+
+	while (len--) {
+		sum ^= *p++;
+		sum *= 16777619U;
+	}
+	return sum;
+}
+
+uint32_t
+strtab_add(struct strtab *strtab, const char *string)
+{
+	size_t len = strlen(string) + 1;
+	size_t offset = strtab->len;
+
+	if (strtab->len + len > strtab->size) {
+		strtab->size = (strtab->len + len) * 2;
+		strtab->buf = xrealloc(strtab->buf, strtab->size);
+	}
+	memcpy(strtab->buf + strtab->len, string, len);
+	strtab->len += len;
+	return offset;
+}
+
+/* Each value set replaces any earlier one for the same key, so rather
+ * than walk the config for every line we keep its lines in an open hash
+ * on their keys */
+struct config_index {
+	RC_STRING **slots;
+	size_t size;
+	size_t count;
+};
+
+static RC_STRING **
+config_index_slot(const struct config_index *index, const char *key,
+    size_t len)
+{
+	size_t mask = index->size - 1;
+	size_t i = checksum_update(2166136261U, key, len) & mask;
+	RC_STRING *line;
+
+	while ((line = index->slots[i])) {
+		if (strncmp(line->value, key, len) == 0 && line->value[len] == '=')
+			break;
+		i = (i + 1) & mask;
+	}
+	return &index->slots[i];
+}
+
+static void
+config_index_resize(struct config_index *index, size_t size)
+{
+	RC_STRING **slots = index->slots;
+	size_t i, old_size = index->size;
+
+	index->size = size;
+	index->slots = xmalloc(sizeof(*index->slots) * size);
+	memset(index->slots, 0, sizeof(*index->slots) * size);
+	for (i = 0; i < old_size; i++)
+		if (slots[i])
+			*config_index_slot(index, slots[i]->value,
+			    strcspn(slots[i]->value, "=")) = slots[i];
+	free(slots);
+}
+
+/* The first line for a key is the one rc_config_value() finds, so a key
+ * already in the index keeps its line */
+static void
+config_index_add(struct config_index *index, RC_STRING *line)
+{
+	RC_STRING **slot;
+
+	if ((index->count + 1) * 2 > index->size)
+		config_index_resize(index, index->size * 2);
+	slot = config_index_slot(index, line->value, strcspn(line->value, "="));
+	if (!*slot) {
+		*slot = line;
+		index->count++;
+	}
+}
+
+static void
+config_index_init(struct config_index *index, RC_STRINGLIST *config)
+{
+	RC_STRING *line;
+
+	index->slots = NULL;
+	index->size = 0;
+	index->count = 0;
+	config_index_resize(index, 64);
+	TAILQ_FOREACH(line, config, entries)
+		config_index_add(index, line);
+}
+
+static void rc_config_set_value(RC_STRINGLIST *config,
+    struct config_index *index, char *value)
+{
+	RC_STRING **cline;
 	char *entry;
 	size_t i = 0;
 	char *newline;
 	char *p = value;
-	bool replaced;
 	char *token;
 
 	if (!p)
@@ -221,22 +319,15 @@ static void rc_config_set_value(RC_STRINGLIST *config, char *value)
 		xasprintf(&newline, "%s=", entry);
 	}
 
-	replaced = false;
 	/* In shells the last item takes precedence, so we need to remove
 	   any prior values we may already have */
-	TAILQ_FOREACH(cline, config, entries) {
-		i = strlen(entry);
-		if (strncmp(entry, cline->value, i) == 0 && cline->value[i] == '=') {
-			/* We have a match now - to save time we directly replace it */
-			free(cline->value);
-			cline->value = newline;
-			replaced = true;
-			break;
-		}
-	}
-
-	if (!replaced) {
-		rc_stringlist_add(config, newline);
+	cline = config_index_slot(index, entry, strlen(entry));
+	if (*cline) {
+		/* We have a match now - to save time we directly replace it */
+		free((*cline)->value);
+		(*cline)->value = newline;
+	} else {
+		config_index_add(index, rc_stringlist_add(config, newline));
 		free(newline);
 	}
 	free(entry);
@@ -310,6 +401,7 @@ static RC_STRINGLIST * rc_config_directory(RC_STRINGLIST *config, const char *di
 	RC_STRINGLIST *rc_conf_d_list;
 	char path[PATH_MAX];
 	RC_STRING *line;
+	struct config_index index;
 
 	if ((dp = opendir(dir)) != NULL) {
 		rc_conf_d_files = rc_stringlist_new();
@@ -321,6 +413,7 @@ static RC_STRINGLIST * rc_config_directory(RC_STRINGLIST *config, const char *di
 		closedir(dp);
 
 		rc_stringlist_sort(&rc_conf_d_files);
+		config_index_init(&index, config);
 		TAILQ_FOREACH(fname, rc_conf_d_files, entries) {
 			if (!fname->value)
 				continue;
@@ -328,10 +421,12 @@ static RC_STRINGLIST * rc_config_directory(RC_STRINGLIST *config, const char *di
 			rc_conf_d_list = rc_config_list(path);
 			TAILQ_FOREACH(line, rc_conf_d_list, entries)
 				if (line->value)
-					rc_config_set_value(config, line->value);
+					rc_config_set_value(config, &index,
+					    line->value);
 			rc_stringlist_free(rc_conf_d_list);
 		}
 
+		free(index.slots);
 		rc_stringlist_free(rc_conf_d_files);
 	}
 
@@ -344,12 +439,15 @@ rc_config_load(const char *file)
 	RC_STRINGLIST *list;
 	RC_STRINGLIST *config;
 	RC_STRING *line;
+	struct config_index index;
 
 	list = rc_config_list(file);
 	config = rc_stringlist_new();
+	config_index_init(&index, config);
 	TAILQ_FOREACH(line, list, entries) {
-		rc_config_set_value(config, line->value);
+		rc_config_set_value(config, &index, line->value);
 	}
+	free(index.slots);
 	rc_stringlist_free(list);
 
 	return config;
@@ -373,66 +471,51 @@ rc_config_value(RC_STRINGLIST *list, const char *entry)
 	return NULL;
 }
 
-/* Global for caching the strings loaded from rc.conf to avoid reparsing for
- * each rc_conf_value call */
-static RC_STRINGLIST *rc_conf = NULL;
-
-static void
-_free_rc_conf(void)
-{
-	rc_stringlist_free(rc_conf);
-}
-
 static void
-rc_conf_append(const char *file)
+rc_conf_append(RC_STRINGLIST *conf, const char *file)
 {
-	RC_STRINGLIST *conf = rc_config_load(file);
-	TAILQ_CONCAT(rc_conf, conf, entries);
-	rc_stringlist_free(conf);
+	RC_STRINGLIST *list = rc_config_load(file);
+	TAILQ_CONCAT(conf, list, entries);
+	rc_stringlist_free(list);
 }
 
-char *
-rc_conf_value(const char *setting)
+RC_STRINGLIST *
+rc_conf_list(void)
 {
 	const char *sysconfdir = rc_sysconfdir();
 	const char *usrconfdir = rc_usrconfdir();
+	RC_STRINGLIST *conf = rc_stringlist_new();
 	RC_STRING *s;
-	char *conf;
-
-	if (rc_conf)
-		return rc_config_value(rc_conf, setting);
-
-	rc_conf = rc_stringlist_new();
-	atexit(_free_rc_conf);
+	char *file;
 
 	/* Load user configurations first, as they should override
 	 * system wide configs. */
 	if (usrconfdir) {
-		xasprintf(&conf, "%s/%s", usrconfdir, "rc.conf");
-		rc_conf_append(conf);
-		free(conf);
+		xasprintf(&file, "%s/%s", usrconfdir, "rc.conf");
+		rc_conf_append(conf, file);
+		free(file);
 
-		xasprintf(&conf, "%s/%s", usrconfdir, "rc.conf.d");
-		rc_conf = rc_config_directory(rc_conf, conf);
-		free(conf);
+		xasprintf(&file, "%s/%s", usrconfdir, "rc.conf.d");
+		conf = rc_config_directory(conf, file);
+		free(file);
 	}
 
-	xasprintf(&conf, "%s/%s", sysconfdir, "rc.conf");
-	rc_conf_append(conf);
-	free(conf);
+	xasprintf(&file, "%s/%s", sysconfdir, "rc.conf");
+	rc_conf_append(conf, file);
+	free(file);
 
 	/* Support old configs. */
 	if (exists(RC_CONF_OLD))
-		rc_conf_append(RC_CONF_OLD);
+		rc_conf_append(conf, RC_CONF_OLD);
 
-	xasprintf(&conf, "%s/%s", sysconfdir, "rc.conf.d");
-	rc_conf = rc_config_directory(rc_conf, conf);
-	free(conf);
+	xasprintf(&file, "%s/%s", sysconfdir, "rc.conf.d");
+	conf = rc_config_directory(conf, file);
+	free(file);
 
-	rc_conf = rc_config_kcl(rc_conf);
+	conf = rc_config_kcl(conf);
 
 	/* Convert old uppercase to lowercase */
-	TAILQ_FOREACH(s, rc_conf, entries) {
+	TAILQ_FOREACH(s, conf, entries) {
 		char *p = s->value;
 		while (p && *p && *p != '=') {
 			if (isupper((unsigned char)*p))
@@ -441,5 +524,398 @@ rc_conf_value(const char *setting)
 		}
 	}
 
-	return rc_config_value(rc_conf, setting);
+	return conf;
+}
+
+/* Rather than parse rc.conf and rc.conf.d in every process that wants a
+ * setting, we keep the result in $svcdir for the next one to use straight
+ * from a private mapping. Settings are looked up in the same image when
+ * we had to build it ourselves.
+ * All integers are in host byte order. The file is laid out as
+ *   header
+ *   input records, for the files read and their mtimes at the time
+ *   hash buckets, each the index of the first entry in it
+ *   entries, each the offset of a key=value line in the string table
+ *   string table of NUL terminated strings
+ * The kernel command line is not an input, as it cannot change without a
+ * reboot and that takes $svcdir with it.
+ * Bump the version whenever the layout changes. */
+#define CONF_BIN_MAGIC		0x46434352	/* RCCF */
+#define CONF_BIN_VERSION	1
+#define CONF_BIN_FILE		"rc.conf.bin"
+#define CONF_BIN_NONE		UINT32_MAX
+
+struct conf_bin_header {
+	uint32_t magic;
+	uint32_t version;
+	/* FNV-1a of everything after the header */
+	uint32_t checksum;
+	uint32_t inputs;
+	/* always a power of 2 */
+	uint32_t buckets;
+	uint32_t entries;
+	/* size of the string table in bytes */
+	uint32_t strings;
+	uint32_t reserved;
+};
+
+struct conf_bin_input {
+	uint32_t path;
+	/* 0 if the file did not exist */
+	uint32_t exists;
+	int64_t sec;
+	int64_t nsec;
+};
+
+struct conf_bin_entry {
+	uint32_t line;
+	/* the next entry in the same bucket, always an earlier one */
+	uint32_t next;
+};
+
+/* Global for caching the image loaded from rc.conf to avoid reparsing for
+ * each rc_conf_value call */
+static void *rc_conf = NULL;
+static size_t rc_conf_size;
+static bool rc_conf_mapped;
+
+static void
+_free_rc_conf(void)
+{
+	if (rc_conf_mapped)
+		munmap(rc_conf, rc_conf_size);
+	else
+		free(rc_conf);
+}
+
+static void
+conf_dir_inputs(RC_STRINGLIST *inputs, const char *dir)
+{
+	DIR *dp;
+	struct dirent *d;
+	char *file;
+
+	/* Its mtime tells us when files are added or removed */
+	rc_stringlist_add(inputs, dir);
+	if (!(dp = opendir(dir)))
+		return;
+	while ((d = readdir(dp))) {
+		if (fnmatch("*.conf", d->d_name, FNM_PATHNAME) != 0)
+			continue;
+		xasprintf(&file, "%s/%s", dir, d->d_name);
+		rc_stringlist_add(inputs, file);
+		free(file);
+	}
+	closedir(dp);
+}
+
+/* Everything rc_conf_list() reads, whether it exists or not */
+static RC_STRINGLIST *
+conf_inputs(void)
+{
+	const char *sysconfdir = rc_sysconfdir();
+	const char *usrconfdir = rc_usrconfdir();
+	RC_STRINGLIST *inputs = rc_stringlist_new();
+	char *file;
+
+	if (usrconfdir) {
+		xasprintf(&file, "%s/%s", usrconfdir, "rc.conf");
+		rc_stringlist_add(inputs, file);
+		free(file);
+
+		xasprintf(&file, "%s/%s", usrconfdir, "rc.conf.d");
+		conf_dir_inputs(inputs, file);
+		free(file);
+	}
+
+	xasprintf(&file, "%s/%s", sysconfdir, "rc.conf");
+	rc_stringlist_add(inputs, file);
+	free(file);
+
+	rc_stringlist_add(inputs, RC_CONF_OLD);
+
+	xasprintf(&file, "%s/%s", sysconfdir, "rc.conf.d");
+	conf_dir_inputs(inputs, file);
+	free(file);
+
+	return inputs;
+}
+
+static void
+conf_stat(const char *path, struct conf_bin_input *input)
+{
+	struct stat st;
+
+	input->exists = 0;
+	input->sec = input->nsec = 0;
+	if (stat(path, &st) == 0) {
+		input->exists = 1;
+		input->sec = st.st_mtim.tv_sec;
+		input->nsec = st.st_mtim.tv_nsec;
+	}
+}
+
+/* Check the mapped cache is sane and still matches its inputs before we
+ * point anything into it */
+static bool
+conf_check(const unsigned char *map, size_t size)
+{
+	const struct conf_bin_header *hdr = (const void *)map;
+	const struct conf_bin_input *inputs;
+	const struct conf_bin_entry *entries;
+	const uint32_t *buckets;
+	const char *strings;
+	struct conf_bin_input now;
+	uint64_t len;
+	uint32_t i;
+
+	if (size < sizeof(*hdr) ||
+	    hdr->magic != CONF_BIN_MAGIC ||
+	    hdr->version != CONF_BIN_VERSION ||
+	    hdr->buckets == 0 || (hdr->buckets & (hdr->buckets - 1)) != 0)
+		return false;
+
+	len = sizeof(*hdr) +
+	    (uint64_t)hdr->inputs * sizeof(*inputs) +
+	    (uint64_t)hdr->buckets * sizeof(*buckets) +
+	    (uint64_t)hdr->entries * sizeof(*entries) +
+	    hdr->strings;
+	if (len != size)
+		return false;
+	if (checksum_update(2166136261U, map + sizeof(*hdr),
+		    size - sizeof(*hdr)) != hdr->checksum)
+		return false;
+
+	inputs = (const void *)(map + sizeof(*hdr));
+	buckets = (const void *)(inputs + hdr->inputs);
+	entries = (const void *)(buckets + hdr->buckets);
+	strings = (const char *)(entries + hdr->entries);
+	if (hdr->strings == 0 || strings[hdr->strings - 1] != '\0')
+		return false;
+
+	for (i = 0; i < hdr->buckets; i++)
+		if (buckets[i] != CONF_BIN_NONE && buckets[i] >= hdr->entries)
+			return false;
+	/* Chains only run backwards, so they always end */
+	for (i = 0; i < hdr->entries; i++)
+		if (entries[i].line >= hdr->strings ||
+		    (entries[i].next != CONF_BIN_NONE && entries[i].next >= i))
+			return false;
+
+	for (i = 0; i < hdr->inputs; i++) {
+		if (inputs[i].path >= hdr->strings)
+			return false;
+		conf_stat(strings + inputs[i].path, &now);
+		if (now.exists != inputs[i].exists ||
+		    now.sec != inputs[i].sec || now.nsec != inputs[i].nsec)
+			return false;
+	}
+	return true;
+}
+
+static bool
+conf_load(const char *file)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	if ((fd = open(file, O_RDONLY | O_CLOEXEC)) == -1)
+		return false;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+		close(fd);
+		return false;
+	}
+	/* rc_conf_value() has always handed out strings callers may change,
+	 * and get_systype() does, so they must be writable. Being private,
+	 * nothing written goes back to the file. */
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+	    fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+	if (!conf_check(map, st.st_size)) {
+		munmap(map, st.st_size);
+		return false;
+	}
+	rc_conf = map;
+	rc_conf_size = st.st_size;
+	rc_conf_mapped = true;
+	return true;
+}
+
+/* Lay conf out as a cache image. Only the first line for each key goes in,
+ * as that is the one rc_config_value() would find.
+ * Each input should have been stat'ed before conf was read, so a change
+ * made while we read it gets noticed next time. */
+static void *
+conf_build(RC_STRINGLIST *conf, RC_STRINGLIST *inputs,
+    struct conf_bin_input *stats, size_t *size)
+{
+	struct conf_bin_header hdr;
+	struct conf_bin_entry *entries;
+	struct strtab strtab = { NULL, 0, 0 };
+	RC_STRING *s;
+	uint32_t *buckets, *bucket, e;
+	size_t nlines = 0, ninputs = 0, nbuckets = 16, nentries = 0, len;
+	unsigned char *image, *p;
+
+	TAILQ_FOREACH(s, conf, entries)
+		nlines++;
+	while (nbuckets < nlines * 2)
+		nbuckets *= 2;
+	buckets = xmalloc(sizeof(*buckets) * nbuckets);
+	for (len = 0; len < nbuckets; len++)
+		buckets[len] = CONF_BIN_NONE;
+	entries = xmalloc(sizeof(*entries) * (nlines + 1));
+
+	/* Never leave the string table empty */
+	strtab_add(&strtab, "");
+	if (inputs)
+		TAILQ_FOREACH(s, inputs, entries)
+			stats[ninputs++].path = strtab_add(&strtab, s->value);
+
+	TAILQ_FOREACH(s, conf, entries) {
+		if (!strchr(s->value, '='))
+			continue;
+		len = strcspn(s->value, "=");
+		bucket = &buckets[checksum_update(2166136261U, s->value, len) &
+		    (nbuckets - 1)];
+		for (e = *bucket; e != CONF_BIN_NONE; e = entries[e].next)
+			if (strncmp(strtab.buf + entries[e].line,
+				    s->value, len + 1) == 0)
+				break;
+		if (e != CONF_BIN_NONE)
+			continue;
+		entries[nentries].line = strtab_add(&strtab, s->value);
+		entries[nentries].next = *bucket;
+		*bucket = nentries++;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CONF_BIN_MAGIC;
+	hdr.version = CONF_BIN_VERSION;
+	hdr.inputs = ninputs;
+	hdr.buckets = nbuckets;
+	hdr.entries = nentries;
+	hdr.strings = strtab.len;
+
+	*size = sizeof(hdr) + sizeof(*stats) * ninputs +
+	    sizeof(*buckets) * nbuckets + sizeof(*entries) * nentries +
+	    strtab.len;
+	image = xmalloc(*size);
+	p = image + sizeof(hdr);
+	if (ninputs)
+		memcpy(p, stats, sizeof(*stats) * ninputs);
+	p += sizeof(*stats) * ninputs;
+	memcpy(p, buckets, sizeof(*buckets) * nbuckets);
+	p += sizeof(*buckets) * nbuckets;
+	memcpy(p, entries, sizeof(*entries) * nentries);
+	p += sizeof(*entries) * nentries;
+	memcpy(p, strtab.buf, strtab.len);
+	hdr.checksum = checksum_update(2166136261U, image + sizeof(hdr),
+	    *size - sizeof(hdr));
+	memcpy(image, &hdr, sizeof(hdr));
+
+	free(strtab.buf);
+	free(entries);
+	free(buckets);
+	return image;
+}
+
+static void
+conf_save(const char *file, const void *image, size_t size)
+{
+	char *tmp;
+	ssize_t w = 0;
+	size_t done = 0;
+	int fd;
+
+	/* Readers may map the cache at any time and any number of us may be
+	 * writing it, so replace it atomically */
+	xasprintf(&tmp, "%s.%d", file, (int)getpid());
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) == -1) {
+		free(tmp);
+		return;
+	}
+	while (done < size &&
+	    ((w = write(fd, (const char *)image + done, size - done)) > 0 ||
+	    (w == -1 && errno == EINTR)))
+		if (w > 0)
+			done += w;
+	if (close(fd) != 0 || done != size || rename(tmp, file) != 0)
+		unlink(tmp);
+	free(tmp);
+}
+
+static char *
+conf_lookup(const char *setting)
+{
+	const struct conf_bin_header *hdr = rc_conf;
+	const struct conf_bin_input *inputs;
+	const struct conf_bin_entry *entries;
+	const uint32_t *buckets;
+	const char *strings, *line;
+	size_t len = strlen(setting);
+	uint32_t e;
+
+	inputs = (const void *)((const unsigned char *)rc_conf + sizeof(*hdr));
+	buckets = (const void *)(inputs + hdr->inputs);
+	entries = (const void *)(buckets + hdr->buckets);
+	strings = (const char *)(entries + hdr->entries);
+
+	e = buckets[checksum_update(2166136261U, setting, len) &
+	    (hdr->buckets - 1)];
+	for (; e != CONF_BIN_NONE; e = entries[e].next) {
+		line = strings + entries[e].line;
+		if (strncmp(line, setting, len) == 0 && line[len] == '=')
+			return UNCONST(line + len + 1);
+	}
+	return NULL;
+}
+
+char *
+rc_conf_value(const char *setting)
+{
+	RC_STRINGLIST *conf, *inputs;
+	struct conf_bin_input *stats;
+	RC_STRING *s;
+	char *file;
+	size_t i = 0;
+
+	if (rc_conf)
+		return conf_lookup(setting);
+	atexit(_free_rc_conf);
+
+	/* What rc-stated gives us is current, but we don't know what it was
+	 * read from so it can't be cached */
+	if ((conf = rc_stated_query("conf"))) {
+		rc_conf = conf_build(conf, NULL, NULL, &rc_conf_size);
+		rc_stringlist_free(conf);
+		return conf_lookup(setting);
+	}
+
+	xasprintf(&file, "%s/%s", rc_svcdir(), CONF_BIN_FILE);
+	if (conf_load(file)) {
+		free(file);
+		return conf_lookup(setting);
+	}
+
+	inputs = conf_inputs();
+	TAILQ_FOREACH(s, inputs, entries)
+		i++;
+	stats = xmalloc(sizeof(*stats) * (i + 1));
+	i = 0;
+	TAILQ_FOREACH(s, inputs, entries)
+		conf_stat(s->value, &stats[i++]);
+
+	conf = rc_conf_list();
+	rc_conf = conf_build(conf, inputs, stats, &rc_conf_size);
+	conf_save(file, rc_conf, rc_conf_size);
+
+	rc_stringlist_free(conf);
+	rc_stringlist_free(inputs);
+	free(stats);
+	free(file);
+	return conf_lookup(setting);
 }
@@ -0,0 +1,115 @@
+/*
+ * librc-stated
+ * Client side of rc-stated, which keeps rc.conf and service states in
+ * memory so we don't have to read them from disk in every process.
+ */
+
+/*
+ * Copyright (c) 2007-2015 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/HEAD/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/HEAD/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "queue.h"
+#include "librc.h"
+#include "helpers.h"
+
+#ifndef MSG_NOSIGNAL
+#  define MSG_NOSIGNAL 0
+#endif
+
+/* We keep the one connection for the life of the process, and once
+ * rc-stated has failed us we stop trying */
+static FILE *stated;
+static bool stated_gone;
+
+static void
+stated_close(void)
+{
+	if (stated)
+		fclose(stated);
+	stated = NULL;
+	stated_gone = true;
+}
+
+static bool
+stated_connect(void)
+{
+	struct sockaddr_un sun;
+	struct timeval timeout = { .tv_sec = 1 };
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if ((size_t)snprintf(sun.sun_path, sizeof(sun.sun_path), "%s/%s",
+		rc_svcdir(), RC_STATED_SOCKET) >= sizeof(sun.sun_path))
+		return false;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+		return false;
+	/* A wedged daemon should only cost us a second */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1 ||
+	    !(stated = fdopen(fd, "r")))
+	{
+		close(fd);
+		return false;
+	}
+	return true;
+}
+
+RC_STRINGLIST *
+rc_stated_query(const char *request)
+{
+	RC_STRINGLIST *reply;
+	char *line = NULL, *buffer;
+	size_t len = 0;
+	const char *value;
+	int blen;
+
+	if (stated_gone)
+		return NULL;
+	/* rc-stated sets this so it doesn't end up asking itself */
+	if ((value = getenv("RC_STATED")) && !rc_yesno(value)) {
+		stated_gone = true;
+		return NULL;
+	}
+	if (!stated && !stated_connect()) {
+		stated_gone = true;
+		return NULL;
+	}
+
+	/* Replies are read in full, so nothing is left buffered in stated
+	 * to get in the way of writing to the socket underneath it */
+	blen = xasprintf(&buffer, "%s\n", request);
+	if (send(fileno(stated), buffer, blen, MSG_NOSIGNAL) != blen) {
+		free(buffer);
+		stated_close();
+		return NULL;
+	}
+	free(buffer);
+
+	/* The reply is a line for each item and then an empty one */
+	reply = rc_stringlist_new();
+	while (xgetline(&line, &len, stated) != -1) {
+		if (*line == '\0') {
+			free(line);
+			return reply;
+		}
+		rc_stringlist_add(reply, line);
+	}
+	free(line);
+	rc_stringlist_free(reply);
+	stated_close();
+	return NULL;
+}
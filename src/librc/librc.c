@@ -27,6 +27,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -886,8 +887,116 @@ rc_service_in_runlevel(const char *service, const char *runlevel)
 	return r;
 }
 
-bool
-rc_service_mark(const char *service, const RC_SERVICE state)
+/* Work out the state of a service from the state directories, leaving out
+ * RC_SERVICE_CRASHED which depends on its daemons rather than on us. */
+static int
+scan_service_state(const char *svcdir, const char *base)
+{
+	int i;
+	int state = RC_SERVICE_STOPPED;
+	char *file;
+	RC_STRINGLIST *dirs;
+	RC_STRING *dir;
+
+	for (i = 0; rc_service_state_names[i].name; i++) {
+		xasprintf(&file, "%s/%s/%s", svcdir, rc_service_state_names[i].name, base);
+		if (exists(file)) {
+			if (rc_service_state_names[i].state <= 0x10)
+				state = rc_service_state_names[i].state;
+			else
+				state |= rc_service_state_names[i].state;
+		}
+		free(file);
+	}
+
+	if (state & RC_SERVICE_STOPPED) {
+		char *sched_dir;
+		xasprintf(&sched_dir, "%s/scheduled", svcdir);
+		dirs = ls_dir(sched_dir, 0);
+		TAILQ_FOREACH(dir, dirs, entries) {
+			xasprintf(&file, "%s/scheduled/%s/%s", svcdir, dir->value, base);
+			i = exists(file);
+			free(file);
+			if (i) {
+				state |= RC_SERVICE_SCHEDULED;
+				break;
+			}
+		}
+		rc_stringlist_free(dirs);
+		free(sched_dir);
+	}
+
+	return state;
+}
+
+/* $svcdir/state/<service> caches what scan_service_state() would return so
+ * rc_service_state() needs one read. Everything in librc which changes the
+ * state directories rewrites it; anything else has to remove it.
+ * Writers hold a lock on the state directory from the scan to the rename,
+ * so one can't put back what it saw before another's change. */
+static void
+save_service_state(const char *service)
+{
+	const char *svcdir = rc_svcdir();
+	const char *base = basename_c(service);
+	char *file, *tmp;
+	FILE *fp;
+	int serrno = errno;
+	int lock_fd;
+
+	xasprintf(&file, "%s/state", svcdir);
+	if ((mkdir(file, 0755) != 0 && errno != EEXIST) ||
+	    (lock_fd = open(file, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+		free(file);
+		errno = serrno;
+		return;
+	}
+	free(file);
+	while (flock(lock_fd, LOCK_EX) == -1 && errno == EINTR)
+		;
+
+	xasprintf(&file, "%s/state/%s", svcdir, base);
+	xasprintf(&tmp, "%s/state/.%s.%d", svcdir, base, getpid());
+	if ((fp = fopen(tmp, "w"))) {
+		fprintf(fp, "%d\n", scan_service_state(svcdir, base));
+		if (fclose(fp) != 0 || rename(tmp, file) != 0) {
+			unlink(tmp);
+			unlink(file);
+		}
+	} else
+		unlink(file);
+	close(lock_fd);
+	free(tmp);
+	free(file);
+	errno = serrno;
+}
+
+static int
+load_service_state(const char *svcdir, const char *base)
+{
+	char *file, buffer[32], *end;
+	ssize_t len;
+	long state;
+	int fd;
+
+	xasprintf(&file, "%s/state/%s", svcdir, base);
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	free(file);
+	if (fd == -1)
+		return -1;
+	len = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+	buffer[len] = '\0';
+	state = strtol(buffer, &end, 10);
+	if (end == buffer || *end != '\n' || state <= 0)
+		return -1;
+	return (int)state;
+}
+
+static bool
+mark_service(const char *service, const RC_SERVICE state)
 {
 	char *file, *was;
 	int i = 0;
@@ -1000,7 +1109,8 @@ rc_service_mark(const char *service, const RC_SERVICE state)
 			/* Try and remove the dir; we don't care about errors */
 			xasprintf(&was, "%s/%s", file, dir->value);
 			serrno = errno;
-			rmdir(was);
+			if (rmdir(was) == 0)
+				save_service_state(dir->value);
 			errno = serrno;
 			free(was);
 		}
@@ -1011,50 +1121,345 @@ rc_service_mark(const char *service, const RC_SERVICE state)
 	return true;
 }
 
+bool
+rc_service_event(const char *service, const char *event, int status)
+{
+	struct timespec now;
+	const char *runlevel = getenv("RC_RUNLEVEL");
+	char *level = NULL;
+	char *file, *line;
+	char code[12] = "-";
+	int serrno = errno;
+	int fd, len;
+	bool retval = false;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!runlevel || !*runlevel)
+		runlevel = level = rc_runlevel_get();
+	if (status >= 0)
+		snprintf(code, sizeof(code), "%d", status);
+	len = xasprintf(&line, "%lld.%09ld %s %s %d %s %s\n",
+	    (long long)now.tv_sec, now.tv_nsec, basename_c(service), event,
+	    (int)getpid(), runlevel, code);
+
+	/* Services start in parallel, so each record has to go in one
+	 * write to stay whole */
+	xasprintf(&file, "%s/events", rc_svcdir());
+	if ((fd = open(file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) != -1) {
+		retval = write(fd, line, len) == len;
+		close(fd);
+	}
+	free(file);
+	free(line);
+	free(level);
+	errno = serrno;
+	return retval;
+}
+
+bool
+rc_service_mark(const char *service, const RC_SERVICE state)
+{
+	bool retval = mark_service(service, state);
+	const char *name;
+
+	save_service_state(service);
+	if (retval && (name = rc_parse_service_state(state)))
+		rc_service_event(service, name, -1);
+	return retval;
+}
+
 RC_SERVICE
 rc_service_state(const char *service)
 {
-	int i;
-	int state = RC_SERVICE_STOPPED;
-	char *file;
-	RC_STRINGLIST *dirs;
-	RC_STRING *dir;
 	const char *base = basename_c(service);
 	const char *svcdir = rc_svcdir();
+	int state;
+
+	state = load_service_state(svcdir, base);
+	if (state == -1)
+		state = scan_service_state(svcdir, base);
+
+	if (state & RC_SERVICE_STARTED) {
+		if (rc_service_daemons_crashed(service) && errno != EACCES)
+			state |= RC_SERVICE_CRASHED;
+	}
+
+	return state;
+}
+
+static int
+stated_cmp(const void *key, const void *line)
+{
+	const char *service = *(const char * const *)key;
+	const char *l = *(char * const *)line;
+	size_t len = strlen(service);
+	int r = strncmp(service, l, len);
+
+	if (r != 0)
+		return r;
+	return l[len] == ' ' ? 0 : -1;
+}
+
+/* rc-stated gives us every service it knows about as "service state",
+ * sorted, less RC_SERVICE_CRASHED which it can't see change */
+static bool
+stated_states(const RC_STRINGLIST *services, RC_SERVICE *states)
+{
+	RC_STRINGLIST *reply;
+	RC_STRING *s;
+	char **lines, **found;
+	const char *base;
+	size_t count = 0, i = 0;
+
+	if (!(reply = rc_stated_query("states")))
+		return false;
+	TAILQ_FOREACH(s, reply, entries)
+		count++;
+	lines = xmalloc(sizeof(*lines) * (count ? count : 1));
+	TAILQ_FOREACH(s, reply, entries)
+		lines[i++] = s->value;
+
+	i = 0;
+	TAILQ_FOREACH(s, services, entries) {
+		base = basename_c(s->value);
+		found = bsearch(&base, lines, count, sizeof(*lines), stated_cmp);
+		states[i++] = found ?
+		    (RC_SERVICE)atoi(*found + strlen(base) + 1) : RC_SERVICE_STOPPED;
+	}
+	free(lines);
+	rc_stringlist_free(reply);
+	return true;
+}
+
+static void
+add_crashed(const RC_STRINGLIST *services, RC_SERVICE *states)
+{
+	RC_STRING *service;
+	size_t i = 0;
+
+	TAILQ_FOREACH(service, services, entries) {
+		if (states[i] & RC_SERVICE_STARTED &&
+		    rc_service_daemons_crashed(service->value) &&
+		    errno != EACCES)
+			states[i] |= RC_SERVICE_CRASHED;
+		i++;
+	}
+}
+
+/* List each state directory once rather than checking every state of every
+ * service. RC_SERVICE_CRASHED means looking for daemons, so it is optional. */
+static RC_SERVICE *
+service_states(const RC_STRINGLIST *services, bool crashed)
+{
+	RC_STRINGLIST *lists[ARRAY_SIZE(rc_service_state_names)];
+	RC_STRINGLIST *scheduled, *dirs, *list;
+	RC_STRING *service, *dir, *s;
+	RC_SERVICE *states;
+	const char *svcdir = rc_svcdir();
+	const char *base;
+	char *path;
+	size_t count = 0, i;
+	int state;
+
+	TAILQ_FOREACH(service, services, entries)
+		count++;
+	states = xmalloc(sizeof(*states) * (count ? count : 1));
+
+	if (stated_states(services, states)) {
+		if (crashed)
+			add_crashed(services, states);
+		return states;
+	}
 
 	for (i = 0; rc_service_state_names[i].name; i++) {
-		xasprintf(&file, "%s/%s/%s", svcdir, rc_service_state_names[i].name, base);
-		if (exists(file)) {
+		xasprintf(&path, "%s/%s", svcdir, rc_service_state_names[i].name);
+		/* LS_INITD skips dangling links like exists() does */
+		lists[i] = ls_dir(path, LS_INITD);
+		free(path);
+	}
+	scheduled = rc_stringlist_new();
+	xasprintf(&path, "%s/scheduled", svcdir);
+	dirs = ls_dir(path, 0);
+	TAILQ_FOREACH(dir, dirs, entries) {
+		free(path);
+		xasprintf(&path, "%s/scheduled/%s", svcdir, dir->value);
+		list = ls_dir(path, LS_INITD);
+		TAILQ_FOREACH(s, list, entries)
+			rc_stringlist_addu(scheduled, s->value);
+		rc_stringlist_free(list);
+	}
+	rc_stringlist_free(dirs);
+	free(path);
+
+	count = 0;
+	TAILQ_FOREACH(service, services, entries) {
+		base = basename_c(service->value);
+		state = RC_SERVICE_STOPPED;
+		for (i = 0; rc_service_state_names[i].name; i++) {
+			if (!rc_stringlist_find(lists[i], base))
+				continue;
 			if (rc_service_state_names[i].state <= 0x10)
 				state = rc_service_state_names[i].state;
 			else
 				state |= rc_service_state_names[i].state;
 		}
-		free(file);
+		if (state & RC_SERVICE_STOPPED &&
+		    rc_stringlist_find(scheduled, base))
+			state |= RC_SERVICE_SCHEDULED;
+		states[count++] = state;
 	}
 
-	if (state & RC_SERVICE_STARTED) {
-		if (rc_service_daemons_crashed(service) && errno != EACCES)
-			state |= RC_SERVICE_CRASHED;
+	for (i = 0; rc_service_state_names[i].name; i++)
+		rc_stringlist_free(lists[i]);
+	rc_stringlist_free(scheduled);
+	if (crashed)
+		add_crashed(services, states);
+	return states;
+}
+
+RC_SERVICE *
+rc_service_states(const RC_STRINGLIST *services)
+{
+	return service_states(services, true);
+}
+
+static int
+service_info_cmp(const void *a, const void *b)
+{
+	const RC_SERVICE_INFO *ia = a;
+	const RC_SERVICE_INFO *ib = b;
+
+	return strcmp(ia->service, ib->service);
+}
+
+RC_SNAPSHOT *
+rc_snapshot_load(void)
+{
+	RC_SNAPSHOT *snapshot = xmalloc(sizeof(*snapshot));
+	RC_STRINGLIST *services, *list, *levels;
+	RC_STRING *s, *level;
+	RC_SERVICE_INFO *info;
+	RC_SERVICE *states;
+	const char *svcdir = rc_svcdir();
+	char *path;
+	size_t i, j;
+
+	/* Everything in init.d plus anything with a state, like hotplugged
+	 * services whose script has gone */
+	services = rc_services_in_runlevel(NULL);
+	for (i = 0; rc_service_state_names[i].name; i++) {
+		if (rc_service_state_names[i].state == RC_SERVICE_SCHEDULED)
+			continue;
+		xasprintf(&path, "%s/%s", svcdir, rc_service_state_names[i].name);
+		list = ls_dir(path, 0);
+		free(path);
+		TAILQ_CONCAT(services, list, entries);
+		rc_stringlist_free(list);
 	}
-	if (state & RC_SERVICE_STOPPED) {
-		char *sched_dir;
-		xasprintf(&sched_dir, "%s/scheduled", svcdir);
-		dirs = ls_dir(sched_dir, 0);
-		TAILQ_FOREACH(dir, dirs, entries) {
-			xasprintf(&file, "%s/scheduled/%s/%s", svcdir, dir->value, service);
-			i = exists(file);
-			free(file);
-			if (i) {
-				state |= RC_SERVICE_SCHEDULED;
-				break;
-			}
+	snapshot->count = 0;
+	TAILQ_FOREACH(s, services, entries)
+		snapshot->count++;
+	snapshot->services = xmalloc(sizeof(*snapshot->services) *
+	    (snapshot->count ? snapshot->count : 1));
+	i = 0;
+	TAILQ_FOREACH(s, services, entries) {
+		info = &snapshot->services[i++];
+		memset(info, 0, sizeof(*info));
+		info->service = s->value;
+		s->value = NULL;
+	}
+	rc_stringlist_free(services);
+
+	/* Sort so we can bsearch, dropping services found more than once */
+	qsort(snapshot->services, snapshot->count,
+	    sizeof(*snapshot->services), service_info_cmp);
+	services = rc_stringlist_new();
+	for (i = 0, j = 0; i < snapshot->count; i++) {
+		info = &snapshot->services[i];
+		if (j > 0 && strcmp(snapshot->services[j - 1].service,
+			info->service) == 0)
+		{
+			free(info->service);
+			continue;
 		}
-		rc_stringlist_free(dirs);
-		free(sched_dir);
+		snapshot->services[j++] = *info;
+		rc_stringlist_add(services, info->service);
 	}
+	snapshot->count = j;
 
-	return state;
+	states = service_states(services, false);
+	for (i = 0; i < snapshot->count; i++) {
+		snapshot->services[i].state = states[i];
+		snapshot->services[i].runlevels = rc_stringlist_new();
+	}
+	free(states);
+	rc_stringlist_free(services);
+
+	levels = rc_runlevel_list();
+	TAILQ_FOREACH(level, levels, entries) {
+		list = rc_services_in_runlevel(level->value);
+		TAILQ_FOREACH(s, list, entries)
+			if ((info = rc_snapshot_find(snapshot, s->value)))
+				rc_stringlist_add(info->runlevels,
+				    level->value);
+		rc_stringlist_free(list);
+	}
+	rc_stringlist_free(levels);
+
+	xasprintf(&path, "%s/daemons", svcdir);
+	list = ls_dir(path, 0);
+	free(path);
+	TAILQ_FOREACH(s, list, entries)
+		if ((info = rc_snapshot_find(snapshot, s->value)))
+			info->daemons = true;
+	rc_stringlist_free(list);
+
+	/* Only services which have stored options need reading */
+	xasprintf(&path, "%s/options", svcdir);
+	list = ls_dir(path, 0);
+	free(path);
+	TAILQ_FOREACH(s, list, entries) {
+		if (!(info = rc_snapshot_find(snapshot, s->value)))
+			continue;
+		info->start_time = rc_service_value_get(s->value, "start_time");
+		info->start_count = rc_service_value_get(s->value, "start_count");
+		info->child_pid = rc_service_value_get(s->value, "child_pid");
+		info->last_exit = rc_service_value_get(s->value, "last_exit");
+	}
+	rc_stringlist_free(list);
+
+	return snapshot;
+}
+
+RC_SERVICE_INFO *
+rc_snapshot_find(const RC_SNAPSHOT *snapshot, const char *service)
+{
+	RC_SERVICE_INFO key;
+
+	if (!snapshot || !snapshot->count)
+		return NULL;
+	key.service = UNCONST(basename_c(service));
+	return bsearch(&key, snapshot->services, snapshot->count,
+	    sizeof(*snapshot->services), service_info_cmp);
+}
+
+void
+rc_snapshot_free(RC_SNAPSHOT *snapshot)
+{
+	size_t i;
+
+	if (!snapshot)
+		return;
+	for (i = 0; i < snapshot->count; i++) {
+		free(snapshot->services[i].service);
+		rc_stringlist_free(snapshot->services[i].runlevels);
+		free(snapshot->services[i].start_time);
+		free(snapshot->services[i].start_count);
+		free(snapshot->services[i].child_pid);
+		free(snapshot->services[i].last_exit);
+	}
+	free(snapshot->services);
+	free(snapshot);
 }
 
 char *
@@ -1123,6 +1528,8 @@ rc_service_schedule_start(const char *service, const char *service_to_start)
 	retval = (exists(file2) || symlink(init, file2) == 0);
 	free(file2);
 	free(init);
+	save_service_state(service);
+	save_service_state(service_to_start);
 	return retval;
 }
 
@@ -1131,10 +1538,20 @@ rc_service_schedule_clear(const char *service)
 {
 	char *dir;
 	bool r;
+	int serrno;
+	RC_STRINGLIST *scheduled;
+	RC_STRING *svc;
 
 	xasprintf(&dir, "%s/scheduled/%s", rc_svcdir(), basename_c(service));
+	scheduled = ls_dir(dir, 0);
 	r = rm_dir(dir, true);
 	free(dir);
+	serrno = errno;
+	TAILQ_FOREACH(svc, scheduled, entries)
+		save_service_state(svc->value);
+	rc_stringlist_free(scheduled);
+	save_service_state(service);
+	errno = serrno;
 	if (!r && errno == ENOENT)
 		return true;
 	return false;
@@ -36,6 +36,7 @@
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -55,4 +56,21 @@
 #include "rc.h"
 #include "misc.h"
 
+/* Ask rc-stated for something we would otherwise read from disk, giving
+ * NULL if it isn't running */
+RC_STRINGLIST *rc_stated_query(const char *);
+
+/* FNV-1a, which our binary caches use for their checksums and hashes.
+ * Start a new sum at 2166136261U. */
+uint32_t checksum_update(uint32_t, const void *, size_t);
+
+/* The string table of a binary cache, which strtab_add() grows and gives
+ * the offset of each string added */
+struct strtab {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+uint32_t strtab_add(struct strtab *, const char *);
+
 #endif
@@ -130,6 +130,10 @@ handle_signal(int sig)
 		}
 		break;
 
+	case SIGALRM:
+		/* Only here to interrupt svc_wait */
+		break;
+
 	case SIGWINCH:
 		if (master_tty >= 0) {
 			ioctl(fileno(stdout), TIOCGWINSZ, &ws);
@@ -172,6 +176,9 @@ unhotplug(void)
 	if (exists(file) && unlink(file) != 0)
 		eerror("%s: unlink `%s': %s", applet, file, strerror(errno));
 	free(file);
+
+	/* Our cached state still says hotplugged */
+	forget_service_state(applet);
 }
 
 static void
@@ -509,9 +516,10 @@ svc_wait(const char *svc)
 {
 	char *file = NULL;
 	int fd;
-	bool forever = false;
+	bool forever = false, retval = false;
 	RC_STRINGLIST *keywords;
-	struct timespec timeout, warn;
+	struct timespec start, now;
+	time_t waited, warn = WARN_TIMEOUT;
 
 	/* Some services don't have a timeout, like fsck */
 	keywords = rc_deptree_depend(deptree, svc, "keyword");
@@ -522,50 +530,55 @@ svc_wait(const char *svc)
 
 	xasprintf(&file, "%s/exclusive/%s", rc_svcdir(), basename_c(svc));
 
-	timeout.tv_sec = WAIT_TIMEOUT;
-	timeout.tv_nsec = 0;
-	warn.tv_sec = WARN_TIMEOUT;
-	warn.tv_nsec = 0;
-	for (;;) {
-		fd = open(file, O_RDONLY | O_NONBLOCK);
-		if (fd != -1) {
-			if (flock(fd, LOCK_SH | LOCK_NB) == 0) {
-				close(fd);
-				free(file);
-				return true;
-			}
-			close(fd);
-		}
+	fd = open(file, O_RDONLY | O_NONBLOCK);
+	if (fd == -1) {
 		if (errno == ENOENT) {
 			free(file);
 			return true;
 		}
-		if (errno != EWOULDBLOCK) {
-			eerror("%s: open `%s': %s", applet, file,
-			    strerror(errno));
-			free(file);
-			exit(EXIT_FAILURE);
-		}
-		if (nanosleep(&interval, NULL) == -1) {
-			if (errno != EINTR)
-				goto finish;
-		}
+		eerror("%s: open `%s': %s", applet, file, strerror(errno));
+		free(file);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Block on the lock until the service releases it. SIGALRM
+	 * interrupts us when it's time to warn or give up. */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (;;) {
 		if (!forever) {
-			timespecsub(&timeout, &interval, &timeout);
-			if (timeout.tv_sec <= 0)
-				goto finish;
-			timespecsub(&warn, &interval, &warn);
-			if (warn.tv_sec <= 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			timespecsub(&now, &start, &now);
+			waited = now.tv_sec;
+			if (waited >= WAIT_TIMEOUT)
+				break;
+			if (waited >= warn) {
 				ewarn("%s: waiting for %s (%d seconds)",
-				    applet, svc, (int)timeout.tv_sec);
-				warn.tv_sec = WARN_TIMEOUT;
-				warn.tv_nsec = 0;
+				    applet, svc, (int)(WAIT_TIMEOUT - waited));
+				while (warn <= waited)
+					warn += WARN_TIMEOUT;
 			}
+			alarm((unsigned int)((warn < WAIT_TIMEOUT ?
+			    warn : WAIT_TIMEOUT) - waited));
+		}
+		if (flock(fd, LOCK_SH) == 0) {
+			retval = true;
+			break;
+		}
+		if (errno != EINTR) {
+			eerror("%s: flock `%s': %s", applet, file,
+			    strerror(errno));
+			break;
+		}
+		/* The lock file went away, so nothing holds it */
+		if (!exists(file)) {
+			retval = true;
+			break;
 		}
 	}
-finish:
+	alarm(0);
+	close(fd);
 	free(file);
-	return false;
+	return retval;
 }
 
 static void
@@ -803,17 +816,38 @@ svc_start_deps(void)
 	services = NULL;
 }
 
+/* Remember how long we took so openrc can start the slowest chains first */
+static void
+record_duration(const char *option, const struct timespec *start)
+{
+	struct timespec now;
+	char *value;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, start, &now);
+	xasprintf(&value, "%lld",
+	    (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+	rc_service_value_set(applet, option, value);
+	free(value);
+}
+
 static void svc_start_real(void)
 {
 	bool started;
+	int ret;
 	RC_STRING *svc, *svc2;
+	struct timespec start;
 
 	if (ibsave)
 		setenv("IN_BACKGROUND", ibsave, 1);
 	hook_out = RC_HOOK_SERVICE_START_DONE;
 	rc_plugin_run(RC_HOOK_SERVICE_START_NOW, applet);
 	skip_mark = false;
-	started = (svc_exec("start", NULL) == 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rc_service_event(applet, "start_now", -1);
+	ret = svc_exec("start", NULL);
+	rc_service_event(applet, "start_done", ret);
+	started = (ret == 0);
 	if (ibsave)
 		unsetenv("IN_BACKGROUND");
 
@@ -824,6 +858,7 @@ static void svc_start_real(void)
 
 	if (!skip_mark)
 		rc_service_mark(applet, RC_SERVICE_STARTED);
+	record_duration("start_duration", &start);
 	exclusive_fd = svc_unlock(applet, exclusive_fd);
 	hook_out = RC_HOOK_SERVICE_START_OUT;
 	rc_plugin_run(RC_HOOK_SERVICE_START_DONE, applet);
@@ -1010,6 +1045,8 @@ static void
 svc_stop_real(void)
 {
 	bool stopped;
+	int ret;
+	struct timespec start;
 
 	/* If we're stopping localmount, set LC_ALL=C so that
 	 * bash doesn't load anything blocking the unmounting of /usr */
@@ -1021,7 +1058,11 @@ svc_stop_real(void)
 	hook_out = RC_HOOK_SERVICE_STOP_DONE;
 	rc_plugin_run(RC_HOOK_SERVICE_STOP_NOW, applet);
 	skip_mark = false;
-	stopped = (svc_exec("stop", NULL) == 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rc_service_event(applet, "stop_now", -1);
+	ret = svc_exec("stop", NULL);
+	rc_service_event(applet, "stop_done", ret);
+	stopped = (ret == 0);
 	if (ibsave)
 		unsetenv("IN_BACKGROUND");
 
@@ -1034,6 +1075,8 @@ svc_stop_real(void)
 		else
 		    rc_service_mark(applet, RC_SERVICE_STOPPED);
 	}
+	/* Marking us stopped cleared our options, so this outlives it */
+	record_duration("stop_duration", &start);
 	hook_out = RC_HOOK_SERVICE_STOP_OUT;
 	rc_plugin_run(RC_HOOK_SERVICE_STOP_DONE, applet);
 	hook_out = 0;
@@ -1265,6 +1308,7 @@ int main(int argc, char **argv)
 	signal_setup(SIGQUIT, handle_signal);
 	signal_setup(SIGTERM, handle_signal);
 	signal_setup(SIGCHLD, handle_signal);
+	signal_setup(SIGALRM, handle_signal);
 
 	/* Load our plugins */
 	rc_plugin_load();
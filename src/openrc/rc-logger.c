@@ -16,6 +16,11 @@
  *    except according to the terms contained in the LICENSE file.
  */
 
+#ifdef HAVE_COPY_FILE_RANGE
+/* For copy_file_range() */
+# define _GNU_SOURCE
+#endif
+
 #include <errno.h>
 #include <ctype.h>
 #include <fcntl.h>
@@ -26,11 +31,16 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#  include <sys/sendfile.h>
+#endif
+
 #if defined(__linux__) || (defined(__FreeBSD_kernel__) && defined(__GLIBC__)) \
 	|| defined(__GNU__)
 #  include <pty.h>
@@ -63,40 +73,75 @@ pid_t rc_logger_pid = -1;
 int rc_logger_tty = -1;
 bool rc_in_logger = false;
 
-static void
-write_log(int logfd, const char *buffer, size_t bytes)
+size_t
+rc_logger_strip(char *out, const char *buffer, size_t bytes)
 {
-	const char *p = buffer;
+	const char *p = buffer, *end = buffer + bytes, *esc;
+	char *o = out;
+
+	while (p < end) {
+		if (!in_escape) {
+			/* Copy the printable text up to the next escape */
+			if (!(esc = memchr(p, '\033', end - p)))
+				esc = end;
+			for (; p < esc; p++)
+				if (isprint((unsigned char)*p) || *p == '\n')
+					*o++ = *p;
+			if (p == end)
+				break;
+			in_escape = true;
+			in_term = false;
+			p++;
+			continue;
+		}
 
-	while ((size_t)(p - buffer) < bytes) {
 		switch (*p) {
 		case '\r':
-			goto cont;
+			break;
 		case '\033':
-			in_escape = true;
 			in_term = false;
-			goto cont;
+			break;
 		case '\n':
 			in_escape = in_term = false;
+			*o++ = *p;
 			break;
 		case '[':
-			if (in_escape)
-				in_term = true;
+			in_term = true;
+			break;
+		default:
+			if (!in_term || isalpha((unsigned char)*p))
+				in_escape = in_term = false;
 			break;
 		}
+		p++;
+	}
+	return o - out;
+}
 
-		if (!in_escape) {
-			if (!isprint((int) *p) && *p != '\n')
-				goto cont;
-			if (write(logfd, p++, 1) == -1)
+static void
+write_log(int logfd, const char *buffer, size_t bytes)
+{
+	char out[BUFSIZ];
+	size_t n, len;
+	ssize_t w;
+	char *p;
+
+	while (bytes > 0) {
+		n = bytes < sizeof(out) ? bytes : sizeof(out);
+		len = rc_logger_strip(out, buffer, n);
+		buffer += n;
+		bytes -= n;
+
+		for (p = out; len > 0; p += w, len -= w) {
+			if ((w = write(logfd, p, len)) == -1) {
+				if (errno == EINTR) {
+					w = 0;
+					continue;
+				}
 				eerror("write: %s", strerror(errno));
-			continue;
+				return;
+			}
 		}
-
-		if (!in_term || isalpha((unsigned char)*p))
-			in_escape = in_term = false;
-cont:
-		p++;
 	}
 }
 
@@ -124,6 +169,74 @@ mkpath(const char *path)
 	free(dir);
 }
 
+/* Append everything in from to the end of to, letting the kernel do the
+ * copying where it can. to must not be O_APPEND as neither copy_file_range
+ * nor sendfile allow that. */
+static bool
+append_log(int from, int to)
+{
+	char buffer[BUFSIZ];
+	struct stat st;
+	ssize_t bytes, w;
+	off_t left;
+	char *p;
+
+	if (fstat(from, &st) == -1 || lseek(to, 0, SEEK_END) == -1)
+		return false;
+	left = st.st_size;
+
+	/* Both carry on from the file offsets, so if either gives up part
+	 * way through the next way picks up where it stopped */
+#ifdef HAVE_COPY_FILE_RANGE
+	while (left > 0 &&
+	    (bytes = copy_file_range(from, NULL, to, NULL, left, 0)) > 0)
+		left -= bytes;
+#endif
+#ifdef __linux__
+	while (left > 0 && (bytes = sendfile(to, from, NULL, left)) > 0)
+		left -= bytes;
+#endif
+	if (S_ISREG(st.st_mode) && left <= 0)
+		return true;
+
+	while ((bytes = read(from, buffer, sizeof(buffer))) != 0) {
+		if (bytes == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		for (p = buffer; bytes > 0; p += w, bytes -= w) {
+			if ((w = write(to, p, bytes)) == -1) {
+				if (errno != EINTR)
+					return false;
+				w = 0;
+			}
+		}
+	}
+	return true;
+}
+
+/* Keep the log under rc_log_max_size kilobytes by moving it to .old
+ * before adding to it would go over */
+static void
+rotate_log(const char *logfile, off_t adding)
+{
+	const char *value = rc_conf_value("rc_log_max_size");
+	struct stat st;
+	long long max;
+	char *old;
+
+	if (!value || (max = strtoll(value, NULL, 10)) <= 0)
+		return;
+	if (stat(logfile, &st) == -1 || st.st_size + adding <= max * 1024)
+		return;
+
+	xasprintf(&old, "%s.old", logfile);
+	if (rename(logfile, old) == -1)
+		eerror("Error: rename(%s) failed: %s", logfile, strerror(errno));
+	free(old);
+}
+
 void
 rc_logger_close(void)
 {
@@ -157,7 +270,8 @@ rc_logger_open(const char *level)
 	size_t bytes;
 	int i;
 	FILE *log = NULL;
-	FILE *plog = NULL;
+	int logfd, plogfd;
+	struct stat st;
 	const char *logfile;
 	char *tmplog, *usrlog = NULL;
 	int log_error = 0;
@@ -282,22 +396,21 @@ rc_logger_open(const char *level)
 			eerrorx("Please change rc_log_path to something other than %s to get rid of this message", tmplog);
 		}
 
-		if ((plog = fopen(logfile, "ae"))) {
-			if ((log = fopen(tmplog, "re"))) {
-				while ((bytes = fread(buffer, sizeof(*buffer), BUFSIZ, log)) > 0) {
-					if (fwrite(buffer, sizeof(*buffer), bytes, plog) < bytes) {
-						log_error = 1;
-						eerror("Error: write(%s) failed: %s", logfile, strerror(errno));
-						break;
-					}
+		if (stat(tmplog, &st) == 0)
+			rotate_log(logfile, st.st_size);
+		if ((plogfd = open(logfile, O_WRONLY | O_CREAT | O_CLOEXEC, 0666)) != -1) {
+			if ((logfd = open(tmplog, O_RDONLY | O_CLOEXEC)) != -1) {
+				if (!append_log(logfd, plogfd)) {
+					log_error = 1;
+					eerror("Error: write(%s) failed: %s", logfile, strerror(errno));
 				}
-				fclose(log);
+				close(logfd);
 			} else {
 				log_error = 1;
-				eerror("Error: fopen(%s) failed: %s", tmplog, strerror(errno));
+				eerror("Error: open(%s) failed: %s", tmplog, strerror(errno));
 			}
 
-			fclose(plog);
+			close(plogfd);
 		} else {
 			/*
 			 * logfile or its basedir may be read-only during sysinit and
@@ -305,7 +418,7 @@ rc_logger_open(const char *level)
 			 */
 			if (errno != EROFS && ((strcmp(level, RC_LEVEL_SHUTDOWN) != 0) && (strcmp(level, RC_LEVEL_SYSINIT) != 0))) {
 				log_error = 1;
-				eerror("Error: fopen(%s) failed: %s", logfile, strerror(errno));
+				eerror("Error: open(%s) failed: %s", logfile, strerror(errno));
 			}
 		}
 
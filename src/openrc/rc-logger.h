@@ -23,4 +23,9 @@ extern bool rc_in_logger;
 void rc_logger_open(const char *runlevel);
 void rc_logger_close(void);
 
+/* Copies bytes from buffer to out, which must be as big, leaving out
+ * terminal escapes, carriage returns and anything else unprintable.
+ * Returns the number of bytes copied. */
+size_t rc_logger_strip(char *out, const char *buffer, size_t bytes);
+
 #endif
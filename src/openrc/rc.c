@@ -26,6 +26,7 @@
 #include <libgen.h>
 #include <pwd.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
@@ -110,6 +111,9 @@ clean_failed(void)
 				eerror("%s: unlink `%s': %s",
 				    applet, path, strerror(errno));
 			free(path);
+
+			/* and the cached state which still says failed */
+			forget_service_state(d->d_name);
 		}
 		closedir(dp);
 	}
@@ -428,18 +432,17 @@ handle_signal(int sig)
 
 	switch (sig) {
 	case SIGCHLD:
-		do {
-			pid = waitpid(-1, &status, WNOHANG);
+		/* Signals do not queue, so reap everything that has exited */
+		while ((pid = waitpid(-1, &status, WNOHANG)) != 0) {
 			if (pid < 0) {
 				if (errno != ECHILD)
 					eerror("waitpid: %s", strerror(errno));
-				return;
+				break;
 			}
-		} while (!WIFEXITED(status) && !WIFSIGNALED(status));
-
-		/* Remove that pid from our list */
-		if (pid > 0)
-			remove_pid(pid, true);
+			/* Remove that pid from our list */
+			if (WIFEXITED(status) || WIFSIGNALED(status))
+				remove_pid(pid, true);
+		}
 		break;
 
 	case SIGWINCH:
@@ -660,13 +663,396 @@ stop:
 	rc_stringlist_free(nostop);
 }
 
+/* Returns the pid of the started service, 0 if we skipped it or -1 if we
+ * should stop starting services altogether. */
+static pid_t
+start_service(const char *service, bool crashed, bool *interactive)
+{
+	RC_SERVICE state;
+
+	state = rc_service_state(service);
+	if (state & RC_SERVICE_FAILED)
+		return 0;
+	if (!(state & RC_SERVICE_STOPPED)) {
+		if (crashed && rc_service_daemons_crashed(service))
+			rc_service_mark(service, RC_SERVICE_STOPPED);
+		else
+			return 0;
+	}
+	if (!*interactive)
+		*interactive = want_interactive();
+
+	if (*interactive) {
+interactive_retry:
+		printf("\n");
+		einfo("About to start the service %s", service);
+		eindent();
+		einfo("1) Start the service\t\t2) Skip the service");
+		einfo("3) Continue boot process\t\t4) Exit to shell");
+		eoutdent();
+interactive_option:
+		switch (read_key(true)) {
+		case '1': break;
+		case '2': return 0;
+		case '3': *interactive = false; break;
+		case '4': open_shell(); goto interactive_retry;
+		default: goto interactive_option;
+		}
+	}
+
+	return service_start(service);
+}
+
+/* How long services took to start and stop in milliseconds, kept in
+ * $svcdir/durations as savecache carries it over to the next boot while
+ * the options dir is cleared whenever a service stops. */
+struct duration {
+	char *service;
+	long start;
+	long stop;
+};
+
+static struct duration *
+load_durations(size_t *count)
+{
+	struct duration *durations = NULL;
+	char *file, *line = NULL, *p;
+	size_t len = 0;
+	FILE *fp;
+
+	*count = 0;
+	xasprintf(&file, "%s/durations", rc_svcdir());
+	fp = fopen(file, "r");
+	free(file);
+	if (!fp)
+		return NULL;
+	while (xgetline(&line, &len, fp) != -1) {
+		p = line;
+		durations = xrealloc(durations,
+		    sizeof(*durations) * (*count + 1));
+		durations[*count].service = xstrdup(strsep(&p, " "));
+		durations[*count].start = durations[*count].stop = 0;
+		if (p)
+			durations[*count].start = strtol(strsep(&p, " "),
+			    NULL, 10);
+		if (p)
+			durations[*count].stop = strtol(p, NULL, 10);
+		(*count)++;
+	}
+	free(line);
+	fclose(fp);
+	return durations;
+}
+
+static void
+free_durations(struct duration *durations, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		free(durations[i].service);
+	free(durations);
+}
+
+static struct duration *
+find_duration(struct duration *durations, size_t count, const char *service)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		if (strcmp(durations[i].service, service) == 0)
+			return &durations[i];
+	return NULL;
+}
+
+/* openrc-run leaves start_duration and stop_duration in the options of the
+ * services it ran, so fold those into $svcdir/durations. */
+static void
+save_durations(const RC_STRINGLIST *services)
+{
+	struct duration *durations, *d;
+	const RC_STRING *service;
+	char *start, *stop, *file, *tmp;
+	size_t count, i;
+	FILE *fp;
+
+	if (!services)
+		return;
+	durations = load_durations(&count);
+	TAILQ_FOREACH(service, services, entries) {
+		start = rc_service_value_get(service->value, "start_duration");
+		stop = rc_service_value_get(service->value, "stop_duration");
+		if (start || stop) {
+			d = find_duration(durations, count, service->value);
+			if (!d) {
+				durations = xrealloc(durations,
+				    sizeof(*durations) * (count + 1));
+				d = &durations[count++];
+				d->service = xstrdup(service->value);
+				d->start = d->stop = 0;
+			}
+			if (start)
+				d->start = strtol(start, NULL, 10);
+			if (stop)
+				d->stop = strtol(stop, NULL, 10);
+		}
+		free(start);
+		free(stop);
+	}
+
+	xasprintf(&file, "%s/durations", rc_svcdir());
+	xasprintf(&tmp, "%s.%d", file, getpid());
+	if ((fp = fopen(tmp, "w"))) {
+		for (i = 0; i < count; i++)
+			fprintf(fp, "%s %ld %ld\n", durations[i].service,
+			    durations[i].start, durations[i].stop);
+		if (fclose(fp) == 0 && rename(tmp, file) == 0)
+			tmp[0] = '\0';
+	}
+	if (tmp[0])
+		unlink(tmp);
+	free(tmp);
+	free(file);
+	free_durations(durations, count);
+}
+
+/* A service queued by the parallel scheduler */
+struct sched_service {
+	const char *name;
+	pid_t pid;
+	bool started;
+	bool done;
+	size_t ndeps;
+	size_t *deps;
+	/* Longest time from starting us to the end of any chain of
+	 * services in start_services which depend on us */
+	long chain;
+};
+
+static struct sched_service *
+sched_find(struct sched_service *svcs, size_t count, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		if (strcmp(svcs[i].name, name) == 0)
+			return &svcs[i];
+	return NULL;
+}
+
+static void
+sched_add_dep(struct sched_service *svcs, struct sched_service *svc,
+    const char *name)
+{
+	struct sched_service *dep = sched_find(svcs, svc - svcs, name);
+	size_t i;
+
+	/* start_services is in dependency order, so anything we have to wait
+	 * for comes before us. Anything after us is part of a loop and the
+	 * children sort that out between themselves as before. */
+	if (!dep)
+		return;
+	for (i = 0; i < svc->ndeps; i++)
+		if (svc->deps[i] == (size_t)(dep - svcs))
+			return;
+	svc->deps = xrealloc(svc->deps, sizeof(*svc->deps) * (svc->ndeps + 1));
+	svc->deps[svc->ndeps++] = dep - svcs;
+}
+
+static void
+sched_depends(struct sched_service *svcs, struct sched_service *svc)
+{
+	RC_STRINGLIST *deps, *providers;
+	RC_STRING *type, *dep, *provider;
+
+	TAILQ_FOREACH(type, main_types_nwua, entries) {
+		deps = rc_deptree_depend(main_deptree, svc->name, type->value);
+		TAILQ_FOREACH(dep, deps, entries) {
+			/* Virtual services are satisfied by their providers */
+			providers = rc_deptree_depend(main_deptree, dep->value,
+			    "providedby");
+			if (TAILQ_FIRST(providers)) {
+				TAILQ_FOREACH(provider, providers, entries)
+					sched_add_dep(svcs, svc, provider->value);
+			} else
+				sched_add_dep(svcs, svc, dep->value);
+			rc_stringlist_free(providers);
+		}
+		rc_stringlist_free(deps);
+	}
+}
+
+static bool
+sched_ready(const struct sched_service *svcs, const struct sched_service *svc)
+{
+	size_t i;
+
+	for (i = 0; i < svc->ndeps; i++)
+		if (!svcs[svc->deps[i]].done)
+			return false;
+	return true;
+}
+
+/* Work out the longest chain through each service, so the services gating
+ * the most work can be started first. */
+static void
+sched_weigh(struct sched_service *svcs, size_t count)
+{
+	struct duration *durations, *d;
+	struct sched_service *svc;
+	char *value;
+	long tail;
+	size_t ndurations, i, j;
+
+	durations = load_durations(&ndurations);
+	for (i = count; i-- > 0;) {
+		svc = &svcs[i];
+		/* svc->chain holds the longest chain of our dependents */
+		tail = svc->chain;
+		if ((value = rc_service_value_get(svc->name, "start_duration"))) {
+			svc->chain = strtol(value, NULL, 10);
+			free(value);
+		} else if ((d = find_duration(durations, ndurations, svc->name)))
+			svc->chain = d->start;
+		else
+			svc->chain = 0;
+		if (svc->chain < 0)
+			svc->chain = 0;
+		svc->chain += tail;
+		for (j = 0; j < svc->ndeps; j++)
+			if (svcs[svc->deps[j]].chain < svc->chain)
+				svcs[svc->deps[j]].chain = svc->chain;
+	}
+	free_durations(durations, ndurations);
+}
+
+static int
+sched_cmp(const void *a, const void *b)
+{
+	const struct sched_service *sa = *(struct sched_service * const *)a;
+	const struct sched_service *sb = *(struct sched_service * const *)b;
+
+	if (sa->chain != sb->chain)
+		return sa->chain > sb->chain ? -1 : 1;
+	return sa < sb ? -1 : sa > sb;
+}
+
+/* Our SIGCHLD handler takes exited children off service_pids via
+ * remove_pid(), so anything still on it is running. */
+static bool
+pid_running(pid_t pid)
+{
+	RC_PID *p;
+
+	LIST_FOREACH(p, &service_pids, entries)
+		if (p->pid == pid)
+			return true;
+	return false;
+}
+
+static size_t
+parallel_jobs(void)
+{
+	const char *value = rc_conf_value("rc_parallel_jobs");
+	long jobs = 0;
+
+	if (value)
+		jobs = strtol(value, NULL, 10);
+	return jobs > 0 ? (size_t)jobs : SIZE_MAX;
+}
+
+/* Start services as soon as everything they depend on in start_services has
+ * finished, at most rc_parallel_jobs at a time, instead of forking them all
+ * and leaving each child to block on its dependencies. */
+static void
+schedule_start_services(const RC_STRINGLIST *start_services, bool crashed,
+    bool *interactive)
+{
+	struct sched_service *svcs, **order, *svc;
+	RC_STRING *service;
+	sigset_t sset, old;
+	size_t count = 0, running = 0, jobs = parallel_jobs(), i;
+	bool stop = false, exited;
+
+	TAILQ_FOREACH(service, start_services, entries)
+		count++;
+	if (count == 0)
+		return;
+	svcs = xmalloc(sizeof(*svcs) * count);
+	memset(svcs, 0, sizeof(*svcs) * count);
+	order = xmalloc(sizeof(*order) * count);
+	i = 0;
+	TAILQ_FOREACH(service, start_services, entries) {
+		order[i] = &svcs[i];
+		svcs[i++].name = service->value;
+	}
+	for (i = 0; i < count; i++)
+		sched_depends(svcs, &svcs[i]);
+	sched_weigh(svcs, count);
+	qsort(order, count, sizeof(*order), sched_cmp);
+
+	sigemptyset(&sset);
+	sigaddset(&sset, SIGCHLD);
+	for (;;) {
+		/* A chain through a service is never shorter than one through
+		 * its dependents, so dependencies still come first in order
+		 * and one pass finds everything a finished service made
+		 * ready. */
+		for (i = 0; i < count && !stop && running < jobs; i++) {
+			svc = order[i];
+			if (svc->started || !sched_ready(svcs, svc))
+				continue;
+			svc->started = true;
+			svc->pid = start_service(svc->name, crashed, interactive);
+			if (svc->pid > 0) {
+				add_pid(svc->pid);
+				running++;
+				/* If it exited before we added it, SIGCHLD
+				 * has already reaped it without us knowing. */
+				sigprocmask(SIG_BLOCK, &sset, &old);
+				if (waitpid(svc->pid, NULL, WNOHANG) != 0)
+					remove_pid(svc->pid, false);
+				sigprocmask(SIG_SETMASK, &old, NULL);
+			} else {
+				if (svc->pid == -1)
+					stop = true;
+				svc->done = true;
+			}
+		}
+
+		if (running == 0)
+			break;
+
+		/* Wait for a child to exit and release its dependents */
+		sigprocmask(SIG_BLOCK, &sset, &old);
+		exited = false;
+		for (i = 0; i < count; i++) {
+			svc = &svcs[i];
+			if (svc->pid > 0 && !svc->done &&
+			    !pid_running(svc->pid))
+			{
+				svc->done = true;
+				running--;
+				exited = true;
+			}
+		}
+		if (!exited)
+			sigsuspend(&old);
+		sigprocmask(SIG_SETMASK, &old, NULL);
+	}
+
+	for (i = 0; i < count; i++)
+		free(svcs[i].deps);
+	free(order);
+	free(svcs);
+}
+
 static void
 do_start_services(const RC_STRINGLIST *start_services, bool parallel)
 {
 	RC_STRING *service;
 	pid_t pid;
 	bool interactive = false;
-	RC_SERVICE state;
 	bool crashed = false;
 	char *interactive_dir;
 
@@ -678,47 +1064,16 @@ do_start_services(const RC_STRINGLIST *start_services, bool parallel)
 	if (errno == ENOENT)
 		crashed = true;
 
-	TAILQ_FOREACH(service, start_services, entries) {
-		state = rc_service_state(service->value);
-		if (state & RC_SERVICE_FAILED)
-			continue;
-		if (!(state & RC_SERVICE_STOPPED)) {
-			if (crashed &&
-			    rc_service_daemons_crashed(service->value))
-				rc_service_mark(service->value,
-				    RC_SERVICE_STOPPED);
-			else
-			    continue;
-		}
-		if (!interactive)
-			interactive = want_interactive();
-
-		if (interactive) {
-	interactive_retry:
-			printf("\n");
-			einfo("About to start the service %s",
-			    service->value);
-			eindent();
-			einfo("1) Start the service\t\t2) Skip the service");
-			einfo("3) Continue boot process\t\t4) Exit to shell");
-			eoutdent();
-	interactive_option:
-			switch (read_key(true)) {
-			case '1': break;
-			case '2': continue;
-			case '3': interactive = false; break;
-			case '4': open_shell(); goto interactive_retry;
-			default: goto interactive_option;
-			}
-		}
-
-		pid = service_start(service->value);
-		if (pid == -1)
-			break;
-		/* Remember the pid if we're running in parallel */
-		if (pid > 0) {
-			add_pid(pid);
-			if (!parallel) {
+	if (parallel) {
+		schedule_start_services(start_services, crashed, &interactive);
+	} else {
+		TAILQ_FOREACH(service, start_services, entries) {
+			pid = start_service(service->value, crashed,
+			    &interactive);
+			if (pid == -1)
+				break;
+			if (pid > 0) {
+				add_pid(pid);
 				rc_waitpid(pid);
 				remove_pid(pid, false);
 			}
@@ -770,6 +1125,9 @@ int main(int argc, char **argv)
 	RC_STRINGLIST *deporder = NULL;
 	RC_STRINGLIST *tmplist;
 	RC_STRING *service;
+	RC_SNAPSHOT *snapshot;
+	RC_SERVICE_INFO *info;
+	size_t i;
 	bool going_down = false;
 	int depoptions = RC_DEP_STRICT | RC_DEP_TRACE;
 	const char *svcdir;
@@ -1004,17 +1362,21 @@ int main(int argc, char **argv)
 	* all those services which have been started, are inactive or
 	* are currently starting.  Clearly, some of these will be listed
 	* in the new or current runlevel so we won't actually be stopping
-	* them all.
+	* them all. The snapshot is sorted by name already.
 	*/
-	main_stop_services = rc_services_in_state(RC_SERVICE_STARTED);
-	tmplist = rc_services_in_state(RC_SERVICE_INACTIVE);
-	TAILQ_CONCAT(main_stop_services, tmplist, entries);
-	free(tmplist);
-	tmplist = rc_services_in_state(RC_SERVICE_STARTING);
-	TAILQ_CONCAT(main_stop_services, tmplist, entries);
-	free(tmplist);
-	if (main_stop_services)
-		rc_stringlist_sort(&main_stop_services);
+	snapshot = rc_snapshot_load();
+	main_stop_services = rc_stringlist_new();
+	main_hotplugged_services = rc_stringlist_new();
+	for (i = 0; i < snapshot->count; i++) {
+		info = &snapshot->services[i];
+		if (info->state & (RC_SERVICE_STARTED | RC_SERVICE_INACTIVE |
+			RC_SERVICE_STARTING))
+			rc_stringlist_add(main_stop_services, info->service);
+		if (info->state & RC_SERVICE_HOTPLUGGED)
+			rc_stringlist_add(main_hotplugged_services,
+			    info->service);
+	}
+	rc_snapshot_free(snapshot);
 
 	main_types_nwua = rc_stringlist_new();
 	rc_stringlist_add(main_types_nwua, "ineed");
@@ -1034,7 +1396,6 @@ int main(int argc, char **argv)
 	 * runlevels.  Clearly, some of these will already be started so we
 	 * won't actually be starting them all.
 	 */
-	main_hotplugged_services = rc_services_in_state(RC_SERVICE_HOTPLUGGED);
 	main_start_services = rc_services_in_runlevel_stacked(newlevel ?
 	    newlevel : runlevel);
 	if (strcmp(newlevel ? newlevel : runlevel, RC_LEVEL_SHUTDOWN) != 0 &&
@@ -1072,6 +1433,8 @@ int main(int argc, char **argv)
 
 	/* Wait for our services to finish */
 	wait_for_services();
+	if (main_stop_services && !nostop)
+		save_durations(main_stop_services);
 
 	/* Notify the plugins we have finished */
 	rc_plugin_run(RC_HOOK_RUNLEVEL_STOP_OUT,
@@ -1141,6 +1504,7 @@ int main(int argc, char **argv)
 
 			/* Wait for our services to finish */
 			wait_for_services();
+			save_durations(run_services);
 
 			/* Free the list of services, we're done with it. */
 			rc_stringlist_free(run_services);
@@ -0,0 +1,611 @@
+/*
+ * rc-analyze
+ * Report where the time went starting and stopping services, from the
+ * event log librc keeps in the service directory
+ */
+
+/*
+ * Copyright (c) 2007-2015 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/HEAD/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/HEAD/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "einfo.h"
+#include "queue.h"
+#include "rc.h"
+#include "misc.h"
+#include "_usage.h"
+#include "helpers.h"
+
+enum phase { PHASE_START, PHASE_STOP };
+
+/* When a service was marked starting or stopping, so began waiting on its
+ * dependencies, when it ran its start or stop function and how that went */
+struct span {
+	double wait;
+	double now;
+	double done;
+	int status;
+};
+
+struct service {
+	char *name;
+	struct span span[2];
+};
+
+enum event { EVENT_WAIT, EVENT_NOW, EVENT_DONE };
+
+static const struct {
+	const char *name;
+	enum phase phase;
+	enum event event;
+} events[] = {
+	{ "starting",   PHASE_START, EVENT_WAIT },
+	{ "start_now",  PHASE_START, EVENT_NOW },
+	{ "start_done", PHASE_START, EVENT_DONE },
+	{ "stopping",   PHASE_STOP,  EVENT_WAIT },
+	{ "stop_now",   PHASE_STOP,  EVENT_NOW },
+	{ "stop_done",  PHASE_STOP,  EVENT_DONE },
+};
+
+/* Layout of the chart, in pixels */
+#define GRAPH_WIDTH	1000
+#define GRAPH_MARGIN	20
+#define GRAPH_LABELS	300
+#define GRAPH_ROW	20
+
+const char *applet = NULL;
+const char *extraopts = "[service]";
+const char getoptstring[] = "bcgr:sf:F:" getoptstring_COMMON;
+const struct option longopts[] = {
+	{ "blame",          0, NULL, 'b'},
+	{ "critical-chain", 0, NULL, 'c'},
+	{ "graph",          0, NULL, 'g'},
+	{ "runlevel",       1, NULL, 'r'},
+	{ "stop",           0, NULL, 's'},
+	{ "file",           1, NULL, 'f'},
+	{ "deptree-file",   1, NULL, 'F'},
+	longopts_COMMON
+};
+const char * const longopts_help[] = {
+	"List services by how long they took",
+	"Show what the last service, or the one given, waited on",
+	"Draw an SVG timeline of the services",
+	"Only count events in this runlevel",
+	"Report on stopping services instead of starting them",
+	"Event log to read",
+	"File to load cached deptree from",
+	longopts_help_COMMON
+};
+const char *usagestring = NULL;
+
+/* What a service waits on before it can start or stop */
+static const char *const blockers[2][4] = {
+	[PHASE_START] = { "ineed", "iwant", "iuse", "iafter" },
+	[PHASE_STOP]  = { "needsme", "wantsme", "usesme", "ibefore" },
+};
+
+static struct service *services;
+static size_t nservices;
+
+static struct service *
+find_service(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < nservices; i++)
+		if (strcmp(services[i].name, name) == 0)
+			return &services[i];
+	return NULL;
+}
+
+static struct service *
+add_service(const char *name)
+{
+	struct service *svc = find_service(name);
+	int i;
+
+	if (svc)
+		return svc;
+	services = xrealloc(services, sizeof(*services) * (nservices + 1));
+	svc = &services[nservices++];
+	svc->name = xstrdup(name);
+	for (i = PHASE_START; i <= PHASE_STOP; i++) {
+		svc->span[i].wait = svc->span[i].now = svc->span[i].done = -1;
+		svc->span[i].status = -1;
+	}
+	return svc;
+}
+
+/* Boot is the first time each service starts, shutdown the last time
+ * each one stops, so restarts in between don't count against either */
+static void
+add_event(double t, const char *name, const char *event, const char *status)
+{
+	struct span *span;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(events); i++)
+		if (strcmp(events[i].name, event) == 0)
+			break;
+	if (i == ARRAY_SIZE(events))
+		return;
+
+	span = &add_service(name)->span[events[i].phase];
+	if (events[i].event == EVENT_DONE) {
+		if (span->now >= 0 && span->done < 0) {
+			span->done = t;
+			span->status = *status == '-' ? -1 : atoi(status);
+		}
+		return;
+	}
+
+	if (events[i].phase == PHASE_START && span->done >= 0)
+		return;
+	if (events[i].event == EVENT_WAIT || span->wait < 0)
+		span->wait = t;
+	span->now = events[i].event == EVENT_NOW ? t : -1;
+	span->done = -1;
+}
+
+static void
+load_events(const char *file, const char *runlevel)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t len = 0;
+	char *p, *when, *name, *event, *level, *status;
+
+	if (!(fp = fopen(file, "r")))
+		eerrorx("%s: fopen `%s': %s", applet, file, strerror(errno));
+
+	while (xgetline(&line, &len, fp) != -1) {
+		p = line;
+		when = strsep(&p, " ");
+		name = strsep(&p, " ");
+		event = strsep(&p, " ");
+		/* pid */
+		strsep(&p, " ");
+		level = strsep(&p, " ");
+		status = strsep(&p, " ");
+		if (!when || !name || !event || !level || !status)
+			continue;
+		if (runlevel && strcmp(level, runlevel) != 0)
+			continue;
+		add_event(strtod(when, NULL), name, event, status);
+	}
+	free(line);
+	fclose(fp);
+}
+
+static bool
+complete(const struct service *svc, enum phase phase)
+{
+	return svc->span[phase].now >= 0 && svc->span[phase].done >= 0;
+}
+
+static int
+duration_cmp(const void *a, const void *b, enum phase phase)
+{
+	const struct service *sa = a, *sb = b;
+	double da = sa->span[phase].done - sa->span[phase].now;
+	double db = sb->span[phase].done - sb->span[phase].now;
+
+	if (da != db)
+		return da < db ? 1 : -1;
+	return strcmp(sa->name, sb->name);
+}
+
+static int
+start_cmp(const void *a, const void *b)
+{
+	return duration_cmp(a, b, PHASE_START);
+}
+
+static int
+stop_cmp(const void *a, const void *b)
+{
+	return duration_cmp(a, b, PHASE_STOP);
+}
+
+static void
+print_summary(enum phase phase)
+{
+	double first = -1, last = -1;
+	size_t i, n = 0;
+
+	for (i = 0; i < nservices; i++) {
+		if (!complete(&services[i], phase))
+			continue;
+		if (first < 0 || services[i].span[phase].now < first)
+			first = services[i].span[phase].now;
+		if (services[i].span[phase].done > last)
+			last = services[i].span[phase].done;
+		n++;
+	}
+	if (n == 0)
+		eerrorx("%s: no services have %s yet", applet,
+		    phase == PHASE_START ? "started" : "stopped");
+
+	printf("%s %zu services from %.3fs to %.3fs after boot, taking %.3fs\n",
+	    phase == PHASE_START ? "Started" : "Stopped",
+	    n, first, last, last - first);
+}
+
+static void
+print_blame(enum phase phase)
+{
+	struct service *sorted = xmalloc(sizeof(*sorted) * nservices);
+	const struct span *span;
+	size_t i, n = 0;
+
+	for (i = 0; i < nservices; i++)
+		if (complete(&services[i], phase))
+			sorted[n++] = services[i];
+	qsort(sorted, n, sizeof(*sorted),
+	    phase == PHASE_START ? start_cmp : stop_cmp);
+
+	for (i = 0; i < n; i++) {
+		span = &sorted[i].span[phase];
+		printf("%9.3fs %s", span->done - span->now, sorted[i].name);
+		if (span->status > 0)
+			printf(" (exited %d)", span->status);
+		else if (span->status < 0)
+			printf(" (did not run)");
+		printf("\n");
+	}
+	free(sorted);
+}
+
+/* Fill deps with the services svc had to wait on which finished before it
+ * could go. deps needs room for every service. */
+static size_t
+waited_on(const RC_DEPTREE *deptree, const struct service *svc,
+    enum phase phase, struct service **deps)
+{
+	struct service *dep;
+	RC_STRINGLIST *list, *providers;
+	RC_STRING *s, *p;
+	size_t i, j, n = 0;
+
+	for (i = 0; i < ARRAY_SIZE(blockers[phase]); i++) {
+		list = rc_deptree_depend(deptree, svc->name, blockers[phase][i]);
+		TAILQ_FOREACH(s, list, entries) {
+			/* Virtual services are held up by what provides them */
+			providers = rc_deptree_depend(deptree, s->value, "providedby");
+			if (!TAILQ_FIRST(providers))
+				rc_stringlist_add(providers, s->value);
+			TAILQ_FOREACH(p, providers, entries) {
+				dep = find_service(p->value);
+				if (!dep || dep == svc || !complete(dep, phase))
+					continue;
+				if (dep->span[phase].done > svc->span[phase].now)
+					continue;
+				for (j = 0; j < n; j++)
+					if (deps[j] == dep)
+						break;
+				if (j == n)
+					deps[n++] = dep;
+			}
+			rc_stringlist_free(providers);
+		}
+		rc_stringlist_free(list);
+	}
+	return n;
+}
+
+/* Of everything svc had to wait on, the one that finished last is what
+ * held it up */
+static struct service *
+blocked_by(const RC_DEPTREE *deptree, const struct service *svc,
+    enum phase phase)
+{
+	struct service **deps = xmalloc(sizeof(*deps) * nservices);
+	struct service *best = NULL;
+	size_t i, n;
+
+	n = waited_on(deptree, svc, phase, deps);
+	for (i = 0; i < n; i++)
+		if (!best || deps[i]->span[phase].done > best->span[phase].done)
+			best = deps[i];
+	free(deps);
+	return best;
+}
+
+static void
+print_chain(const RC_DEPTREE *deptree, const char *name, enum phase phase)
+{
+	struct service *svc = NULL;
+	const struct span *span;
+	double first = -1;
+	size_t i, depth;
+
+	for (i = 0; i < nservices; i++) {
+		if (!complete(&services[i], phase))
+			continue;
+		if (first < 0 || services[i].span[phase].now < first)
+			first = services[i].span[phase].now;
+		if (!name && (!svc ||
+			services[i].span[phase].done > svc->span[phase].done))
+			svc = &services[i];
+	}
+	if (name && (!(svc = find_service(name)) || !complete(svc, phase)))
+		eerrorx("%s: no %s recorded for `%s'", applet,
+		    phase == PHASE_START ? "start" : "stop", name);
+	if (!svc)
+		return;
+
+	/* Every step goes back in time, so this is just a guard against a
+	 * service finishing as its dependant starts */
+	for (depth = 0; svc && depth < nservices; depth++) {
+		span = &svc->span[phase];
+		printf("%*s%s @%.3fs +%.3fs\n", (int)depth, "", svc->name,
+		    span->done - first, span->done - span->now);
+		svc = blocked_by(deptree, svc, phase);
+	}
+}
+
+static void
+print_xml(const char *s)
+{
+	for (; *s; s++) {
+		switch (*s) {
+		case '<':
+			fputs("&lt;", stdout);
+			break;
+		case '>':
+			fputs("&gt;", stdout);
+			break;
+		case '&':
+			fputs("&amp;", stdout);
+			break;
+		case '"':
+			fputs("&quot;", stdout);
+			break;
+		default:
+			putchar(*s);
+		}
+	}
+}
+
+static int
+wait_cmp(const void *a, const void *b, enum phase phase)
+{
+	const struct service *sa = *(struct service * const *)a;
+	const struct service *sb = *(struct service * const *)b;
+
+	if (sa->span[phase].wait != sb->span[phase].wait)
+		return sa->span[phase].wait < sb->span[phase].wait ? -1 : 1;
+	return strcmp(sa->name, sb->name);
+}
+
+static int
+start_wait_cmp(const void *a, const void *b)
+{
+	return wait_cmp(a, b, PHASE_START);
+}
+
+static int
+stop_wait_cmp(const void *a, const void *b)
+{
+	return wait_cmp(a, b, PHASE_STOP);
+}
+
+/* A Gantt chart of the services in the order they began, each showing the
+ * time spent waiting on dependencies and then running, with lines from
+ * what each one waited on. The line from what held it up is drawn
+ * heavier, so following those from the end traces the critical chain. */
+static void
+print_graph(const RC_DEPTREE *deptree, enum phase phase)
+{
+	static const double steps[] = {
+		0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1, 2, 5, 10, 15, 30, 60,
+		120, 300, 600, 1800, 3600,
+	};
+	struct service **rows = xmalloc(sizeof(*rows) * nservices);
+	struct service **deps = xmalloc(sizeof(*deps) * nservices);
+	struct service *critical;
+	const struct span *span;
+	double first, last = 0, scale, step, t;
+	size_t i, j, k, n = 0, ndeps;
+
+	for (i = 0; i < nservices; i++)
+		if (complete(&services[i], phase))
+			rows[n++] = &services[i];
+	if (n == 0)
+		eerrorx("%s: no services have %s yet", applet,
+		    phase == PHASE_START ? "started" : "stopped");
+	qsort(rows, n, sizeof(*rows),
+	    phase == PHASE_START ? start_wait_cmp : stop_wait_cmp);
+
+	first = rows[0]->span[phase].wait;
+	for (i = 0; i < n; i++)
+		if (rows[i]->span[phase].done - first > last)
+			last = rows[i]->span[phase].done - first;
+	scale = GRAPH_WIDTH / (last > 0 ? last : 1);
+	for (i = 0; i < ARRAY_SIZE(steps) - 1; i++)
+		if (last / steps[i] <= 20)
+			break;
+	step = steps[i];
+
+#define X(t) (GRAPH_MARGIN + ((t) - first) * scale)
+#define Y(row) (GRAPH_MARGIN * 2 + (double)(row) * GRAPH_ROW)
+
+	printf("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+	printf("<svg xmlns=\"http://www.w3.org/2000/svg\" "
+	    "width=\"%d\" height=\"%.0f\">\n",
+	    GRAPH_MARGIN * 2 + GRAPH_WIDTH + GRAPH_LABELS, Y(n) + GRAPH_MARGIN);
+	printf("<style>\n"
+	    "text { font: 12px sans-serif; }\n"
+	    ".grid { stroke: #ddd; }\n"
+	    ".wait { fill: #ccc; }\n"
+	    ".run { fill: #4a7ebb; }\n"
+	    ".failed { fill: #c33; }\n"
+	    ".edge { stroke: #888; stroke-opacity: 0.4; fill: none; }\n"
+	    ".critical { stroke: #c60; stroke-opacity: 1; stroke-width: 2; }\n"
+	    "</style>\n");
+
+	for (t = 0; t <= last + step / 2; t += step) {
+		printf("<line class=\"grid\" x1=\"%.1f\" y1=\"%d\" "
+		    "x2=\"%.1f\" y2=\"%.0f\"/>\n",
+		    X(first + t), GRAPH_MARGIN, X(first + t), Y(n));
+		printf("<text x=\"%.1f\" y=\"%d\">%gs</text>\n",
+		    X(first + t), GRAPH_MARGIN + 12, t);
+	}
+
+	for (i = 0; i < n; i++) {
+		span = &rows[i]->span[phase];
+		ndeps = waited_on(deptree, rows[i], phase, deps);
+		critical = NULL;
+		for (j = 0; j < ndeps; j++)
+			if (!critical ||
+			    deps[j]->span[phase].done > critical->span[phase].done)
+				critical = deps[j];
+		for (j = 0; j < ndeps; j++) {
+			for (k = 0; k < n; k++)
+				if (rows[k] == deps[j])
+					break;
+			printf("<path class=\"edge%s\" "
+			    "d=\"M%.1f,%.1f H%.1f V%.1f\"/>\n",
+			    deps[j] == critical ? " critical" : "",
+			    X(deps[j]->span[phase].done), Y(k) + GRAPH_ROW / 2,
+			    X(span->now), Y(i) + GRAPH_ROW / 2);
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		span = &rows[i]->span[phase];
+		printf("<g><title>");
+		print_xml(rows[i]->name);
+		printf(": waited %.3fs, ran %.3fs", span->now - span->wait,
+		    span->done - span->now);
+		if (span->status >= 0)
+			printf(", exited %d", span->status);
+		printf("</title>\n");
+		printf("<rect class=\"wait\" x=\"%.1f\" y=\"%.1f\" "
+		    "width=\"%.1f\" height=\"%d\"/>\n",
+		    X(span->wait), Y(i) + 2, (span->now - span->wait) * scale,
+		    GRAPH_ROW - 4);
+		printf("<rect class=\"%s\" x=\"%.1f\" y=\"%.1f\" "
+		    "width=\"%.1f\" height=\"%d\"/>\n",
+		    span->status == 0 ? "run" : "failed",
+		    X(span->now), Y(i) + 2, (span->done - span->now) * scale,
+		    GRAPH_ROW - 4);
+		printf("<text x=\"%.1f\" y=\"%.1f\">",
+		    X(span->done) + 4, Y(i) + GRAPH_ROW - 6);
+		print_xml(rows[i]->name);
+		printf(" (%.3fs)</text></g>\n", span->done - span->now);
+	}
+	printf("</svg>\n");
+
+#undef X
+#undef Y
+
+	free(deps);
+	free(rows);
+}
+
+static RC_DEPTREE *
+load_deptree(const char *file)
+{
+	RC_DEPTREE *deptree;
+
+	if (file)
+		deptree = rc_deptree_load_file(file);
+	else
+		deptree = _rc_deptree_load(0, NULL);
+	if (!deptree)
+		eerrorx("failed to load deptree");
+	return deptree;
+}
+
+int main(int argc, char **argv)
+{
+	RC_DEPTREE *deptree = NULL;
+	char *deptree_file = NULL;
+	char *file = NULL;
+	char *runlevel = NULL;
+	enum phase phase = PHASE_START;
+	bool blame = false, chain = false, graph = false;
+	size_t i;
+	int opt;
+
+	applet = basename_c(argv[0]);
+	while ((opt = getopt_long(argc, argv, getoptstring,
+		    longopts, (int *) 0)) != -1)
+	{
+		switch (opt) {
+		case 'b':
+			blame = true;
+			break;
+		case 'c':
+			chain = true;
+			break;
+		case 'g':
+			graph = true;
+			break;
+		case 'r':
+			free(runlevel);
+			runlevel = xstrdup(optarg);
+			break;
+		case 's':
+			phase = PHASE_STOP;
+			break;
+		case 'f':
+			free(file);
+			file = xstrdup(optarg);
+			break;
+		case 'F':
+			free(deptree_file);
+			deptree_file = xstrdup(optarg);
+			break;
+
+		case_RC_COMMON_GETOPT
+		}
+	}
+
+	if (!blame && !chain)
+		blame = true;
+	if (!file)
+		xasprintf(&file, "%s/events", rc_svcdir());
+	load_events(file, runlevel);
+
+	if (graph) {
+		/* The chart is the whole of the output */
+		deptree = load_deptree(deptree_file);
+		print_graph(deptree, phase);
+		blame = chain = false;
+	} else
+		print_summary(phase);
+	if (blame) {
+		printf("\n");
+		print_blame(phase);
+	}
+	if (chain) {
+		deptree = load_deptree(deptree_file);
+		printf("\n");
+		print_chain(deptree, optind < argc ? argv[optind] : NULL, phase);
+	}
+
+	for (i = 0; i < nservices; i++)
+		free(services[i].name);
+	free(services);
+	rc_deptree_free(deptree);
+	free(deptree_file);
+	free(runlevel);
+	free(file);
+	return EXIT_SUCCESS;
+}
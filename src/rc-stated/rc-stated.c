@@ -0,0 +1,844 @@
+/*
+ * rc-stated
+ * Keep rc.conf and the states of services in memory and hand them out over
+ * a socket in the service directory, so rc-status and friends don't have
+ * to read them from disk every time they run. inotify tells us when what
+ * we have is out of date.
+ * We also note when anything the deptree is built from changes, so librc
+ * doesn't have to look at every file to find out.
+ */
+
+/*
+ * Copyright (c) 2007-2015 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/HEAD/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/HEAD/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "einfo.h"
+#include "queue.h"
+#include "rc.h"
+#include "misc.h"
+#include "_usage.h"
+#include "helpers.h"
+
+#define MAX_CLIENTS	64
+#define WATCH_MASK	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+			 IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+const char *applet = NULL;
+const char *extraopts = NULL;
+const char getoptstring[] = getoptstring_COMMON;
+const struct option longopts[] = {
+	longopts_COMMON
+};
+const char * const longopts_help[] = {
+	longopts_help_COMMON
+};
+const char *usagestring = NULL;
+
+enum { REPLY_CONF, REPLY_STATES };
+
+/* What a change under a watch affects */
+#define AFFECTS_CONF		0x01
+#define AFFECTS_STATES		0x02
+#define AFFECTS_DEPTREE		0x04
+/* The deptree and depconfig in $svcdir */
+#define AFFECTS_DEPFILES	0x08
+
+/* What we answer each request with, built when first asked for after
+ * something it came from changed */
+struct reply {
+	const char *request;
+	void (*build)(struct reply *);
+	char *text;
+	size_t len;
+	bool stale;
+};
+
+/* A directory we watch, what it affects, and if it is only some of its
+ * entries that matter, which */
+static struct watch {
+	char *path;
+	unsigned int affects;
+	char *only[2];
+	int wd;
+} *watches;
+static size_t nwatches;
+
+/* Our stamp in $svcdir, which is only there while we can see every change
+ * that matters to the deptree */
+static char *dirty_path;
+static int dirty_fd = -1;
+/* What the deptree is built from, and if any of it can never be watched */
+static RC_STRINGLIST *deptree_inputs;
+static bool deptree_unwatchable;
+
+struct client {
+	int fd;
+	size_t len;
+	char buffer[64];
+};
+
+static volatile sig_atomic_t stop;
+
+static void
+handle_signal(int sig RC_UNUSED)
+{
+	stop = 1;
+}
+
+static void
+append(struct reply *reply, const char *line)
+{
+	size_t len = strlen(line);
+
+	reply->text = xrealloc(reply->text, reply->len + len + 2);
+	memcpy(reply->text + reply->len, line, len);
+	reply->len += len;
+	reply->text[reply->len++] = '\n';
+}
+
+static void
+build_conf(struct reply *reply)
+{
+	RC_STRINGLIST *conf = rc_conf_list();
+	RC_STRING *s;
+
+	TAILQ_FOREACH(s, conf, entries)
+		append(reply, s->value);
+	rc_stringlist_free(conf);
+}
+
+static int
+line_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Every service we can find, in init.d or only in a state directory, with
+ * its state as "service state" sorted so librc can search it. Crashed
+ * depends on daemons we can't watch, so librc works that out itself. */
+static void
+build_states(struct reply *reply)
+{
+	static const RC_SERVICE in_state[] = {
+		RC_SERVICE_STARTED, RC_SERVICE_STOPPING, RC_SERVICE_STARTING,
+		RC_SERVICE_INACTIVE, RC_SERVICE_WASINACTIVE,
+		RC_SERVICE_HOTPLUGGED, RC_SERVICE_FAILED, RC_SERVICE_SCHEDULED,
+	};
+	RC_STRINGLIST *services = rc_services_in_runlevel(NULL);
+	RC_STRINGLIST *list;
+	RC_STRING *s;
+	RC_SERVICE *states;
+	char **lines;
+	size_t count = 0, i;
+
+	for (i = 0; i < ARRAY_SIZE(in_state); i++) {
+		list = rc_services_in_state(in_state[i]);
+		TAILQ_FOREACH(s, list, entries)
+			rc_stringlist_addu(services, s->value);
+		rc_stringlist_free(list);
+	}
+
+	states = rc_service_states(services);
+	TAILQ_FOREACH(s, services, entries)
+		count++;
+	lines = xmalloc(sizeof(*lines) * (count ? count : 1));
+	i = 0;
+	TAILQ_FOREACH(s, services, entries) {
+		xasprintf(&lines[i], "%s %d", s->value,
+		    states[i] & ~RC_SERVICE_CRASHED);
+		i++;
+	}
+	qsort(lines, count, sizeof(*lines), line_cmp);
+	for (i = 0; i < count; i++) {
+		append(reply, lines[i]);
+		free(lines[i]);
+	}
+	free(lines);
+	free(states);
+	rc_stringlist_free(services);
+}
+
+static struct reply replies[] = {
+	[REPLY_CONF]   = { "conf",   build_conf,   NULL, 0, true },
+	[REPLY_STATES] = { "states", build_states, NULL, 0, true },
+};
+
+static void
+add_watch(const char *path, unsigned int affects, const char *only)
+{
+	watches = xrealloc(watches, sizeof(*watches) * (nwatches + 1));
+	watches[nwatches].path = xstrdup(path);
+	watches[nwatches].affects = affects;
+	watches[nwatches].only[0] = only ? xstrdup(only) : NULL;
+	watches[nwatches].only[1] = NULL;
+	watches[nwatches].wd = -1;
+	nwatches++;
+}
+
+static void
+also_watch(const char *only)
+{
+	watches[nwatches - 1].only[1] = xstrdup(only);
+}
+
+static void
+setup_watches(void)
+{
+	static const char *const dirs[] = {
+		"started", "starting", "stopping", "inactive", "wasinactive",
+		"hotplugged", "failed", "scheduled", "crashed", "state",
+	};
+	const char *svcdir = rc_svcdir();
+	const char *usrconfdir = rc_usrconfdir();
+	char *path;
+	size_t i;
+
+	/* svcdir itself so we see state directories being made */
+	add_watch(svcdir, AFFECTS_STATES, NULL);
+	for (i = 0; i < ARRAY_SIZE(dirs); i++) {
+		xasprintf(&path, "%s/%s", svcdir, dirs[i]);
+		add_watch(path, AFFECTS_STATES, NULL);
+		free(path);
+	}
+	for (const char * const *d = rc_scriptdirs(); *d; d++) {
+		xasprintf(&path, "%s/init.d", *d);
+		add_watch(path, AFFECTS_STATES, NULL);
+		free(path);
+	}
+
+	if (usrconfdir) {
+		add_watch(usrconfdir, AFFECTS_CONF, "rc.conf");
+		also_watch("rc.conf.d");
+		xasprintf(&path, "%s/rc.conf.d", usrconfdir);
+		add_watch(path, AFFECTS_CONF, NULL);
+		free(path);
+	}
+	add_watch(rc_sysconfdir(), AFFECTS_CONF, "rc.conf");
+	also_watch("rc.conf.d");
+	xasprintf(&path, "%s/rc.conf.d", rc_sysconfdir());
+	add_watch(path, AFFECTS_CONF, NULL);
+	free(path);
+	add_watch(RC_SYSCONFDIR "/conf.d", AFFECTS_CONF, basename_c(RC_CONF_OLD));
+}
+
+static bool
+is_dir(const char *path)
+{
+	struct stat st;
+
+	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static void watch_link(int ifd, const char *path);
+
+/* Watch a directory and every one under it, as librc looks at every file
+ * in them. The same directory reached twice, say through a symlink, is
+ * only watched once. */
+static void
+watch_tree(int ifd, const char *path)
+{
+	DIR *dp;
+	struct dirent *d;
+	char *sub;
+	size_t i, w = nwatches;
+	int wd;
+
+	for (i = 0; i < nwatches; i++)
+		if (watches[i].affects & AFFECTS_DEPTREE && !watches[i].only[0] &&
+		    watches[i].wd == -1 && strcmp(watches[i].path, path) == 0)
+			w = i;
+	wd = inotify_add_watch(ifd, path, WATCH_MASK);
+	for (i = 0; wd != -1 && i < nwatches; i++)
+		if (watches[i].affects & AFFECTS_DEPTREE && !watches[i].only[0] &&
+		    watches[i].wd == wd)
+			return;
+	if (w == nwatches)
+		add_watch(path, AFFECTS_DEPTREE, NULL);
+	watches[w].wd = wd;
+	if (wd == -1 || !(dp = opendir(path)))
+		return;
+
+	while ((d = readdir(dp))) {
+		if (d->d_name[0] == '.')
+			continue;
+		xasprintf(&sub, "%s/%s", path, d->d_name);
+		if (is_dir(sub))
+			watch_tree(ifd, sub);
+		else
+			watch_link(ifd, sub);
+		free(sub);
+	}
+	closedir(dp);
+}
+
+/* Something the deptree is built from, a file or a directory, which may
+ * not exist yet. We watch the deepest directory on its path that does
+ * exist for the next part of the path coming and going. */
+static void
+watch_input(int ifd, const char *path)
+{
+	char *dir, *name;
+	const char *parent;
+	size_t i;
+
+	if (*path != '/') {
+		deptree_unwatchable = true;
+		return;
+	}
+	dir = xstrdup(path);
+	do {
+		name = strrchr(dir, '/');
+		*name++ = '\0';
+	} while (*dir && !is_dir(dir));
+	parent = *dir ? dir : "/";
+
+	for (i = 0; i < nwatches; i++)
+		if (watches[i].affects & AFFECTS_DEPTREE && watches[i].only[0] &&
+		    strcmp(watches[i].path, parent) == 0 &&
+		    strcmp(watches[i].only[0], name) == 0)
+			break;
+	if (i == nwatches)
+		add_watch(parent, AFFECTS_DEPTREE, name);
+	if (watches[i].wd == -1)
+		watches[i].wd = inotify_add_watch(ifd, parent, WATCH_MASK);
+	free(dir);
+
+	if (is_dir(path))
+		watch_tree(ifd, path);
+	else
+		watch_link(ifd, path);
+}
+
+/* librc stat()s what a symlink points to, so that has to be watched as
+ * well, say /etc/init.d/foo -> /usr/lib/foo. Unless it is in a directory
+ * we watch already, it becomes an input of its own. One which points at
+ * nothing yet is watched for it appearing. */
+static void
+watch_link(int ifd, const char *path)
+{
+	struct stat st;
+	char buffer[PATH_MAX];
+	char *target, *dir;
+	ssize_t len;
+	size_t i;
+
+	if (lstat(path, &st) != 0 || !S_ISLNK(st.st_mode))
+		return;
+	if (!(target = realpath(path, NULL))) {
+		if ((len = readlink(path, buffer, sizeof(buffer) - 1)) == -1)
+			return;
+		buffer[len] = '\0';
+		dir = xstrdup(path);
+		*strrchr(dir, '/') = '\0';
+		if (*buffer == '/')
+			target = xstrdup(buffer);
+		else
+			xasprintf(&target, "%s/%s", dir, buffer);
+		free(dir);
+	}
+
+	dir = xstrdup(target);
+	*strrchr(dir, '/') = '\0';
+	for (i = 0; i < nwatches; i++)
+		if (watches[i].affects & AFFECTS_DEPTREE && !watches[i].only[0] &&
+		    watches[i].wd != -1 &&
+		    strcmp(watches[i].path, *dir ? dir : "/") == 0)
+			break;
+	if (i == nwatches && !rc_stringlist_find(deptree_inputs, target)) {
+		rc_stringlist_add(deptree_inputs, target);
+		watch_input(ifd, target);
+	}
+	free(dir);
+	free(target);
+}
+
+/* Inputs come into being and go again, so this is done again whenever
+ * they do */
+static void
+watch_inputs(int ifd)
+{
+	RC_STRING *s;
+
+	TAILQ_FOREACH(s, deptree_inputs, entries)
+		watch_input(ifd, s->value);
+}
+
+/* The files outside init.d and conf.d that scripts said they depend on
+ * are listed in depconfig when the deptree is updated */
+static bool
+read_depconfig(void)
+{
+	RC_STRINGLIST *config;
+	RC_STRING *s, *t;
+	char *path;
+	bool added = false;
+
+	xasprintf(&path, "%s/depconfig", rc_svcdir());
+	config = rc_config_list(path);
+	TAILQ_FOREACH(s, config, entries) {
+		TAILQ_FOREACH(t, deptree_inputs, entries)
+			if (strcmp(s->value, t->value) == 0)
+				break;
+		if (!t) {
+			rc_stringlist_add(deptree_inputs, s->value);
+			added = true;
+		}
+	}
+	rc_stringlist_free(config);
+	free(path);
+	return added;
+}
+
+/* The same files rc_deptree_update_needed() looks at */
+static void
+setup_deptree_watches(int ifd)
+{
+	static const char *const subdirs[] = { "init.d", "conf.d" };
+	const char *svcdir = rc_svcdir();
+	char *path;
+	size_t i;
+
+	deptree_inputs = rc_stringlist_new();
+	for (const char * const *d = rc_scriptdirs(); *d; d++) {
+		for (i = 0; i < ARRAY_SIZE(subdirs); i++) {
+			xasprintf(&path, "%s/%s", *d, subdirs[i]);
+			rc_stringlist_add(deptree_inputs, path);
+			free(path);
+		}
+	}
+	xasprintf(&path, "%s/rc.conf", rc_sysconfdir());
+	rc_stringlist_add(deptree_inputs, path);
+	free(path);
+	if (rc_is_user()) {
+		xasprintf(&path, "%s/rc.conf", rc_usrconfdir());
+		rc_stringlist_add(deptree_inputs, path);
+		free(path);
+	}
+	read_depconfig();
+	watch_inputs(ifd);
+
+	add_watch(svcdir, AFFECTS_DEPFILES, "deptree");
+	also_watch("depconfig");
+	watches[nwatches - 1].wd = inotify_add_watch(ifd, svcdir, WATCH_MASK);
+}
+
+/* Note in the stamp what changed, unless it already says something has */
+static void
+deptree_dirty(const char *path, const char *name)
+{
+	struct stat st;
+	char *line;
+	int len;
+
+	if (dirty_fd == -1 ||
+	    fstat(dirty_fd, &st) != 0 || st.st_size != 0)
+		return;
+	len = xasprintf(&line, "%s%s%s\n", path, name ? "/" : "",
+	    name ? name : "");
+	if (write(dirty_fd, line, len) != len)
+		eerror("%s: write `%s': %s", applet, dirty_path, strerror(errno));
+	free(line);
+}
+
+/* The stamp is locked for as long as we have it open, so librc can tell
+ * it apart from one left behind when we were killed. It only appears
+ * under its name once it is locked and says we just started. */
+static void
+deptree_dirty_open(void)
+{
+	char *tmp;
+
+	xasprintf(&tmp, "%s.new", dirty_path);
+	dirty_fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+	    0644);
+	if (dirty_fd == -1) {
+		eerror("%s: open `%s': %s", applet, tmp, strerror(errno));
+		free(tmp);
+		return;
+	}
+	if (flock(dirty_fd, LOCK_EX) == -1) {
+		eerror("%s: flock `%s': %s", applet, tmp, strerror(errno));
+	} else {
+		/* We don't know what changed before we started watching */
+		deptree_dirty(applet, NULL);
+		if (rename(tmp, dirty_path) == 0) {
+			free(tmp);
+			return;
+		}
+		eerror("%s: rename `%s': %s", applet, tmp, strerror(errno));
+	}
+	unlink(tmp);
+	close(dirty_fd);
+	dirty_fd = -1;
+	free(tmp);
+}
+
+/* We can only vouch for the deptree while every watch it needs is in
+ * place. Until then the stamp goes, so librc checks every file itself.
+ * A directory that has gone doesn't count, as the one above it is watched
+ * for it coming back. */
+static void
+check_deptree_watches(void)
+{
+	bool blind = deptree_unwatchable;
+	size_t i;
+
+	for (i = 0; !blind && i < nwatches; i++)
+		if (watches[i].affects & AFFECTS_DEPTREE &&
+		    watches[i].wd == -1 && is_dir(watches[i].path))
+			blind = true;
+
+	if (blind && dirty_fd != -1) {
+		unlink(dirty_path);
+		close(dirty_fd);
+		dirty_fd = -1;
+	} else if (!blind && dirty_fd == -1)
+		deptree_dirty_open();
+}
+
+/* Directories come and go, so this is tried again whenever one appears */
+static void
+add_watches(int ifd)
+{
+	size_t i;
+
+	for (i = 0; i < nwatches; i++)
+		if (watches[i].wd == -1)
+			watches[i].wd = inotify_add_watch(ifd, watches[i].path,
+			    WATCH_MASK);
+}
+
+static void
+set_stale(unsigned int affects)
+{
+	if (affects & AFFECTS_CONF)
+		replies[REPLY_CONF].stale = true;
+	if (affects & AFFECTS_STATES)
+		replies[REPLY_STATES].stale = true;
+}
+
+static bool
+wanted(const struct watch *watch, const struct inotify_event *event)
+{
+	return !watch->only[0] || !event->len ||
+	    strcmp(event->name, watch->only[0]) == 0 ||
+	    (watch->only[1] && strcmp(event->name, watch->only[1]) == 0);
+}
+
+/* Changes to the deptree inputs, and to the files rc_deptree_update()
+ * writes which tell us about them. Returns true if the inputs need
+ * watching again. */
+static bool
+deptree_event(int ifd, size_t w, const struct inotify_event *event)
+{
+	char *path;
+
+	if (watches[w].affects & AFFECTS_DEPFILES) {
+		if (!event->len)
+			return false;
+		if (strcmp(event->name, "depconfig") == 0) {
+			if (!read_depconfig())
+				return false;
+			/* We can't know what changed in a new input before
+			 * we watched it */
+			deptree_dirty(watches[w].path, event->name);
+			return true;
+		}
+		if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+			deptree_dirty(watches[w].path, event->name);
+		return false;
+	}
+
+	deptree_dirty(watches[w].path, event->len ? event->name : NULL);
+	if (!event->len || !(event->mask & (IN_CREATE | IN_MOVED_TO)))
+		return false;
+	/* Part of the path to an input, or somewhere under one */
+	if (watches[w].only[0])
+		return true;
+	/* A new directory, or a new symlink pointing somewhere else */
+	xasprintf(&path, "%s/%s", watches[w].path, event->name);
+	if (event->mask & IN_ISDIR)
+		watch_tree(ifd, path);
+	else
+		watch_link(ifd, path);
+	free(path);
+	return false;
+}
+
+static void
+read_events(int ifd)
+{
+	char buffer[4096]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	ssize_t len;
+	char *p;
+	size_t i;
+	bool rewatch = false, inputs = false;
+
+	while ((len = read(ifd, buffer, sizeof(buffer))) > 0) {
+		for (p = buffer; p < buffer + len;
+		    p += sizeof(*event) + event->len)
+		{
+			event = (const struct inotify_event *)p;
+			if (event->mask & IN_Q_OVERFLOW) {
+				set_stale(AFFECTS_CONF | AFFECTS_STATES);
+				deptree_dirty(applet, NULL);
+				continue;
+			}
+			for (i = 0; i < nwatches; i++) {
+				if (watches[i].wd != event->wd)
+					continue;
+				if (event->mask & IN_IGNORED) {
+					watches[i].wd = -1;
+					set_stale(watches[i].affects);
+					if (watches[i].affects & AFFECTS_DEPTREE) {
+						deptree_dirty(watches[i].path, NULL);
+						inputs = true;
+					}
+					continue;
+				}
+				if (!wanted(&watches[i], event))
+					continue;
+				set_stale(watches[i].affects);
+				if (watches[i].affects &
+				    (AFFECTS_DEPTREE | AFFECTS_DEPFILES) &&
+				    deptree_event(ifd, i, event))
+					inputs = true;
+				if (event->mask & IN_ISDIR &&
+				    event->mask & (IN_CREATE | IN_MOVED_TO))
+					rewatch = true;
+			}
+		}
+	}
+	if (rewatch)
+		add_watches(ifd);
+	if (inputs)
+		watch_inputs(ifd);
+	check_deptree_watches();
+}
+
+static bool
+send_all(int fd, const char *buffer, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = send(fd, buffer, len, MSG_NOSIGNAL)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		buffer += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool
+answer(int fd, const char *request)
+{
+	struct reply *reply = NULL;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(replies); i++)
+		if (strcmp(replies[i].request, request) == 0)
+			reply = &replies[i];
+	if (!reply)
+		return send_all(fd, "\n", 1);
+
+	if (reply->stale) {
+		free(reply->text);
+		reply->text = NULL;
+		reply->len = 0;
+		reply->build(reply);
+		/* The empty line that ends it */
+		append(reply, "");
+		reply->stale = false;
+	}
+	return send_all(fd, reply->text, reply->len);
+}
+
+static bool
+serve(struct client *client, int ifd)
+{
+	char *nl;
+	ssize_t n;
+
+	n = read(client->fd, client->buffer + client->len,
+	    sizeof(client->buffer) - client->len - 1);
+	if (n <= 0)
+		return n == -1 && errno == EINTR;
+	client->len += n;
+	client->buffer[client->len] = '\0';
+
+	while ((nl = strchr(client->buffer, '\n'))) {
+		*nl++ = '\0';
+		/* Pick up anything that changed before we were asked */
+		read_events(ifd);
+		if (!answer(client->fd, client->buffer))
+			return false;
+		client->len -= nl - client->buffer;
+		memmove(client->buffer, nl, client->len + 1);
+	}
+	/* Nobody asks for anything that long */
+	return client->len < sizeof(client->buffer) - 1;
+}
+
+static int
+listen_socket(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path))
+		eerrorx("%s: socket path `%s' is too long", applet, path);
+	strcpy(sun.sun_path, path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+		eerrorx("%s: socket: %s", applet, strerror(errno));
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		eerrorx("%s: bind `%s': %s", applet, path, strerror(errno));
+	/* Everything we hand out can be read from the filesystem anyway */
+	chmod(path, 0666);
+	if (listen(fd, 16) == -1)
+		eerrorx("%s: listen: %s", applet, strerror(errno));
+	return fd;
+}
+
+int main(int argc, char **argv)
+{
+	struct pollfd fds[MAX_CLIENTS + 2];
+	struct client clients[MAX_CLIENTS];
+	struct timeval timeout = { .tv_sec = 1 };
+	struct sigaction sa;
+	size_t nclients = 0, i;
+	char *path;
+	int opt, lfd, ifd, fd;
+
+	applet = basename_c(argv[0]);
+	while ((opt = getopt_long(argc, argv, getoptstring,
+		    longopts, (int *) 0)) != -1)
+	{
+		switch (opt) {
+		case_RC_COMMON_GETOPT
+		}
+	}
+
+	/* Our own librc calls must not come back to us */
+	setenv("RC_STATED", "NO", 1);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	if ((ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+		eerrorx("%s: inotify_init1: %s", applet, strerror(errno));
+	setup_watches();
+	add_watches(ifd);
+	xasprintf(&dirty_path, "%s/%s", rc_svcdir(), RC_DEPTREE_DIRTY);
+	setup_deptree_watches(ifd);
+	check_deptree_watches();
+
+	xasprintf(&path, "%s/%s", rc_svcdir(), RC_STATED_SOCKET);
+	lfd = listen_socket(path);
+
+	fds[0].fd = lfd;
+	fds[0].events = POLLIN;
+	fds[1].fd = ifd;
+	fds[1].events = POLLIN;
+	while (!stop) {
+		for (i = 0; i < nclients; i++) {
+			fds[i + 2].fd = clients[i].fd;
+			fds[i + 2].events = POLLIN;
+			fds[i + 2].revents = 0;
+		}
+		if (poll(fds, nclients + 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			eerror("%s: poll: %s", applet, strerror(errno));
+			break;
+		}
+
+		if (fds[1].revents & POLLIN)
+			read_events(ifd);
+
+		for (i = nclients; i-- > 0;) {
+			if (!fds[i + 2].revents)
+				continue;
+			if (serve(&clients[i], ifd))
+				continue;
+			close(clients[i].fd);
+			clients[i] = clients[--nclients];
+		}
+
+		if (fds[0].revents & POLLIN &&
+		    (fd = accept(lfd, NULL, NULL)) != -1)
+		{
+			if (nclients == MAX_CLIENTS) {
+				close(fd);
+				continue;
+			}
+			/* Don't let a client that stops reading wedge us */
+			setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO,
+			    &timeout, sizeof(timeout));
+			clients[nclients].fd = fd;
+			clients[nclients].len = 0;
+			nclients++;
+		}
+	}
+
+	unlink(path);
+	free(path);
+	if (dirty_fd != -1) {
+		unlink(dirty_path);
+		close(dirty_fd);
+	}
+	free(dirty_path);
+	rc_stringlist_free(deptree_inputs);
+	for (i = 0; i < nclients; i++)
+		close(clients[i].fd);
+	close(lfd);
+	close(ifd);
+	for (i = 0; i < nwatches; i++) {
+		free(watches[i].path);
+		free(watches[i].only[0]);
+		free(watches[i].only[1]);
+	}
+	free(watches);
+	for (i = 0; i < ARRAY_SIZE(replies); i++)
+		free(replies[i].text);
+	return EXIT_SUCCESS;
+}
@@ -74,6 +74,25 @@ static RC_STRINGLIST *types;
 
 static RC_STRINGLIST *levels, *services, *tmp, *alist;
 static RC_STRINGLIST *sservices, *nservices, *needsme;
+static RC_SNAPSHOT *snapshot;
+
+/* Everything we show comes from one snapshot of all the services */
+static const RC_SERVICE_INFO *service_info(const char *service)
+{
+	static const RC_SERVICE_INFO stopped = { .state = RC_SERVICE_STOPPED };
+	const RC_SERVICE_INFO *info;
+
+	if (!snapshot)
+		snapshot = rc_snapshot_load();
+	info = rc_snapshot_find(snapshot, service);
+	return info ? info : &stopped;
+}
+
+static bool in_runlevel(const char *service, const char *runlevel)
+{
+	return rc_stringlist_find(service_info(service)->runlevels,
+			runlevel) != NULL;
+}
 
 static void print_level(const char *prefix, const char *level,
 		enum format_t format)
@@ -100,9 +119,9 @@ static void print_level(const char *prefix, const char *level,
 
 static char *get_uptime(const char *service)
 {
-	RC_SERVICE state = rc_service_state(service);
-	char *start_count;
-	char *start_time_string;
+	const RC_SERVICE_INFO *info = service_info(service);
+	const char *start_count = info->start_count;
+	const char *start_time_string = info->start_time;
 	time_t start_time;
 	int64_t diff_days;
 	int64_t diff_hours;
@@ -110,9 +129,7 @@ static char *get_uptime(const char *service)
 	int64_t diff_secs;
 	char *uptime = NULL;
 
-	if (state & RC_SERVICE_STARTED) {
-		start_count = rc_service_value_get(service, "start_count");
-		start_time_string = rc_service_value_get(service, "start_time");
+	if (info->state & RC_SERVICE_STARTED) {
 		if (start_count && start_time_string) {
 			start_time = to_time_t(start_time_string);
 			diff_secs = (int64_t) difftime(time(NULL), start_time);
@@ -132,8 +149,6 @@ static char *get_uptime(const char *service)
 						"%02"PRId64":%02"PRId64":%02"PRId64" (%s)",
 						diff_hours, diff_mins, diff_secs, start_count);
 		}
-		free(start_count);
-		free(start_time_string);
 	}
 	return uptime;
 }
@@ -142,11 +157,10 @@ static void print_service(const char *service, enum format_t format)
 {
 	char *status = NULL;
 	char *uptime = NULL;
-	char *child_pid = NULL;
-	char *start_time = NULL;
 	int cols;
 	const char *c = ecolor(ECOLOR_GOOD);
-	RC_SERVICE state = rc_service_state(service);
+	const RC_SERVICE_INFO *info = service_info(service);
+	RC_SERVICE state = info->state;
 	ECOLOR color = ECOLOR_BAD;
 
 	if (state & RC_SERVICE_STOPPING)
@@ -159,16 +173,13 @@ static void print_service(const char *service, enum format_t format)
 		color = ECOLOR_WARN;
 	} else if (state & RC_SERVICE_STARTED) {
 		errno = 0;
-		if (rc_service_daemons_crashed(service) && errno != EACCES)
+		if (info->daemons && rc_service_daemons_crashed(service) &&
+				errno != EACCES)
 		{
-			child_pid = rc_service_value_get(service, "child_pid");
-			start_time = rc_service_value_get(service, "start_time");
-			if (start_time && child_pid)
+			if (info->start_time && info->child_pid)
 				xasprintf(&status, " unsupervised ");
 			else
 				xasprintf(&status, " crashed ");
-			free(child_pid);
-			free(start_time);
 		} else {
 			uptime = get_uptime(service);
 			if (uptime) {
@@ -194,6 +205,9 @@ static void print_service(const char *service, enum format_t format)
 		if (c && *c && isatty(fileno(stdout)))
 			printf("\n");
 		ebracket(cols, color, status);
+		/* Why supervise-daemon last had to respawn it */
+		if (state & RC_SERVICE_STARTED && info->last_exit)
+			printf("    last exit: %s\n", info->last_exit);
 		break;
 	case FORMAT_INI:
 		printf("%s = %s\n", service, status);
@@ -215,8 +229,7 @@ static void print_services(const char *runlevel, RC_STRINGLIST *svcs,
 		deptree = _rc_deptree_load(0, NULL);
 	if (!deptree) {
 		TAILQ_FOREACH(s, svcs, entries)
-			if (!runlevel ||
-			    rc_service_in_runlevel(s->value, runlevel))
+			if (!runlevel || in_runlevel(s->value, runlevel))
 				print_service(s->value, format);
 		return;
 	}
@@ -236,7 +249,7 @@ static void print_services(const char *runlevel, RC_STRINGLIST *svcs,
 	TAILQ_FOREACH(s, l, entries) {
 		if (!rc_stringlist_find(svcs, s->value))
 			continue;
-		if (!runlevel || rc_service_in_runlevel(s->value, runlevel))
+		if (!runlevel || in_runlevel(s->value, runlevel))
 			print_service(s->value, format);
 	}
 	rc_stringlist_free(l);
@@ -303,18 +316,14 @@ int main(int argc, char **argv)
 			/* NOTREACHED */
 		case 'm':
 			services = rc_services_in_runlevel(NULL);
-			levels = rc_runlevel_list();
-			TAILQ_FOREACH_SAFE(s, services, entries, t) {
-				TAILQ_FOREACH(l, levels, entries)
-					if (rc_service_in_runlevel(s->value, l->value)) {
-						TAILQ_REMOVE(services, s, entries);
-						free(s->value);
-						free(s);
-						break;
-					}
-			}
 			TAILQ_FOREACH_SAFE(s, services, entries, t)
-				if (rc_service_state(s->value) &
+				if (TAILQ_FIRST(service_info(s->value)->runlevels)) {
+					TAILQ_REMOVE(services, s, entries);
+					free(s->value);
+					free(s);
+				}
+			TAILQ_FOREACH_SAFE(s, services, entries, t)
+				if (service_info(s->value)->state &
 					(RC_SERVICE_STOPPED | RC_SERVICE_HOTPLUGGED)) {
 					TAILQ_REMOVE(services, s, entries);
 					free(s->value);
@@ -330,15 +339,12 @@ int main(int argc, char **argv)
 			/* NOTREACHED */
 		case 'S':
 			services = rc_services_in_state(RC_SERVICE_STARTED);
-			TAILQ_FOREACH_SAFE(s, services, entries, t) {
-				char *ret = rc_service_value_get(s->value, "child_pid");
-				if (!ret) {
+			TAILQ_FOREACH_SAFE(s, services, entries, t)
+				if (!service_info(s->value)->child_pid) {
 					TAILQ_REMOVE(services, s, entries);
 					free(s->value);
 					free(s);
 				}
-				free(ret);
-			}
 			print_services(NULL, services, format);
 			goto exit;
 			/* NOTREACHED */
@@ -349,16 +355,12 @@ int main(int argc, char **argv)
 			/* NOTREACHED */
 		case 'u':
 			services = rc_services_in_runlevel(NULL);
-			levels = rc_runlevel_list();
-			TAILQ_FOREACH_SAFE(s, services, entries, t) {
-				TAILQ_FOREACH(l, levels, entries)
-					if (rc_service_in_runlevel(s->value, l->value)) {
-						TAILQ_REMOVE(services, s, entries);
-						free(s->value);
-						free(s);
-						break;
-					}
-			}
+			TAILQ_FOREACH_SAFE(s, services, entries, t)
+				if (TAILQ_FIRST(service_info(s->value)->runlevels)) {
+					TAILQ_REMOVE(services, s, entries);
+					free(s->value);
+					free(s);
+				}
 			print_services(NULL, services, format);
 			goto exit;
 			/* NOTREACHED */
@@ -424,7 +426,7 @@ int main(int argc, char **argv)
 			rc_stringlist_free(nservices);
 		}
 		TAILQ_FOREACH_SAFE(s, services, entries, t) {
-			state = rc_service_state(s->value);
+			state = service_info(s->value)->state;
 			if ((rc_stringlist_find(sservices, s->value) ||
 			    (state & ( RC_SERVICE_STOPPED | RC_SERVICE_HOTPLUGGED)))) {
 				if (!(state & RC_SERVICE_FAILED)) {
@@ -476,6 +478,7 @@ exit:
 	rc_stringlist_free(types);
 	rc_stringlist_free(levels);
 	rc_deptree_free(deptree);
+	rc_snapshot_free(snapshot);
 
 	return retval;
 }
@@ -294,6 +294,27 @@ svc_lock(const char *applet, bool ignore_lock_failure)
 	return fd;
 }
 
+/* librc caches the state of each service in $svcdir/state. We remove it
+ * after changing the state directories behind librc's back, under the
+ * lock librc writes it with so an older scan can't replace it after us. */
+void
+forget_service_state(const char *service)
+{
+	char *dir, *file;
+	int fd;
+
+	xasprintf(&dir, "%s/state", rc_svcdir());
+	xasprintf(&file, "%s/%s", dir, basename_c(service));
+	if ((fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1)
+		while (flock(fd, LOCK_EX) == -1 && errno == EINTR)
+			;
+	unlink(file);
+	if (fd != -1)
+		close(fd);
+	free(file);
+	free(dir);
+}
+
 int
 svc_unlock(const char *applet, int fd)
 {
@@ -414,7 +435,7 @@ RC_DEPTREE * _rc_deptree_load(int force, int *regen)
 
 	t = 0;
 	if (rc_deptree_update_needed(&t, file) || force != 0) {
-		char *deptree_cache, *deptree_skewed;
+		char *deptree_cache, *deptree_bin, *deptree_skewed;
 		xasprintf(&deptree_cache, "%s/deptree", svcdir);
 
 		/* Test if we have permission to update the deptree */
@@ -427,6 +448,14 @@ RC_DEPTREE * _rc_deptree_load(int force, int *regen)
 
 		if (regen)
 			*regen = 1;
+		/* A forced update reads every init script again */
+		if (force) {
+			char *depcache;
+
+			xasprintf(&depcache, "%s/depcache", svcdir);
+			unlink(depcache);
+			free(depcache);
+		}
 		ebegin("Caching service dependencies");
 		retval = rc_deptree_update() ? 0 : -1;
 		eend (retval, "Failed to update the dependency tree");
@@ -449,6 +478,10 @@ RC_DEPTREE * _rc_deptree_load(int force, int *regen)
 				ut.actime = t;
 				ut.modtime = t;
 				utime(deptree_cache, &ut);
+				/* Keep the binary cache as new as the text one */
+				xasprintf(&deptree_bin, "%s/deptree.bin", svcdir);
+				utime(deptree_bin, &ut);
+				free(deptree_bin);
 			} else {
 				if (exists(deptree_skewed))
 					unlink(deptree_skewed);
@@ -492,7 +525,7 @@ void from_time_t(char *time_string, time_t tv)
 	strftime(time_string, 20, "%Y-%m-%d %H:%M:%S", localtime(&tv));
 }
 
-time_t to_time_t(char *timestring)
+time_t to_time_t(const char *timestring)
 {
 	int check = 0;
 	int year = 0;
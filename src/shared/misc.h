@@ -34,6 +34,10 @@
 #define RC_LEVEL_DEFAULT        "default"
 
 #define RC_KRUNLEVEL            RC_SVCDIR "/krunlevel"
+/* rc-stated listens here, in rc_svcdir() */
+#define RC_STATED_SOCKET        "rc-stated.sock"
+/* and keeps this up to date while it watches what the deptree is built from */
+#define RC_DEPTREE_DIRTY        "deptree-dirty"
 
 char *rc_conf_value(const char *var);
 bool rc_conf_yesno(const char *var);
@@ -43,6 +47,7 @@ int signal_setup(int sig, void (*handler)(int));
 int signal_setup_restart(int sig, void (*handler)(int));
 int svc_lock(const char *, bool);
 int svc_unlock(const char *, int);
+void forget_service_state(const char *);
 pid_t exec_service(const char *, const char *);
 
 /*
@@ -61,7 +66,7 @@ RC_DEPTREE *_rc_deptree_load (int, int *);
 
 RC_SERVICE lookup_service_state(const char *service);
 void from_time_t(char *time_string, time_t tv);
-time_t to_time_t(char *timestring);
+time_t to_time_t(const char *timestring);
 pid_t get_pid(const char *applet, const char *pidfile);
 
 void cloexec_fds_from(int);
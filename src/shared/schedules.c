@@ -23,6 +23,7 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <poll.h>
 #include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -30,7 +31,11 @@
 #include <string.h>
 #include <syslog.h>
 #include <time.h>
+#include <unistd.h>
 #include <sys/types.h>
+#ifdef __linux__
+#  include <sys/syscall.h> /* for pidfd_open */
+#endif
 
 #include "einfo.h"
 #include "queue.h"
@@ -295,6 +300,169 @@ int do_stop(const char *applet, const char *exec, const char *const *argv,
 	return nkilled;
 }
 
+static int
+open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* The processes we are waiting on to stop. Where we can get a pidfd for
+ * each one we sleep until they exit, otherwise we look for them again
+ * every POLL_INTERVAL. */
+struct stop_wait {
+	struct pollfd *fds;
+	size_t count;
+	bool scan;
+};
+
+static void
+stop_wait_close(struct stop_wait *wait)
+{
+	size_t i;
+
+	for (i = 0; i < wait->count; i++)
+		close(wait->fds[i].fd);
+	free(wait->fds);
+	wait->fds = NULL;
+	wait->count = 0;
+}
+
+/* Drops the processes that have exited, which a pidfd tells us even if
+ * they have yet to be reaped */
+static void
+stop_wait_reap(struct stop_wait *wait)
+{
+	size_t i = 0;
+
+	while (i < wait->count) {
+		if (wait->fds[i].revents) {
+			close(wait->fds[i].fd);
+			wait->fds[i] = wait->fds[--wait->count];
+		} else
+			i++;
+	}
+}
+
+/* Takes a pidfd for each process that matches and has yet to exit */
+static void
+stop_wait_find(struct stop_wait *wait, const char *exec,
+    const char *const *argv, pid_t pid, uid_t uid)
+{
+	RC_PIDLIST *pids;
+	RC_PID *pi;
+	RC_PID *np;
+	size_t n = 0;
+	int fd;
+
+	stop_wait_close(wait);
+	if (pid > 0)
+		pids = rc_find_pids(NULL, NULL, 0, pid);
+	else
+		pids = rc_find_pids(exec, argv, uid, 0);
+	if (!pids)
+		return;
+
+	LIST_FOREACH(pi, pids, entries)
+		n++;
+	wait->fds = xmalloc(sizeof(*wait->fds) * n);
+	LIST_FOREACH_SAFE(pi, pids, entries, np) {
+		if (!wait->scan) {
+			if ((fd = open_pidfd(pi->pid)) != -1) {
+				wait->fds[wait->count].fd = fd;
+				wait->fds[wait->count].events = POLLIN;
+				wait->fds[wait->count++].revents = 0;
+			} else if (errno != ESRCH)
+				wait->scan = true;
+		}
+		free(pi);
+	}
+	free(pids);
+
+	if (wait->scan)
+		stop_wait_close(wait);
+	else if (poll(wait->fds, wait->count, 0) > 0)
+		stop_wait_reap(wait);
+}
+
+/* Waits a second for the processes to stop, and returns how many are
+ * still running or -1 on error */
+static int
+stop_wait_second(const char *applet, struct stop_wait *wait,
+    const char *exec, const char *const *argv, pid_t pid, uid_t uid,
+    bool test, bool quiet, bool *progressed)
+{
+	struct timespec ts, now, end;
+	long nloops;
+	int nrunning = 0;
+	int timeout;
+
+	if (wait->scan) {
+		ts.tv_sec = 0;
+		ts.tv_nsec = POLL_INTERVAL;
+		for (nloops = 0; nloops < ONE_SECOND / POLL_INTERVAL; nloops++) {
+			if ((nrunning = do_stop(applet, exec, argv,
+				    pid, uid, 0, test, quiet)) == 0)
+				return 0;
+
+			if (nanosleep(&ts, NULL) == -1) {
+				if (*progressed) {
+					printf("\n");
+					*progressed = false;
+				}
+				if (errno != EINTR) {
+					eerror("%s: nanosleep: %s",
+					    applet, strerror(errno));
+					return -1;
+				}
+			}
+		}
+		return nrunning;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec++;
+	for (;;) {
+		/* Once those we know of have gone, look again in case
+		 * they left anything else behind */
+		if (wait->count == 0) {
+			stop_wait_find(wait, exec, argv, pid, uid);
+			if (wait->scan)
+				return stop_wait_second(applet, wait, exec, argv,
+				    pid, uid, test, quiet, progressed);
+			if (wait->count == 0)
+				return 0;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timespecsub(&end, &now, &now);
+		if (now.tv_sec < 0)
+			return wait->count;
+		timeout = now.tv_sec * 1000 + (now.tv_nsec + ONE_MS - 1) / ONE_MS;
+
+		switch (poll(wait->fds, wait->count, timeout)) {
+		case -1:
+			if (*progressed) {
+				printf("\n");
+				*progressed = false;
+			}
+			if (errno != EINTR) {
+				eerror("%s: poll: %s", applet, strerror(errno));
+				return -1;
+			}
+			break;
+		case 0:
+			return wait->count;
+		default:
+			stop_wait_reap(wait);
+		}
+	}
+}
+
 int run_stop_schedule(const char *applet,
 		const char *exec, const char *const *argv,
 		pid_t pid, uid_t uid,
@@ -304,8 +472,8 @@ int run_stop_schedule(const char *applet,
 	int nkilled = 0;
 	int tkilled = 0;
 	int nrunning = 0;
-	long nloops, nsecs;
-	struct timespec ts;
+	long nsecs;
+	struct stop_wait wait;
 	const char *const *p;
 	bool progressed = false;
 
@@ -366,30 +534,17 @@ int run_stop_schedule(const char *applet,
 				break;
 			}
 
-			ts.tv_sec = 0;
-			ts.tv_nsec = POLL_INTERVAL;
-
+			/* In test mode nothing was signalled, so we just go
+			 * through the motions */
+			wait.fds = NULL;
+			wait.count = 0;
+			wait.scan = test;
 			for (nsecs = 0; item->type == SC_FOREVER || nsecs < item->value; nsecs++) {
-				for (nloops = 0;
-				     nloops < ONE_SECOND / POLL_INTERVAL;
-				     nloops++)
-				{
-					if ((nrunning = do_stop(applet, exec, argv,
-						    pid, uid, 0, test, quiet)) == 0)
-						return 0;
-
-
-					if (nanosleep(&ts, NULL) == -1) {
-						if (progressed) {
-							printf("\n");
-							progressed = false;
-						}
-						if (errno != EINTR) {
-							eerror("%s: nanosleep: %s",
-							    applet, strerror(errno));
-							return 0;
-						}
-					}
+				nrunning = stop_wait_second(applet, &wait, exec,
+				    argv, pid, uid, test, quiet, &progressed);
+				if (nrunning <= 0) {
+					stop_wait_close(&wait);
+					return 0;
 				}
 				if (progress) {
 					printf(".");
@@ -397,6 +552,7 @@ int run_stop_schedule(const char *applet,
 					progressed = true;
 				}
 			}
+			stop_wait_close(&wait);
 			break;
 		default:
 			if (progressed) {
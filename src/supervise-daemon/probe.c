@@ -0,0 +1,242 @@
+/*
+ * probe.c
+ * Health checks supervise-daemon runs itself, so that checking a daemon
+ * is up does not mean running the service script every time.
+ *
+ *   tcp:[host:]port          connect to a TCP port
+ *   unix:/path               connect to a unix socket
+ *   http:[host:]port[/path]  GET the path, any 2xx or 3xx status is fine
+ *   file:/path:seconds       the file has been modified in that long
+ *
+ * The host defaults to 127.0.0.1, and IPv6 addresses go in brackets.
+ */
+
+/*
+ * Copyright (c) 2016 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/HEAD/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/HEAD/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "probe.h"
+#include "helpers.h"
+
+#ifndef MSG_NOSIGNAL
+#  define MSG_NOSIGNAL 0
+#endif
+
+/* [host:]port, looked up now so that probing never waits on a resolver */
+static bool probe_address(struct probe *probe, const char *spec)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	char *copy = xstrdup(spec);
+	char *host = NULL;
+	char *port = copy;
+	char *p;
+	bool found;
+
+	if (*copy == '[') {
+		if (!(p = strchr(copy, ']')) || p[1] != ':') {
+			free(copy);
+			return false;
+		}
+		*p = '\0';
+		host = copy + 1;
+		port = p + 2;
+	} else if ((p = strrchr(copy, ':'))) {
+		*p = '\0';
+		host = copy;
+		port = p + 1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	found = getaddrinfo(host ? host : "127.0.0.1", port, &hints, &res) == 0;
+	if (found) {
+		memcpy(&probe->addr, res->ai_addr, res->ai_addrlen);
+		probe->addrlen = res->ai_addrlen;
+		freeaddrinfo(res);
+	}
+	if (host)
+		probe->host = xstrdup(spec);
+	else
+		xasprintf(&probe->host, "localhost:%s", port);
+	free(copy);
+	return found;
+}
+
+bool probe_parse(struct probe *probe, const char *spec)
+{
+	struct sockaddr_un *sun = (struct sockaddr_un *)&probe->addr;
+	const char *p;
+	char *authority;
+	char dummy[2];
+	bool valid;
+	int age;
+
+	memset(probe, 0, sizeof(*probe));
+	probe->fd = -1;
+	if (strncmp(spec, "tcp:", 4) == 0) {
+		probe->type = PROBE_TCP;
+		return probe_address(probe, spec + 4);
+	}
+	if (strncmp(spec, "unix:", 5) == 0) {
+		probe->type = PROBE_UNIX;
+		sun->sun_family = AF_UNIX;
+		if (spec[5] == '\0' || strlen(spec + 5) >= sizeof(sun->sun_path))
+			return false;
+		strcpy(sun->sun_path, spec + 5);
+		probe->addrlen = sizeof(*sun);
+		return true;
+	}
+	if (strncmp(spec, "http:", 5) == 0) {
+		probe->type = PROBE_HTTP;
+		spec += 5;
+		if ((p = strchr(spec, '/'))) {
+			authority = xmalloc(p - spec + 1);
+			memcpy(authority, spec, p - spec);
+			authority[p - spec] = '\0';
+			probe->path = xstrdup(p);
+		} else {
+			authority = xstrdup(spec);
+			probe->path = xstrdup("/");
+		}
+		valid = probe_address(probe, authority);
+		free(authority);
+		return valid;
+	}
+	if (strncmp(spec, "file:", 5) == 0) {
+		probe->type = PROBE_FILE;
+		spec += 5;
+		if (!(p = strrchr(spec, ':')) || p == spec ||
+		    sscanf(p + 1, "%d%1s", &age, dummy) != 1 || age < 1)
+			return false;
+		probe->max_age = age;
+		probe->path = xmalloc(p - spec + 1);
+		memcpy(probe->path, spec, p - spec);
+		probe->path[p - spec] = '\0';
+		return true;
+	}
+	return false;
+}
+
+void probe_cancel(struct probe *probe)
+{
+	if (probe->fd != -1)
+		close(probe->fd);
+	probe->fd = -1;
+}
+
+void probe_free(struct probe *probe)
+{
+	probe_cancel(probe);
+	free(probe->path);
+	free(probe->host);
+	probe->path = probe->host = NULL;
+}
+
+static enum probe_result probe_done(struct probe *probe, enum probe_result result)
+{
+	probe_cancel(probe);
+	return result;
+}
+
+static enum probe_result probe_connected(struct probe *probe)
+{
+	char *request;
+	int len;
+
+	if (probe->type != PROBE_HTTP)
+		return probe_done(probe, PROBE_OK);
+
+	/* The request is small enough for the socket to take in one go */
+	len = xasprintf(&request, "GET %s HTTP/1.0\r\nHost: %s\r\n"
+			"Connection: close\r\n\r\n", probe->path, probe->host);
+	if (send(probe->fd, request, len, MSG_NOSIGNAL) != len) {
+		free(request);
+		return probe_done(probe, PROBE_FAILED);
+	}
+	free(request);
+	probe->events = POLLIN;
+	probe->len = 0;
+	return PROBE_WAITING;
+}
+
+/* Start a probe. While it is waiting, poll probe->fd for probe->events
+ * and call probe_continue() when they come. */
+enum probe_result probe_start(struct probe *probe)
+{
+	struct stat st;
+
+	probe_cancel(probe);
+	if (probe->type == PROBE_FILE) {
+		if (stat(probe->path, &st) == -1 ||
+		    time(NULL) - st.st_mtime > probe->max_age)
+			return PROBE_FAILED;
+		return PROBE_OK;
+	}
+
+	probe->fd = socket(probe->addr.ss_family,
+			SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (probe->fd == -1)
+		return PROBE_FAILED;
+	if (connect(probe->fd, (struct sockaddr *)&probe->addr,
+		    probe->addrlen) == 0)
+		return probe_connected(probe);
+	if (errno != EINPROGRESS)
+		return probe_done(probe, PROBE_FAILED);
+	probe->events = POLLOUT;
+	return PROBE_WAITING;
+}
+
+enum probe_result probe_continue(struct probe *probe)
+{
+	ssize_t count;
+	socklen_t len;
+	int error;
+	int status;
+
+	if (probe->events == POLLOUT) {
+		len = sizeof(error);
+		if (getsockopt(probe->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 ||
+		    error != 0)
+			return probe_done(probe, PROBE_FAILED);
+		return probe_connected(probe);
+	}
+
+	/* All we want of the reply is its status line */
+	count = read(probe->fd, probe->reply + probe->len,
+			sizeof(probe->reply) - 1 - probe->len);
+	if (count == -1)
+		return errno == EAGAIN || errno == EINTR ?
+			PROBE_WAITING : probe_done(probe, PROBE_FAILED);
+	probe->len += count;
+	probe->reply[probe->len] = '\0';
+	if (count > 0 && !strchr(probe->reply, '\n') &&
+	    probe->len < sizeof(probe->reply) - 1)
+		return PROBE_WAITING;
+
+	if (sscanf(probe->reply, "HTTP/%*u.%*u %d", &status) == 1 &&
+	    status >= 200 && status < 400)
+		return probe_done(probe, PROBE_OK);
+	return probe_done(probe, PROBE_FAILED);
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2016 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/HEAD/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/HEAD/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <time.h>
+
+/* seconds a probe may take before it counts as failed */
+#define PROBE_TIMEOUT 5
+
+enum probe_result {
+	PROBE_OK,
+	PROBE_FAILED,
+	PROBE_WAITING,
+};
+
+struct probe {
+	enum {
+		PROBE_NONE = 0,
+		PROBE_TCP,
+		PROBE_UNIX,
+		PROBE_HTTP,
+		PROBE_FILE,
+	} type;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	char *path;
+	char *host;
+	time_t max_age;
+	/* While we wait on it, poll fd for events */
+	int fd;
+	short events;
+	char reply[64];
+	size_t len;
+};
+
+bool probe_parse(struct probe *probe, const char *spec);
+enum probe_result probe_start(struct probe *probe);
+enum probe_result probe_continue(struct probe *probe);
+void probe_cancel(struct probe *probe);
+void probe_free(struct probe *probe);
+
+#endif
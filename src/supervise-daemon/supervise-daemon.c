@@ -22,14 +22,22 @@
 #define ONE_SECOND    1000000000
 #define ONE_MS           1000000
 
+/* bytes, for a request to a shared supervisor */
+#define REQUEST_MAX      1048576
+/* requests a shared supervisor reads at once */
+#define MAX_CLIENTS           64
+
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
 #include <grp.h>
+#include <inttypes.h>
+#include <poll.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,11 +46,15 @@
 #ifdef __linux__
 # include <sys/syscall.h> /* For io priority */
 # include <sys/prctl.h> /* For prctl */
+# include <sys/signalfd.h>
 #endif
 #include <syslog.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
@@ -64,10 +76,15 @@ static struct pam_conv conv = { NULL, NULL};
 #include "misc.h"
 #include "pipes.h"
 #include "plugin.h"
+#include "probe.h"
 #include "schedules.h"
 #include "_usage.h"
 #include "helpers.h"
 
+#ifndef MSG_NOSIGNAL
+#  define MSG_NOSIGNAL 0
+#endif
+
 /* Use long option value that is out of range for 8 bit getopt values.
  * The exact enum value is internal and can freely change, so we keep the
  * options sorted.
@@ -83,6 +100,13 @@ enum {
   LONGOPT_STDERR_LOGGER,
   LONGOPT_STDOUT_LOGGER,
   LONGOPT_READY,
+  LONGOPT_SHARED,
+  LONGOPT_CHILD,
+  LONGOPT_RESPAWN_DELAY_MAX,
+  LONGOPT_RESPAWN_JITTER,
+  LONGOPT_RESPAWN_RESET,
+  LONGOPT_RESPAWN_PARK,
+  LONGOPT_HEALTHCHECK_PROBE,
 };
 
 const char *applet = NULL;
@@ -118,6 +142,13 @@ const struct option longopts[] = {
 	{ "stderr-logger",1, NULL, LONGOPT_STDERR_LOGGER},
 	{ "reexec",       0, NULL, '3'},
 	{ "ready",        1, NULL, LONGOPT_READY},
+	{ "shared",       0, NULL, LONGOPT_SHARED},
+	{ "child",        1, NULL, LONGOPT_CHILD},
+	{ "respawn-delay-max", 1, NULL, LONGOPT_RESPAWN_DELAY_MAX},
+	{ "respawn-jitter", 1, NULL, LONGOPT_RESPAWN_JITTER},
+	{ "respawn-reset", 1, NULL, LONGOPT_RESPAWN_RESET},
+	{ "respawn-park", 1, NULL, LONGOPT_RESPAWN_PARK},
+	{ "healthcheck-probe", 1, NULL, LONGOPT_HEALTHCHECK_PROBE},
 	longopts_COMMON
 };
 const char * const longopts_help[] = {
@@ -148,13 +179,21 @@ const char * const longopts_help[] = {
 	"Redirect stdout to process",
 	"Redirect stderr to process",
 	"reexec (used internally)",
+	"Tell the daemon it is ready on this fd",
+	"Register with a supervisor shared by many daemons",
+	"run the daemon for a shared supervisor (used internally)",
+	"Double the respawn delay after each crash, up to this",
+	"Take up to this percentage off each respawn delay at random",
+	"Reset the respawn delay once the daemon has been up this long",
+	"Wait this long instead of giving up after respawn-max",
+	"Check health with this probe instead of healthcheck()",
 	longopts_help_COMMON
 };
 const char *usagestring = NULL;
 
 static int healthcheckdelay = 0;
 static int healthchecktimer = 0;
-static volatile sig_atomic_t do_healthcheck = 0;
+static char *healthcheck_probe = NULL;
 static volatile sig_atomic_t exiting = 0;
 static int nicelevel = INT_MIN;
 static int ionicec = -1;
@@ -175,15 +214,139 @@ static char *stdout_process = NULL;
 #ifdef TIOCNOTTY
 static int tty_fd = -1;
 #endif
-static pid_t child_pid;
 static int respawn_count = 0;
 static int respawn_delay = 0;
 static int respawn_max = 10;
 static int respawn_period = 0;
+static int respawn_delay_max = 0;
+static int respawn_jitter = 0;
+static int respawn_reset = 0;
+static int respawn_park = 0;
+
+/* Saved for --reexec along with respawn_delay and respawn_max */
+static const struct {
+	const char *name;
+	int *value;
+} respawn_values[] = {
+	{ "respawn_period", &respawn_period },
+	{ "respawn_delay_max", &respawn_delay_max },
+	{ "respawn_jitter", &respawn_jitter },
+	{ "respawn_reset", &respawn_reset },
+	{ "respawn_park", &respawn_park },
+};
+
+/* A shared supervisor starts each daemon with the resource limits of
+ * the supervise-daemon which registered it, as openrc-run set them */
+static const int rlimit_resources[] = {
+	RLIMIT_CORE, RLIMIT_CPU, RLIMIT_DATA, RLIMIT_FSIZE, RLIMIT_NOFILE,
+	RLIMIT_STACK,
+#ifdef RLIMIT_AS
+	RLIMIT_AS,
+#endif
+#ifdef RLIMIT_MEMLOCK
+	RLIMIT_MEMLOCK,
+#endif
+#ifdef RLIMIT_MSGQUEUE
+	RLIMIT_MSGQUEUE,
+#endif
+#ifdef RLIMIT_NICE
+	RLIMIT_NICE,
+#endif
+#ifdef RLIMIT_NPROC
+	RLIMIT_NPROC,
+#endif
+#ifdef RLIMIT_RSS
+	RLIMIT_RSS,
+#endif
+#ifdef RLIMIT_RTPRIO
+	RLIMIT_RTPRIO,
+#endif
+#ifdef RLIMIT_RTTIME
+	RLIMIT_RTTIME,
+#endif
+#ifdef RLIMIT_SIGPENDING
+	RLIMIT_SIGPENDING,
+#endif
+};
 static char *fifopath = NULL;
 static int fifo_fd = 0;
+static int fifo_wfd = -1;
+static int signal_fd = -1;
+static sigset_t orig_signals;
 static char *pidfile = NULL;
 static char *svcname = NULL;
+static bool shared = false;
+static char *socketpath = NULL;
+static int listen_fd = -1;
+
+/* A connection to a shared supervisor whose request is still coming in */
+struct client {
+	int fd;
+	int passed_fd;
+	char *request;
+	size_t len;
+	int64_t deadline;
+};
+static struct client clients[MAX_CLIENTS];
+static size_t nclients = 0;
+
+/* Counters of the cgroup of a service, taken as each daemon is started
+ * so that we can tell what it used by the time it has gone */
+struct cgroup_usage {
+	uint64_t cpu_usec;
+	uint64_t throttled_usec;
+	uint64_t oom_kills;
+	uint64_t rbytes;
+	uint64_t wbytes;
+};
+
+/* A daemon we look after. On our own there is only the one, set up from
+ * our options. A shared supervisor is sent these by supervise-daemon
+ * --shared and runs each daemon through supervise-daemon --child with
+ * the options and environment it was given, so it keeps no per service
+ * state of its own beyond this. */
+struct supervised {
+	char *svcname;
+	char *exec;
+	char **argv;
+	char **options;
+	char **envp;
+	char *pidfile;
+	char *retry;
+	int sig;
+	int healthcheckdelay;
+	int healthchecktimer;
+	int64_t health_at;
+	pid_t health_pid;
+	bool unhealthy;
+	struct probe probe;
+	int64_t probe_deadline;
+	pid_t child_pid;
+	pid_t stop_pid;
+	int ready_fd;
+	int respawn_count;
+	int respawn_delay;
+	int respawn_max;
+	int respawn_period;
+	int respawn_delay_max;
+	int respawn_jitter;
+	int respawn_reset;
+	int respawn_park;
+	int backoff;
+	int64_t respawn_at;
+	int64_t spawned_at;
+	time_t first_spawn;
+	bool parked;
+	bool removing;
+	bool failing;
+	char *cgroup;
+	struct cgroup_usage usage;
+	struct rlimit rlimits[ARRAY_SIZE(rlimit_resources)];
+	bool rlimit_set[ARRAY_SIZE(rlimit_resources)];
+	int client_fd;
+	TAILQ_ENTRY(supervised) entries;
+};
+static TAILQ_HEAD(, supervised) services = TAILQ_HEAD_INITIALIZER(services);
 static bool verbose = false;
 #ifdef __linux__
 static cap_iab_t cap_iab = NULL;
@@ -225,37 +388,76 @@ RC_NORETURN static void re_exec_supervisor(void)
 	exit(EXIT_FAILURE);
 }
 
-static void handle_signal(int sig)
+/* Signals reach the main loop through a file descriptor, a signalfd where
+ * we have one and a pipe written by the handler otherwise */
+#ifdef __linux__
+static int signals_open(const int *sigs, size_t count)
+{
+	sigset_t set;
+	size_t i;
+
+	sigemptyset(&set);
+	for (i = 0; i < count; i++)
+		sigaddset(&set, sigs[i]);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+	return signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+static int signals_read(int fd)
+{
+	struct signalfd_siginfo si;
+
+	if (read(fd, &si, sizeof(si)) != sizeof(si))
+		return 0;
+	return si.ssi_signo;
+}
+#else
+static int signal_pipe[2] = { -1, -1 };
+
+static void signal_write(int sig)
 {
 	int serrno = errno;
-	pid_t pid;
+	unsigned char c = sig;
 
-	switch (sig) {
-	case SIGALRM:
-		do_healthcheck = 1;
-		break;
-	case SIGCHLD:
-		if (exiting)
-			while (waitpid((pid_t)(-1), NULL, WNOHANG) > 0) {}
-		else {
-			while ((pid = waitpid((pid_t)(-1), NULL, WNOHANG|WNOWAIT)) > 0) {
-				if (pid == child_pid)
-					break;
-				pid = waitpid(pid, NULL, WNOHANG);
-			}
-		}
-		break;
-	case SIGTERM:
-		exiting = 1;
-		break;
-	default:
-		syslog(LOG_WARNING, "caught signal %d", sig);
-		re_exec_supervisor();
-	}
+	if (write(signal_pipe[1], &c, 1) == -1) {}
 	/* Restore errno */
 	errno = serrno;
 }
 
+static int signals_open(const int *sigs, size_t count)
+{
+	struct sigaction sa;
+	sigset_t set;
+	size_t i;
+
+	if (pipe(signal_pipe) == -1)
+		return -1;
+	for (i = 0; i < 2; i++) {
+		fcntl(signal_pipe[i], F_SETFD, FD_CLOEXEC);
+		fcntl(signal_pipe[i], F_SETFL, O_NONBLOCK);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = signal_write;
+	sigemptyset(&set);
+	for (i = 0; i < count; i++) {
+		sigaction(sigs[i], &sa, NULL);
+		sigaddset(&set, sigs[i]);
+	}
+	sigprocmask(SIG_UNBLOCK, &set, NULL);
+	return signal_pipe[0];
+}
+
+static int signals_read(int fd)
+{
+	unsigned char c;
+
+	if (read(fd, &c, 1) != 1)
+		return 0;
+	return c;
+}
+#endif
+
 static char * expand_home(const char *home, const char *path)
 {
 	char *opath, *ppath, *p, *nh;
@@ -311,7 +513,163 @@ static char *make_cmdline(char **argv)
 	return cmdline;
 }
 
-static pid_t exec_command(const char *cmd)
+#ifdef __linux__
+/* Our cgroup in the unified hierarchy */
+static char *cgroup_self(void)
+{
+	FILE *fp;
+	char *line = NULL;
+	char *cgroup = NULL;
+	size_t len = 0;
+
+	if (!(fp = fopen("/proc/self/cgroup", "r")))
+		return NULL;
+	while (!cgroup && xgetline(&line, &len, fp) != -1)
+		if (strncmp(line, "0::", 3) == 0)
+			cgroup = xstrdup(line + 3);
+	free(line);
+	fclose(fp);
+	return cgroup;
+}
+
+/* Where the unified hierarchy is mounted, if it is */
+static const char *cgroup_root(void)
+{
+	static char *root;
+	FILE *fp;
+	char *line = NULL;
+	char *field;
+	char *p;
+	size_t len = 0;
+	int i;
+
+	if (!root && (fp = fopen("/proc/self/mountinfo", "r"))) {
+		/* The mount point is the fifth field */
+		while (!root && xgetline(&line, &len, fp) != -1) {
+			if (!strstr(line, " - cgroup2 "))
+				continue;
+			for (field = line, i = 0; field && i < 4; i++)
+				if ((field = strchr(field, ' ')))
+					field++;
+			if (field && (p = strchr(field, ' '))) {
+				*p = '\0';
+				root = xstrdup(field);
+			}
+		}
+		free(line);
+		fclose(fp);
+	}
+	return root;
+}
+
+/* Move into a cgroup of the unified hierarchy, if it is mounted */
+static void cgroup_enter(const char *cgroup)
+{
+	const char *root = cgroup_root();
+	FILE *fp;
+	char *file;
+
+	if (!root || !cgroup)
+		return;
+
+	xasprintf(&file, "%s%s/cgroup.procs", root, cgroup);
+	if ((fp = fopen(file, "w"))) {
+		fprintf(fp, "0\n");
+		fclose(fp);
+	}
+	free(file);
+}
+
+/* openrc-run put the supervise-daemon which started us in the cgroup of
+ * its service, which is no place for a supervisor of other services too */
+static void cgroup_leave(void)
+{
+	char *cgroup = cgroup_self();
+	char *p;
+
+	if (cgroup && (p = strrchr(cgroup, '/')) &&
+	    strncmp(p + 1, "openrc.", 7) == 0)
+	{
+		p[p == cgroup ? 1 : 0] = '\0';
+		cgroup_enter(cgroup);
+	}
+	free(cgroup);
+}
+
+/* Add up every "key value" or "key=value" in a cgroup file, which for
+ * io.stat means over all devices */
+static uint64_t cgroup_counter(const char *cgroup, const char *name,
+		const char *key)
+{
+	FILE *fp;
+	char *file;
+	char *line = NULL;
+	char *token;
+	char *value;
+	size_t len = 0;
+	size_t keylen = strlen(key);
+	uint64_t total = 0;
+
+	xasprintf(&file, "%s%s/%s", cgroup_root(), cgroup, name);
+	fp = fopen(file, "r");
+	free(file);
+	if (!fp)
+		return 0;
+	while (xgetline(&line, &len, fp) != -1)
+		for (token = strtok(line, " "); token; token = strtok(NULL, " ")) {
+			if (strcmp(token, key) == 0)
+				value = strtok(NULL, " ");
+			else if (strncmp(token, key, keylen) == 0 &&
+			    token[keylen] == '=')
+				value = token + keylen + 1;
+			else
+				continue;
+			if (value)
+				total += strtoull(value, NULL, 10);
+		}
+	free(line);
+	fclose(fp);
+	return total;
+}
+
+/* Only the cgroup openrc-run made for the service tells us anything
+ * about its daemon, rather than about whatever else shares it */
+static bool cgroup_usage(const char *cgroup, struct cgroup_usage *usage)
+{
+	const char *p;
+
+	memset(usage, 0, sizeof(*usage));
+	if (!cgroup || !cgroup_root() || !(p = strrchr(cgroup, '/')) ||
+	    strncmp(p + 1, "openrc.", 7) != 0)
+		return false;
+	usage->cpu_usec = cgroup_counter(cgroup, "cpu.stat", "usage_usec");
+	usage->throttled_usec = cgroup_counter(cgroup, "cpu.stat",
+			"throttled_usec");
+	usage->oom_kills = cgroup_counter(cgroup, "memory.events", "oom_kill");
+	usage->rbytes = cgroup_counter(cgroup, "io.stat", "rbytes");
+	usage->wbytes = cgroup_counter(cgroup, "io.stat", "wbytes");
+	return true;
+}
+
+/* memory.peak is all we have, and it is for the life of the cgroup */
+static uint64_t cgroup_memory_peak(const char *cgroup)
+{
+	FILE *fp;
+	char *file;
+	unsigned long long peak = 0;
+
+	xasprintf(&file, "%s%s/memory.peak", cgroup_root(), cgroup);
+	if ((fp = fopen(file, "r"))) {
+		if (fscanf(fp, "%llu", &peak) != 1)
+			peak = 0;
+		fclose(fp);
+	}
+	free(file);
+	return peak;
+}
+#endif
+
+static pid_t exec_command(struct supervised *sv, const char *cmd)
 {
 	char *file;
 	pid_t pid = -1;
@@ -319,7 +677,7 @@ static pid_t exec_command(const char *cmd)
 	sigset_t old;
 	struct sigaction sa;
 
-	file = rc_service_resolve(svcname);
+	file = rc_service_resolve(sv->svcname);
 	if (!exists(file)) {
 		free(file);
 		return 0;
@@ -344,9 +702,13 @@ static pid_t exec_command(const char *cmd)
 		sigaction(SIGWINCH, &sa, NULL);
 
 		/* Unmask signals */
-		sigprocmask(SIG_SETMASK, &old, NULL);
+		sigprocmask(SIG_SETMASK, &orig_signals, NULL);
 
 		/* Safe to run now */
+#ifdef __linux__
+		cgroup_enter(sv->cgroup);
+#endif
+		environ = sv->envp;
 		execl(file, file, cmd, (char *) NULL);
 		syslog(LOG_ERR, "unable to exec `%s': %s\n",
 		    file, strerror(errno));
@@ -606,50 +968,854 @@ RC_NORETURN static void child_process(char *exec, char **argv)
 	eerrorx("%s: failed to exec `%s': %s", applet, exec,strerror(errno));
 }
 
-RC_NORETURN static void supervisor(char *exec, char **argv)
+static int64_t now_ms(void)
 {
-	FILE *fp;
-	char buf[2048];
-	char cmd[2048];
-	int count;
-	int failing;
-	int health_status;
-	int healthcheck_respawn;
-	int i;
-	int nkilled;
-	int sig_send;
-	pid_t health_pid;
-	pid_t wait_pid;
-	sigset_t old_signals;
-	sigset_t signals;
-	struct sigaction sa;
 	struct timespec ts;
-	time_t respawn_now= 0;
-	time_t first_spawn= 0;
 
-	/* block all signals we do not handle */
-	sigfillset(&signals);
-	sigdelset(&signals, SIGALRM);
-	sigdelset(&signals, SIGCHLD);
-	sigdelset(&signals, SIGTERM);
-	sigprocmask(SIG_SETMASK, &signals, &old_signals);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / ONE_MS;
+}
+
+static char **strv_dup(char *const *strv)
+{
+	char **copy;
+	size_t i, count = 0;
+
+	while (strv && strv[count])
+		count++;
+	copy = xmalloc((count + 1) * sizeof(*copy));
+	for (i = 0; i < count; i++)
+		copy[i] = xstrdup(strv[i]);
+	copy[count] = NULL;
+	return copy;
+}
+
+static char **strv_from_list(RC_STRINGLIST *list)
+{
+	RC_STRING *s;
+	char **strv;
+	size_t count = 0;
+
+	TAILQ_FOREACH(s, list, entries)
+		count++;
+	strv = xmalloc((count + 1) * sizeof(*strv));
+	count = 0;
+	TAILQ_FOREACH(s, list, entries)
+		strv[count++] = xstrdup(s->value);
+	strv[count] = NULL;
+	return strv;
+}
+
+static void strv_free(char **strv)
+{
+	char **p;
+
+	for (p = strv; p && *p; p++)
+		free(*p);
+	free(strv);
+}
+
+static struct supervised *sv_new(void)
+{
+	struct supervised *sv = xmalloc(sizeof(*sv));
+
+	memset(sv, 0, sizeof(*sv));
+	sv->sig = SIGTERM;
+	sv->respawn_max = 10;
+	sv->ready_fd = -1;
+	sv->client_fd = -1;
+	sv->probe.fd = -1;
+	return sv;
+}
+
+static void sv_free(struct supervised *sv)
+{
+	free(sv->svcname);
+	free(sv->exec);
+	strv_free(sv->argv);
+	strv_free(sv->options);
+	strv_free(sv->envp);
+	free(sv->pidfile);
+	free(sv->retry);
+	free(sv->cgroup);
+	probe_free(&sv->probe);
+	if (sv->ready_fd != -1)
+		close(sv->ready_fd);
+	if (sv->client_fd != -1)
+		close(sv->client_fd);
+	free(sv);
+}
+
+static struct supervised *sv_find(const char *name)
+{
+	struct supervised *sv;
+
+	TAILQ_FOREACH(sv, &services, entries)
+		if (strcmp(sv->svcname, name) == 0)
+			return sv;
+	return NULL;
+}
+
+/* Write our pid to the pidfile of the daemon, as it is us that
+ * rc_service_daemons_crashed() should look for */
+static bool sv_register(struct supervised *sv)
+{
+	FILE *fp;
+
+	if (!(fp = fopen(sv->pidfile, "w")))
+		return false;
+	fprintf(fp, "%d\n", getpid());
+	fclose(fp);
+	rc_service_daemon_set(sv->svcname, sv->exec,
+			(const char *const *)sv->argv, sv->pidfile, true);
+	return true;
+}
+
+static void client_reply(int fd, const char *message)
+{
+	char *line;
+	int len;
+
+	len = xasprintf(&line, "%s\n", message);
+	if (send(fd, line, len, MSG_NOSIGNAL) != len)
+		syslog(LOG_WARNING, "%s: unable to reply: %s", applet,
+				strerror(errno));
+	free(line);
+	close(fd);
+}
+
+/* Nothing we started for the daemon is left, so we are done with it */
+static void sv_remove(struct supervised *sv)
+{
+	rc_service_daemon_set(sv->svcname, sv->exec,
+			(const char *const *)sv->argv, sv->pidfile, false);
+	rc_service_value_set(sv->svcname, "child_pid", NULL);
+	rc_service_value_set(sv->svcname, "parked", NULL);
+	rc_service_mark(sv->svcname, RC_SERVICE_STOPPED);
+	if (sv->failing)
+		rc_service_mark(sv->svcname, RC_SERVICE_FAILED);
+	if (sv->pidfile && exists(sv->pidfile))
+		unlink(sv->pidfile);
+	if (shared)
+		syslog(LOG_INFO, "no longer supervising %s", sv->svcname);
+	if (sv->client_fd != -1) {
+		client_reply(sv->client_fd, "ok");
+		sv->client_fd = -1;
+	}
+	TAILQ_REMOVE(&services, sv, entries);
+	sv_free(sv);
+}
+
+static void sv_reap(struct supervised *sv)
+{
+	if (sv->removing && sv->child_pid <= 0 && sv->health_pid <= 0 &&
+	    sv->stop_pid <= 0)
+		sv_remove(sv);
+}
+
+static void health_schedule(struct supervised *sv, int delay)
+{
+	sv->health_at = delay ? now_ms() + delay * 1000LL : 0;
+}
+
+/* Put back the signals we took over before a child of ours goes on */
+static void child_signals(void)
+{
+	struct sigaction sa;
 
-	/* install signal  handler */
 	memset(&sa, 0, sizeof(sa));
-	sa.sa_handler = handle_signal;
-	sigaction(SIGALRM, &sa, NULL);
+	sa.sa_handler = SIG_DFL;
 	sigaction(SIGCHLD, &sa, NULL);
 	sigaction(SIGTERM, &sa, NULL);
+	sigprocmask(SIG_SETMASK, &orig_signals, NULL);
+}
 
-	fp = fopen(pidfile, "w");
-	if (!fp)
-		eerrorx("%s: fopen `%s': %s", applet, pidfile, strerror(errno));
-	fprintf(fp, "%d\n", getpid());
-	fclose(fp);
+/* A shared supervisor runs the daemon through supervise-daemon --child,
+ * which sets it up from the options it was registered with */
+RC_NORETURN static void child_exec(struct supervised *sv)
+{
+	char **argv;
+	size_t count = 0;
+	size_t i;
+
+	while (sv->options[count])
+		count++;
+	argv = xmalloc((count + 5) * sizeof(*argv));
+	argv[0] = xstrdup("supervise-daemon");
+	argv[1] = sv->svcname;
+	argv[2] = xstrdup("--child");
+	xasprintf(&argv[3], "%d:%d", sv->respawn_count, sv->ready_fd);
+	memcpy(argv + 4, sv->options, (count + 1) * sizeof(*argv));
+
+	if (sv->ready_fd != -1)
+		fcntl(sv->ready_fd, F_SETFD, 0);
+#ifdef __linux__
+	cgroup_enter(sv->cgroup);
+#endif
+	for (i = 0; i < ARRAY_SIZE(rlimit_resources); i++)
+		if (sv->rlimit_set[i] &&
+		    setrlimit(rlimit_resources[i], &sv->rlimits[i]) == -1)
+			syslog(LOG_WARNING, "%s: setrlimit %d: %s", sv->svcname,
+					rlimit_resources[i], strerror(errno));
+	environ = sv->envp;
+	execvp(argv[0], argv);
+	syslog(LOG_ERR, "Unable to execute supervise-daemon: %s",
+			strerror(errno));
+	_exit(EXIT_FAILURE);
+}
+
+static void spawn_child(struct supervised *sv)
+{
+	sv->child_pid = fork();
+	if (sv->child_pid == -1) {
+		syslog(LOG_ERR, "%s: fork: %s", applet, strerror(errno));
+		sv->child_pid = 0;
+		sv->respawn_at = now_ms() + 1000;
+		return;
+	}
+	if (sv->child_pid == 0) {
+		child_signals();
+		if (sv->options)
+			child_exec(sv);
+		/* Only the first start is told about the ready fd */
+		if (ready.type == READY_FD)
+			ready.pipe[1] = sv->ready_fd != -1 ? sv->ready_fd : devnull_fd;
+		respawn_count = sv->respawn_count;
+		child_process(sv->exec, sv->argv);
+	}
+	if (sv->ready_fd != -1) {
+		close(sv->ready_fd);
+		sv->ready_fd = -1;
+	}
+	sv->spawned_at = now_ms();
+#ifdef __linux__
+	cgroup_usage(sv->cgroup, &sv->usage);
+#endif
+	if (sv->parked) {
+		sv->parked = false;
+		rc_service_value_set(sv->svcname, "parked", NULL);
+	}
+	health_schedule(sv, sv->healthcheckdelay ?
+			sv->healthcheckdelay : sv->healthchecktimer);
+}
+
+/*
+ * How long to wait before the next respawn. With a respawn_delay_max the
+ * delay doubles with each crash up to that, and goes back down once the
+ * daemon has stayed up for respawn_reset. The jitter keeps daemons which
+ * crash together, say when a database they all use goes away, from all
+ * coming back at the same moment too.
+ */
+static int64_t respawn_wait(struct supervised *sv)
+{
+	int64_t delay = sv->respawn_delay * 1000LL;
+	int64_t ceiling = sv->respawn_delay_max * 1000LL;
+	int reset = sv->respawn_reset ? sv->respawn_reset : sv->respawn_delay_max;
+	int i;
+
+	if (ceiling > 0) {
+		if (now_ms() - sv->spawned_at >= reset * 1000LL)
+			sv->backoff = 0;
+		if (delay == 0)
+			delay = 1000;
+		for (i = 0; i < sv->backoff && delay < ceiling; i++)
+			delay *= 2;
+		/* Stop counting once we are at the ceiling */
+		if (delay >= ceiling)
+			delay = ceiling;
+		else
+			sv->backoff++;
+	}
+	if (sv->respawn_jitter > 0 && delay > 0)
+		delay -= random() % (delay * sv->respawn_jitter / 100 + 1);
+	return delay;
+}
+
+/* Leave what the daemon which has just gone used where rc-status can
+ * show it, so that crashes from running out of memory or CPU stand out */
+static void child_usage(struct supervised *sv, int status,
+		const struct rusage *ru)
+{
+	char *value;
+#ifdef __linux__
+	char *cgroup_value;
+	struct cgroup_usage usage;
+	uint64_t cpu;
+	uint64_t throttled;
+#endif
+
+	xasprintf(&value, "status=%s:%d respawn=%d utime=%ld.%03ld "
+			"stime=%ld.%03ld maxrss=%ld",
+			WIFSIGNALED(status) ? "signal" : "exit",
+			WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status),
+			sv->respawn_count,
+			(long)ru->ru_utime.tv_sec, (long)ru->ru_utime.tv_usec / 1000,
+			(long)ru->ru_stime.tv_sec, (long)ru->ru_stime.tv_usec / 1000,
+			(long)ru->ru_maxrss);
+#ifdef __linux__
+	if (cgroup_usage(sv->cgroup, &usage)) {
+		cpu = usage.cpu_usec - sv->usage.cpu_usec;
+		throttled = usage.throttled_usec - sv->usage.throttled_usec;
+		xasprintf(&cgroup_value, "%s cpu=%"PRIu64".%03"PRIu64
+				" throttled=%"PRIu64".%03"PRIu64" oom_kill=%"PRIu64
+				" memory_peak=%"PRIu64" rbytes=%"PRIu64" wbytes=%"PRIu64,
+				value, cpu / 1000000, cpu / 1000 % 1000,
+				throttled / 1000000, throttled / 1000 % 1000,
+				usage.oom_kills - sv->usage.oom_kills,
+				cgroup_memory_peak(sv->cgroup),
+				usage.rbytes - sv->usage.rbytes,
+				usage.wbytes - sv->usage.wbytes);
+		free(value);
+		value = cgroup_value;
+	}
+#endif
+	rc_service_value_set(sv->svcname, "last_exit", value);
+	free(value);
+}
+
+/* The child has gone, so respawn it after respawn_delay unless it has
+ * been respawned too many times */
+static void child_exited(struct supervised *sv, int status,
+		const struct rusage *ru)
+{
+	time_t respawn_now;
+	char parked[20];
+
+	if (WIFEXITED(status))
+		syslog(LOG_WARNING, "%s, pid %d, exited with return code %d",
+				sv->exec, sv->child_pid, WEXITSTATUS(status));
+	else if (WIFSIGNALED(status))
+		syslog(LOG_WARNING, "%s, pid %d, terminated by signal %d",
+				sv->exec, sv->child_pid, WTERMSIG(status));
+	sv->child_pid = 0;
+	sv->health_at = 0;
+	sv->probe_deadline = 0;
+	probe_cancel(&sv->probe);
+	if (sv->removing) {
+		sv_reap(sv);
+		return;
+	}
+	child_usage(sv, status, ru);
+
+	respawn_now = time(NULL);
+	if (sv->first_spawn == 0)
+		sv->first_spawn = respawn_now;
+	if ((sv->respawn_period > 0)
+			&& (respawn_now - sv->first_spawn > sv->respawn_period)) {
+		sv->respawn_count = 0;
+		sv->first_spawn = 0;
+	} else
+		sv->respawn_count++;
+	if (sv->respawn_max > 0 && sv->respawn_count > sv->respawn_max &&
+	    sv->respawn_park > 0) {
+		/* Leave it be for a while and then start over */
+		syslog(LOG_WARNING, "respawned \"%s\" too many times, "
+				"parking it for %d seconds", sv->exec, sv->respawn_park);
+		sv->respawn_count = 0;
+		sv->first_spawn = 0;
+		sv->parked = true;
+		from_time_t(parked, respawn_now + sv->respawn_park);
+		rc_service_value_set(sv->svcname, "parked", parked);
+		sv->respawn_at = now_ms() + sv->respawn_park * 1000LL;
+		return;
+	}
+	if (sv->respawn_max > 0 && sv->respawn_count > sv->respawn_max) {
+		syslog(LOG_WARNING, "respawned \"%s\" too many times, exiting",
+				sv->exec);
+		sv->failing = true;
+		sv->removing = true;
+		sv_reap(sv);
+		return;
+	}
+	sv->respawn_at = now_ms() + respawn_wait(sv);
+}
+
+/* The stop schedule runs in a child of its own, so that we go on looking
+ * after everything else, reaping the daemon included, while it waits */
+static void stop_child(struct supervised *sv)
+{
+	int nkilled;
+
+	if (sv->child_pid <= 0 || sv->stop_pid > 0)
+		return;
+	syslog(LOG_INFO, "stopping %s, pid %d", sv->exec, sv->child_pid);
+	sv->stop_pid = fork();
+	if (sv->stop_pid == -1) {
+		syslog(LOG_ERR, "%s: fork: %s", applet, strerror(errno));
+		sv->stop_pid = 0;
+		kill(sv->child_pid, sv->sig);
+		return;
+	}
+	if (sv->stop_pid == 0) {
+		child_signals();
+		parse_schedule(applet, sv->retry, sv->sig);
+		nkilled = run_stop_schedule(applet, NULL, NULL, sv->child_pid, 0,
+				false, false, true);
+		if (nkilled > 0)
+			syslog(LOG_INFO, "killed %d processes", nkilled);
+		_exit(nkilled < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+}
+
+static void stop_done(struct supervised *sv, int status)
+{
+	sv->stop_pid = 0;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+		syslog(LOG_INFO, "Unable to stop %s", sv->exec);
+	sv_reap(sv);
+}
+
+/* Stop the daemon for good */
+static void sv_stop(struct supervised *sv)
+{
+	sv->removing = true;
+	sv->respawn_at = 0;
+	sv->health_at = 0;
+	sv->probe_deadline = 0;
+	probe_cancel(&sv->probe);
+	stop_child(sv);
+	sv_reap(sv);
+}
+
+/* A failed health check runs unhealthy and then stops the child, to be
+ * respawned */
+static void health_result(struct supervised *sv, bool healthy)
+{
+	if (healthy) {
+		health_schedule(sv, sv->healthchecktimer);
+		return;
+	}
+	syslog(LOG_WARNING, "health check for %s failed", sv->svcname);
+	sv->unhealthy = true;
+	if ((sv->health_pid = exec_command(sv, "unhealthy")) > 0)
+		return;
+	sv->health_pid = 0;
+	stop_child(sv);
+}
+
+/* A probe is answered in our poll loop, and only without one do we ask
+ * the service script */
+static void health_check(struct supervised *sv)
+{
+	enum probe_result result;
+
+	if (verbose)
+		syslog(LOG_DEBUG, "running health check for %s", sv->svcname);
+	sv->unhealthy = false;
+	if (sv->probe.type != PROBE_NONE) {
+		result = probe_start(&sv->probe);
+		if (result == PROBE_WAITING)
+			sv->probe_deadline = now_ms() + PROBE_TIMEOUT * 1000LL;
+		else
+			health_result(sv, result == PROBE_OK);
+		return;
+	}
+	sv->health_pid = exec_command(sv, "healthcheck");
+	if (sv->health_pid <= 0) {
+		sv->health_pid = 0;
+		health_schedule(sv, sv->healthchecktimer);
+	}
+}
+
+/* The healthcheck or unhealthy command has finished */
+static void health_done(struct supervised *sv, int status)
+{
+	sv->health_pid = 0;
+	if (sv->child_pid <= 0 || sv->removing) {
+		sv_reap(sv);
+		return;
+	}
+
+	if (sv->unhealthy)
+		stop_child(sv);
+	else
+		health_result(sv, WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+/* The probe's fd is ready, or it has run out of time */
+static void probe_ready(struct supervised *sv, bool timeout)
+{
+	enum probe_result result;
+
+	if (timeout) {
+		probe_cancel(&sv->probe);
+		result = PROBE_FAILED;
+	} else if ((result = probe_continue(&sv->probe)) == PROBE_WAITING)
+		return;
+	sv->probe_deadline = 0;
+	health_result(sv, result == PROBE_OK);
+}
+
+static void handle_signal(int sig)
+{
+	struct supervised *sv;
+	struct rusage ru;
+	int status;
+	pid_t pid;
+
+	switch (sig) {
+	case SIGCHLD:
+		while ((pid = wait4((pid_t)(-1), &status, WNOHANG, &ru)) > 0)
+			TAILQ_FOREACH(sv, &services, entries) {
+				if (pid == sv->child_pid) {
+					child_exited(sv, status, &ru);
+					break;
+				} else if (pid == sv->health_pid) {
+					health_done(sv, status);
+					break;
+				} else if (pid == sv->stop_pid) {
+					stop_done(sv, status);
+					break;
+				}
+			}
+		break;
+	case SIGTERM:
+		exiting = 1;
+		break;
+	default:
+		syslog(LOG_WARNING, "caught signal %d", sig);
+		re_exec_supervisor();
+	}
+}
+
+static bool sv_signal(struct supervised *sv, int sig)
+{
+	if (sv->child_pid <= 0) {
+		syslog(LOG_ERR, "Unable to send signal %d, "
+				"the daemon is not running", sig);
+		return false;
+	}
+	syslog(LOG_INFO, "Sending signal %d to %d", sig, sv->child_pid);
+	if (kill(sv->child_pid, sig) == -1) {
+		syslog(LOG_ERR, "Unable to send signal %d to %d",
+				sig, sv->child_pid);
+		return false;
+	}
+	return true;
+}
+
+static void control_command(char *buf)
+{
+	char cmd[2048];
+	int sig_send;
+
+	if (verbose)
+		syslog(LOG_DEBUG, "Received %s from fifo", buf);
+	if (strncasecmp(buf, "sig", 3) == 0) {
+		if ((sscanf(buf, "%s %d", cmd, &sig_send) == 2)
+				&& (sig_send >= 0 && sig_send < NSIG))
+			sv_signal(TAILQ_FIRST(&services), sig_send);
+	}
+}
+
+/* Commands come a line at a time, though older versions of us did not
+ * end them with a newline */
+static void control_read(void)
+{
+	char buf[2048];
+	char *p;
+	char *line;
+	ssize_t count;
+
+	while ((count = read(fifo_fd, buf, sizeof(buf) - 1)) > 0) {
+		buf[count] = '\0';
+		p = buf;
+		while ((line = strsep(&p, "\n")))
+			if (*line)
+				control_command(line);
+	}
+}
+
+/*
+ * Requests to a shared supervisor are key=value strings, each ended by a
+ * nul, with an empty one after the last. A start passes the write end of
+ * the ready pipe along with it. The reply is a line, which is ok, unknown
+ * for a service that is not ours or else says what went wrong.
+ */
+static void request_add(char **request, size_t *len, const char *key,
+		const char *value)
+{
+	size_t size = strlen(key) + strlen(value) + 2;
 
-	if (svcname)
-		rc_service_daemon_set(svcname, exec, (const char * const *) argv,
-				pidfile, true);
+	*request = xrealloc(*request, *len + size + 1);
+	snprintf(*request + *len, size, "%s=%s", key, value);
+	*len += size;
+	(*request)[*len] = '\0';
+}
+
+/* A request ends with an empty string, so in two NULs unless it is empty */
+static bool client_complete(const struct client *client)
+{
+	return client->len > 0 && client->len < REQUEST_MAX &&
+	    client->request[client->len - 1] == '\0' &&
+	    (client->len == 1 || client->request[client->len - 2] == '\0');
+}
+
+/* Take what the client has sent so far, returning true while there
+ * is more of its request to come */
+static bool client_read(struct client *client)
+{
+	char buf[BUFSIZ];
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	ssize_t count;
+	int fd_in;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	if ((count = recvmsg(client->fd, &msg, 0)) == -1)
+		return errno == EAGAIN || errno == EWOULDBLOCK ||
+		    errno == EINTR;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		memcpy(&fd_in, CMSG_DATA(cmsg), sizeof(fd_in));
+		if (client->passed_fd == -1) {
+			fcntl(fd_in, F_SETFD, FD_CLOEXEC);
+			client->passed_fd = fd_in;
+		} else
+			close(fd_in);
+	}
+	if (count == 0)
+		return false;
+
+	client->request = xrealloc(client->request, client->len + count);
+	memcpy(client->request + client->len, buf, count);
+	client->len += count;
+	return client->len < REQUEST_MAX && !client_complete(client);
+}
+
+static void request_start(int fd, struct supervised *sv)
+{
+	char *message;
+
+	if (sv_find(sv->svcname)) {
+		xasprintf(&message, "%s is already supervised", sv->svcname);
+		client_reply(fd, message);
+		free(message);
+		sv_free(sv);
+		return;
+	}
+	if (!sv->exec || !sv->pidfile || !sv->options || !sv->envp) {
+		client_reply(fd, "incomplete request");
+		sv_free(sv);
+		return;
+	}
+	if (!sv_register(sv)) {
+		xasprintf(&message, "fopen `%s': %s", sv->pidfile,
+				strerror(errno));
+		client_reply(fd, message);
+		free(message);
+		sv_free(sv);
+		return;
+	}
+
+	syslog(LOG_INFO, "supervising %s", sv->svcname);
+	TAILQ_INSERT_TAIL(&services, sv, entries);
+	spawn_child(sv);
+	client_reply(fd, "ok");
+}
+
+static void client_request(int fd, char *request, size_t len, int ready_fd)
+{
+	struct supervised *sv = sv_new();
+	struct supervised *running;
+	RC_STRINGLIST *args = rc_stringlist_new();
+	RC_STRINGLIST *options = rc_stringlist_new();
+	RC_STRINGLIST *env = rc_stringlist_new();
+	char *cmd = NULL;
+	char *key;
+	char *next;
+	char *value;
+	unsigned long long cur;
+	unsigned long long max;
+	size_t i;
+
+	sv->ready_fd = ready_fd;
+	for (key = request; key < request + len && *key; key = next) {
+		next = key + strlen(key) + 1;
+		if (!(value = strchr(key, '=')))
+			continue;
+		*value++ = '\0';
+		if (strcmp(key, "cmd") == 0)
+			cmd = value;
+		else if (strcmp(key, "svc") == 0 && !sv->svcname)
+			sv->svcname = xstrdup(value);
+		else if (strcmp(key, "exec") == 0 && !sv->exec)
+			sv->exec = xstrdup(value);
+		else if (strcmp(key, "pidfile") == 0 && !sv->pidfile)
+			sv->pidfile = xstrdup(value);
+		else if (strcmp(key, "retry") == 0 && !sv->retry)
+			sv->retry = xstrdup(value);
+		else if (strcmp(key, "cgroup") == 0 && !sv->cgroup)
+			sv->cgroup = xstrdup(value);
+		else if (strcmp(key, "sig") == 0)
+			sscanf(value, "%d", &sv->sig);
+		else if (strcmp(key, "respawn_delay") == 0)
+			sscanf(value, "%d", &sv->respawn_delay);
+		else if (strcmp(key, "respawn_max") == 0)
+			sscanf(value, "%d", &sv->respawn_max);
+		else if (strcmp(key, "respawn_period") == 0)
+			sscanf(value, "%d", &sv->respawn_period);
+		else if (strcmp(key, "respawn_delay_max") == 0)
+			sscanf(value, "%d", &sv->respawn_delay_max);
+		else if (strcmp(key, "respawn_jitter") == 0)
+			sscanf(value, "%d", &sv->respawn_jitter);
+		else if (strcmp(key, "respawn_reset") == 0)
+			sscanf(value, "%d", &sv->respawn_reset);
+		else if (strcmp(key, "respawn_park") == 0)
+			sscanf(value, "%d", &sv->respawn_park);
+		else if (strcmp(key, "healthcheck_delay") == 0)
+			sscanf(value, "%d", &sv->healthcheckdelay);
+		else if (strcmp(key, "healthcheck_timer") == 0)
+			sscanf(value, "%d", &sv->healthchecktimer);
+		else if (strcmp(key, "rlimit") == 0 &&
+		    sscanf(value, "%zu %llu %llu", &i, &cur, &max) == 3 &&
+		    i < ARRAY_SIZE(rlimit_resources)) {
+			sv->rlimits[i].rlim_cur = (rlim_t)cur;
+			sv->rlimits[i].rlim_max = (rlim_t)max;
+			sv->rlimit_set[i] = true;
+		} else if (strcmp(key, "healthcheck_probe") == 0 &&
+		    sv->probe.type == PROBE_NONE &&
+		    !probe_parse(&sv->probe, value)) {
+			/* The client checked it, so this is only the
+			 * resolver telling us something different */
+			syslog(LOG_WARNING, "invalid health check probe %s", value);
+			probe_free(&sv->probe);
+			sv->probe.type = PROBE_NONE;
+		} else if (strcmp(key, "arg") == 0)
+			rc_stringlist_add(args, value);
+		else if (strcmp(key, "option") == 0)
+			rc_stringlist_add(options, value);
+		else if (strcmp(key, "env") == 0)
+			rc_stringlist_add(env, value);
+	}
+	sv->argv = strv_from_list(args);
+	if (TAILQ_FIRST(options))
+		sv->options = strv_from_list(options);
+	if (TAILQ_FIRST(env))
+		sv->envp = strv_from_list(env);
+	rc_stringlist_free(args);
+	rc_stringlist_free(options);
+	rc_stringlist_free(env);
+
+	if (verbose)
+		syslog(LOG_DEBUG, "Received %s for %s", cmd ? cmd : "nothing",
+				sv->svcname ? sv->svcname : "nothing");
+	if (!cmd || !sv->svcname) {
+		client_reply(fd, "incomplete request");
+		sv_free(sv);
+		return;
+	}
+	if (strcmp(cmd, "start") == 0) {
+		request_start(fd, sv);
+		return;
+	}
+
+	if (!(running = sv_find(sv->svcname)))
+		client_reply(fd, "unknown");
+	else if (strcmp(cmd, "signal") == 0)
+		client_reply(fd, sv_signal(running, sv->sig) ? "ok" :
+				"unable to signal the daemon");
+	else if (strcmp(cmd, "stop") == 0) {
+		/* We reply once it has stopped */
+		if (running->client_fd != -1)
+			client_reply(fd, "already stopping");
+		else {
+			running->client_fd = fd;
+			sv_stop(running);
+		}
+	} else
+		client_reply(fd, "unknown command");
+	sv_free(sv);
+}
+
+static void client_accept(void)
+{
+	int fd;
+
+	if ((fd = accept(listen_fd, NULL, NULL)) == -1)
+		return;
+	if (nclients == MAX_CLIENTS) {
+		close(fd);
+		return;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	clients[nclients].fd = fd;
+	clients[nclients].passed_fd = -1;
+	clients[nclients].request = NULL;
+	clients[nclients].len = 0;
+	/* Clients send their request as soon as they connect, so one
+	 * that does not only gets a second */
+	clients[nclients].deadline = now_ms() + 1000;
+	nclients++;
+}
+
+/* Act on the request of a client we have finished reading, or drop it
+ * if the request never arrived whole */
+static void client_done(size_t i)
+{
+	struct client *client = &clients[i];
+	struct timeval timeout = { .tv_sec = 1 };
+
+	if (client_complete(client)) {
+		/* The reply is short, but don't let a client that stops
+		 * reading wedge us */
+		fcntl(client->fd, F_SETFL,
+		    fcntl(client->fd, F_GETFL) & ~O_NONBLOCK);
+		setsockopt(client->fd, SOL_SOCKET, SO_SNDTIMEO,
+		    &timeout, sizeof(timeout));
+		client_request(client->fd, client->request, client->len,
+		    client->passed_fd);
+	} else {
+		close(client->fd);
+		if (client->passed_fd != -1)
+			close(client->passed_fd);
+	}
+	free(client->request);
+	*client = clients[--nclients];
+}
+
+RC_NORETURN static void supervisor(void)
+{
+	struct supervised *sv;
+	struct supervised *tsv;
+	const int sigs[] = { SIGCHLD, SIGTERM };
+	struct pollfd *fds = NULL;
+	size_t fds_max = 0;
+	size_t nfds;
+	size_t i;
+	sigset_t signals;
+	int64_t now, next;
+	bool served = false;
+	bool stopping = false;
+	int sig;
+	int timeout;
+
+	/* block all signals, those we handle are read from signal_fd */
+	sigfillset(&signals);
+	sigprocmask(SIG_SETMASK, &signals, &orig_signals);
+	if ((signal_fd = signals_open(sigs, ARRAY_SIZE(sigs))) == -1)
+		eerrorx("%s: unable to watch for signals: %s", applet,
+				strerror(errno));
+
+	/* The control fifo stays open, with a writer of our own so that it
+	 * never reads as closed between commands. A shared supervisor takes
+	 * its commands from the socket instead. */
+	if (!shared &&
+	    ((fifo_fd = open(fifopath, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) == -1 ||
+	     (fifo_wfd = open(fifopath, O_WRONLY | O_NONBLOCK | O_CLOEXEC)) == -1))
+		eerrorx("%s: unable to open control fifo: %s", applet,
+				strerror(errno));
 
 	/* remove the controlling tty */
 #ifdef TIOCNOTTY
@@ -658,140 +1824,448 @@ RC_NORETURN static void supervisor(char *exec, char **argv)
 #endif
 
 	/*
-	 * Supervisor main loop
+	 * Supervisor main loop. Everything we wait on is a file descriptor
+	 * or a deadline, so when there is nothing to do we sleep in poll.
+	 * We are done once the last daemon has gone, though a shared
+	 * supervisor first waits for the request it was started for.
 	 */
-	if (healthcheckdelay)
-		alarm(healthcheckdelay);
-	else if (healthchecktimer)
-		alarm(healthchecktimer);
-	failing = 0;
-	while (!exiting) {
-		healthcheck_respawn = 0;
-		fifo_fd = open(fifopath, O_RDONLY);
-		if (fifo_fd > 0) {
-			memset(buf, 0, sizeof(buf));
-			count = read(fifo_fd, buf, sizeof(buf) - 1);
-			close(fifo_fd);
-			if (count != -1)
-				buf[count] = 0;
-			if (count == 0)
+	srandom(getpid() ^ time(NULL));
+	while (!TAILQ_EMPTY(&services) || (shared && !served && !exiting)) {
+		/* Our own fds come first, then those of clients still
+		 * sending their request and of any health probes waiting on
+		 * an answer */
+		nfds = 2 + nclients;
+		TAILQ_FOREACH(sv, &services, entries)
+			if (sv->probe.fd != -1)
+				nfds++;
+		if (nfds > fds_max) {
+			fds_max = nfds;
+			fds = xrealloc(fds, sizeof(*fds) * fds_max);
+		}
+		fds[0].fd = signal_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = shared ? listen_fd : fifo_fd;
+		fds[1].events = POLLIN;
+
+		now = now_ms();
+		next = 0;
+		for (i = 0; i < nclients; i++) {
+			fds[i + 2].fd = clients[i].fd;
+			fds[i + 2].events = POLLIN;
+			if (!next || clients[i].deadline < next)
+				next = clients[i].deadline;
+		}
+		nfds = 2 + nclients;
+		TAILQ_FOREACH(sv, &services, entries) {
+			if (sv->respawn_at && (!next || sv->respawn_at < next))
+				next = sv->respawn_at;
+			if (sv->health_at && !sv->health_pid &&
+			    (!next || sv->health_at < next))
+				next = sv->health_at;
+			if (sv->probe.fd == -1)
 				continue;
-			if (verbose)
-				syslog(LOG_DEBUG, "Received %s from fifo", buf);
-			if (strncasecmp(buf, "sig", 3) == 0) {
-				if ((sscanf(buf, "%s %d", cmd, &sig_send) == 2)
-						&& (sig_send >= 0 && sig_send < NSIG)) {
-					syslog(LOG_INFO, "Sending signal %d to %d", sig_send,
-							child_pid);
-					if (kill(child_pid, sig_send) == -1)
-						syslog(LOG_ERR, "Unable to send signal %d to %d",
-								sig_send, child_pid);
-				}
-			}
-			continue;
+			fds[nfds].fd = sv->probe.fd;
+			fds[nfds].events = sv->probe.events;
+			nfds++;
+			if (!next || sv->probe_deadline < next)
+				next = sv->probe_deadline;
 		}
-		if (do_healthcheck) {
-			do_healthcheck = 0;
-			alarm(0);
-			if (verbose)
-				syslog(LOG_DEBUG, "running health check for %s", svcname);
-			health_pid = exec_command("healthcheck");
-			health_status = rc_waitpid(health_pid);
-			if (WIFEXITED(health_status) && WEXITSTATUS(health_status) == 0)
-				alarm(healthchecktimer);
-			else {
-				syslog(LOG_WARNING, "health check for %s failed", svcname);
-				health_pid = exec_command("unhealthy");
-				rc_waitpid(health_pid);
-				syslog(LOG_INFO, "stopping %s, pid %d", exec, child_pid);
-				nkilled = run_stop_schedule(applet, NULL, NULL, child_pid, 0,
-						false, false, true);
-				if (nkilled < 0)
-					syslog(LOG_INFO, "Unable to kill %d: %s",
-							child_pid, strerror(errno));
-				else
-					healthcheck_respawn = 1;
+		timeout = -1;
+		if (next)
+			timeout = next <= now ? 0 :
+			    next - now > INT_MAX ? INT_MAX : (int)(next - now);
+
+		if (poll(fds, nfds, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "%s: poll: %s", applet, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if (fds[0].revents & POLLIN)
+			while ((sig = signals_read(signal_fd)) > 0)
+				handle_signal(sig);
+		/* Going backwards, the client moved into the place of one we
+		 * are done with has already been seen to */
+		for (i = nclients; i-- > 0;) {
+			if (!fds[i + 2].revents)
+				continue;
+			if (!client_read(&clients[i])) {
+				client_done(i);
+				served = true;
 			}
 		}
+		/* A signal may have done away with the probe in the meantime */
+		for (i = 2 + nclients; i < nfds; i++) {
+			if (!fds[i].revents)
+				continue;
+			TAILQ_FOREACH(sv, &services, entries)
+				if (sv->probe.fd == fds[i].fd) {
+					probe_ready(sv, false);
+					break;
+				}
+		}
+		if (fds[1].revents & POLLIN) {
+			if (shared)
+				client_accept();
+			else
+				control_read();
+		}
+
 		if (exiting) {
-			alarm(0);
-			syslog(LOG_INFO, "stopping %s, pid %d", exec, child_pid);
-			nkilled = run_stop_schedule(applet, NULL, NULL, child_pid, 0,
-					false, false, true);
-			if (nkilled > 0)
-				syslog(LOG_INFO, "killed %d processes", nkilled);
+			if (!stopping) {
+				stopping = true;
+				if (listen_fd != -1) {
+					close(listen_fd);
+					unlink(socketpath);
+					listen_fd = -1;
+				}
+				/* Requests still on their way are dropped */
+				while (nclients > 0) {
+					clients[0].len = 0;
+					client_done(0);
+				}
+				TAILQ_FOREACH_SAFE(sv, &services, entries, tsv)
+					sv_stop(sv);
+			}
 			continue;
 		}
-		wait_pid = waitpid(child_pid, &i, WNOHANG);
-		if (wait_pid == child_pid) {
-			if (WIFEXITED(i))
-				syslog(LOG_WARNING, "%s, pid %d, exited with return code %d",
-						exec, child_pid, WEXITSTATUS(i));
-			else if (WIFSIGNALED(i))
-				syslog(LOG_WARNING, "%s, pid %d, terminated by signal %d",
-						exec, child_pid, WTERMSIG(i));
-		}
-		if (wait_pid == child_pid || healthcheck_respawn) {
-			do_healthcheck = 0;
-			healthcheck_respawn = 0;
-			alarm(0);
-			respawn_now = time(NULL);
-			if (first_spawn == 0)
-				first_spawn = respawn_now;
-			if ((respawn_period > 0)
-					&& (respawn_now - first_spawn > respawn_period)) {
-				respawn_count = 0;
-				first_spawn = 0;
-			} else
-				respawn_count++;
-			if (respawn_max > 0 && respawn_count > respawn_max) {
-				syslog(LOG_WARNING, "respawned \"%s\" too many times, exiting",
-						exec);
-				exiting = 1;
-				failing = 1;
-				continue;
+
+		now = now_ms();
+		for (i = nclients; i-- > 0;)
+			if (now >= clients[i].deadline) {
+				client_done(i);
+				served = true;
 			}
-			ts.tv_sec = respawn_delay;
-			ts.tv_nsec = 0;
-			nanosleep(&ts, NULL);
-			if (exiting)
-				continue;
-			child_pid = fork();
-			if (child_pid == -1) {
-				syslog(LOG_ERR, "%s: fork: %s", applet, strerror(errno));
-				exit(EXIT_FAILURE);
+		TAILQ_FOREACH(sv, &services, entries) {
+			if (sv->respawn_at && now >= sv->respawn_at) {
+				sv->respawn_at = 0;
+				spawn_child(sv);
 			}
-			if (child_pid == 0) {
-				sigprocmask(SIG_SETMASK, &old_signals, NULL);
-				memset(&sa, 0, sizeof(sa));
-				sa.sa_handler = SIG_DFL;
-				sigaction(SIGALRM, &sa, NULL);
-				sigaction(SIGCHLD, &sa, NULL);
-				sigaction(SIGTERM, &sa, NULL);
-				child_process(exec, argv);
+			if (sv->health_at && !sv->health_pid && now >= sv->health_at) {
+				sv->health_at = 0;
+				health_check(sv);
+			}
+			if (sv->probe.fd != -1 && now >= sv->probe_deadline) {
+				syslog(LOG_WARNING, "health probe for %s timed out",
+						sv->svcname);
+				probe_ready(sv, true);
 			}
-			if (healthcheckdelay)
-				alarm(healthcheckdelay);
-			else if (healthchecktimer)
-				alarm(healthchecktimer);
 		}
 	}
 
-	if (svcname) {
-		rc_service_daemon_set(svcname, exec, (const char *const *)argv,
-				pidfile, false);
-		rc_service_value_set(svcname, "child_pid", NULL);
-		rc_service_mark(svcname, RC_SERVICE_STOPPED);
-		if (failing)
-			rc_service_mark(svcname, RC_SERVICE_FAILED);
-	}
-	if (pidfile && exists(pidfile))
-		unlink(pidfile);
-	if (fifopath && exists(fifopath))
+	if (listen_fd != -1) {
+		close(listen_fd);
+		unlink(socketpath);
+	}
+	if (!shared && fifopath && exists(fifopath))
 		unlink(fifopath);
 	exit(EXIT_SUCCESS);
 }
 
+/* Look after the daemon we have just started from our own options */
+static struct supervised *sv_local(const char *exec, char **argv,
+		const char *retry, int sig)
+{
+	struct supervised *sv = sv_new();
+
+	sv->svcname = xstrdup(svcname);
+	sv->exec = xstrdup(exec);
+	sv->argv = strv_dup(argv);
+	sv->envp = strv_dup(environ);
+	sv->pidfile = xstrdup(pidfile);
+	sv->retry = retry ? xstrdup(retry) : NULL;
+	sv->sig = sig;
+	sv->healthcheckdelay = healthcheckdelay;
+	sv->healthchecktimer = healthchecktimer;
+	sv->respawn_delay = respawn_delay;
+	sv->respawn_max = respawn_max;
+	sv->respawn_period = respawn_period;
+	sv->respawn_delay_max = respawn_delay_max;
+	sv->respawn_jitter = respawn_jitter;
+	sv->respawn_reset = respawn_reset;
+	sv->respawn_park = respawn_park;
+#ifdef __linux__
+	sv->cgroup = cgroup_self();
+#endif
+	if (healthcheck_probe)
+		probe_parse(&sv->probe, healthcheck_probe);
+	if (!sv_register(sv))
+		eerrorx("%s: fopen `%s': %s", applet, pidfile, strerror(errno));
+	TAILQ_INSERT_TAIL(&services, sv, entries);
+	return sv;
+}
+
+/* The shared supervisor, forked by the supervise-daemon which found none
+ * running. It looks after daemons until the last of them has gone. */
+RC_NORETURN static void shared_supervisor(void)
+{
+	setsid();
+	if (chdir("/") == -1)
+		syslog(LOG_WARNING, "%s: chdir: %s", applet, strerror(errno));
+	devnull_fd = open("/dev/null", O_RDWR);
+	dup2(devnull_fd, STDIN_FILENO);
+	dup2(devnull_fd, STDOUT_FILENO);
+	dup2(devnull_fd, STDERR_FILENO);
+	if (ready.type == READY_FD) {
+		close(ready.pipe[0]);
+		close(ready.pipe[1]);
+		ready.type = READY_NONE;
+	}
+#ifdef __linux__
+	cgroup_leave();
+#endif
+	syslog(LOG_INFO, "shared supervisor started");
+	supervisor();
+}
+
+static int shared_connect(void)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if ((size_t)snprintf(sun.sun_path, sizeof(sun.sun_path), "%s",
+		socketpath) >= sizeof(sun.sun_path))
+		return -1;
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Nobody is listening, so fork the shared supervisor. It holds the lock
+ * for as long as it runs, so only one of us gets to. */
+static bool shared_spawn(void)
+{
+	struct sockaddr_un sun;
+	char *lockpath;
+	int lock_fd;
+	int fd;
+	mode_t mask;
+	pid_t pid;
+
+	xasprintf(&lockpath, "%s/supervise-daemon.lock", rc_svcdir());
+	lock_fd = open(lockpath, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	free(lockpath);
+	if (lock_fd == -1)
+		return false;
+	if (flock(lock_fd, LOCK_EX | LOCK_NB) == -1) {
+		close(lock_fd);
+		return false;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", socketpath);
+	unlink(socketpath);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+		close(lock_fd);
+		return false;
+	}
+	/* Only we may ask it to run things */
+	mask = umask(0077);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1 ||
+	    listen(fd, SOMAXCONN) == -1)
+	{
+		umask(mask);
+		eerror("%s: unable to listen on `%s': %s", applet, socketpath,
+				strerror(errno));
+		close(fd);
+		close(lock_fd);
+		return false;
+	}
+	umask(mask);
+
+	pid = fork();
+	if (pid == -1)
+		eerrorx("%s: fork: %s", applet, strerror(errno));
+	if (pid == 0) {
+		listen_fd = fd;
+		shared_supervisor();
+	}
+	close(fd);
+	close(lock_fd);
+	return true;
+}
+
+static char *request_send(int fd, char *request, size_t len, int pass_fd)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	char line[BUFSIZ];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	size_t size = 0;
+	ssize_t count;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = request;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (pass_fd != -1) {
+		memset(cbuf, 0, sizeof(cbuf));
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+	}
+	count = sendmsg(fd, &msg, MSG_NOSIGNAL);
+	while (count > 0 && (size_t)count < len) {
+		request += count;
+		len -= count;
+		count = send(fd, request, len, MSG_NOSIGNAL);
+	}
+	if (count <= 0)
+		return NULL;
+
+	while (size < sizeof(line) - 1 && read(fd, line + size, 1) == 1) {
+		if (line[size] == '\n') {
+			line[size] = '\0';
+			return xstrdup(line);
+		}
+		size++;
+	}
+	return NULL;
+}
+
+/* Send a request to the shared supervisor and return its reply, or NULL
+ * when there is none to take it. Starting a daemon forks one if need be. */
+static char *shared_request(char *request, size_t len, int pass_fd,
+		bool spawn)
+{
+	struct timespec ts = { .tv_nsec = POLL_INTERVAL };
+	char *reply;
+	int tries;
+	int fd;
+
+	for (tries = 0; tries < 50; tries++) {
+		if ((fd = shared_connect()) == -1) {
+			if (!spawn)
+				return NULL;
+			/* Another of us may be forking it, or one on its way
+			 * out may still hold the lock */
+			if (!shared_spawn())
+				nanosleep(&ts, NULL);
+			continue;
+		}
+		reply = request_send(fd, request, len, pass_fd);
+		close(fd);
+		/* A supervisor on its way out closes on us */
+		if (reply || !spawn)
+			return reply;
+		nanosleep(&ts, NULL);
+	}
+	return NULL;
+}
+
+RC_NORETURN static void shared_start(const char *exec, char **argv,
+		char **options, const char *retry, int sig)
+{
+	char *request = NULL;
+	char *reply;
+	char **c;
+	char number[20];
+	char limit[64];
+	struct rlimit rl;
+	size_t len = 0;
+	size_t i;
+#ifdef __linux__
+	char *cgroup;
+#endif
+
+	request_add(&request, &len, "cmd", "start");
+	request_add(&request, &len, "svc", svcname);
+	request_add(&request, &len, "exec", exec);
+	request_add(&request, &len, "pidfile", pidfile);
+	if (retry)
+		request_add(&request, &len, "retry", retry);
+	snprintf(number, sizeof(number), "%d", sig);
+	request_add(&request, &len, "sig", number);
+	snprintf(number, sizeof(number), "%d", respawn_delay);
+	request_add(&request, &len, "respawn_delay", number);
+	snprintf(number, sizeof(number), "%d", respawn_max);
+	request_add(&request, &len, "respawn_max", number);
+	snprintf(number, sizeof(number), "%d", respawn_period);
+	request_add(&request, &len, "respawn_period", number);
+	snprintf(number, sizeof(number), "%d", respawn_delay_max);
+	request_add(&request, &len, "respawn_delay_max", number);
+	snprintf(number, sizeof(number), "%d", respawn_jitter);
+	request_add(&request, &len, "respawn_jitter", number);
+	snprintf(number, sizeof(number), "%d", respawn_reset);
+	request_add(&request, &len, "respawn_reset", number);
+	snprintf(number, sizeof(number), "%d", respawn_park);
+	request_add(&request, &len, "respawn_park", number);
+	snprintf(number, sizeof(number), "%d", healthcheckdelay);
+	request_add(&request, &len, "healthcheck_delay", number);
+	snprintf(number, sizeof(number), "%d", healthchecktimer);
+	request_add(&request, &len, "healthcheck_timer", number);
+	if (healthcheck_probe)
+		request_add(&request, &len, "healthcheck_probe", healthcheck_probe);
+#ifdef __linux__
+	if ((cgroup = cgroup_self())) {
+		request_add(&request, &len, "cgroup", cgroup);
+		free(cgroup);
+	}
+#endif
+	for (i = 0; i < ARRAY_SIZE(rlimit_resources); i++) {
+		if (getrlimit(rlimit_resources[i], &rl) == -1)
+			continue;
+		snprintf(limit, sizeof(limit), "%zu %llu %llu", i,
+				(unsigned long long)rl.rlim_cur,
+				(unsigned long long)rl.rlim_max);
+		request_add(&request, &len, "rlimit", limit);
+	}
+	for (c = argv; *c; c++)
+		request_add(&request, &len, "arg", *c);
+	for (c = options; *c; c++)
+		request_add(&request, &len, "option", *c);
+	for (c = environ; *c; c++)
+		request_add(&request, &len, "env", *c);
+
+	reply = shared_request(request, len + 1,
+			ready.type == READY_FD ? ready.pipe[1] : -1, true);
+	free(request);
+	if (!reply)
+		eerrorx("%s: unable to reach the shared supervisor", applet);
+	if (strcmp(reply, "ok") != 0)
+		eerrorx("%s: %s", applet, reply);
+	free(reply);
+	exit(ready_wait(applet, ready) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/* Stop or signal the daemon through the shared supervisor. We return
+ * false if it is not one of its daemons. */
+static bool shared_command(const char *cmd, int sig)
+{
+	char *request = NULL;
+	char *reply;
+	char number[20];
+	size_t len = 0;
+
+	request_add(&request, &len, "cmd", cmd);
+	request_add(&request, &len, "svc", svcname);
+	snprintf(number, sizeof(number), "%d", sig);
+	request_add(&request, &len, "sig", number);
+	reply = shared_request(request, len + 1, -1, false);
+	free(request);
+	if (!reply || strcmp(reply, "unknown") == 0) {
+		free(reply);
+		return false;
+	}
+	if (strcmp(reply, "ok") != 0)
+		eerrorx("%s: %s", applet, reply);
+	free(reply);
+	return true;
+}
+
 int main(int argc, char **argv)
 {
 	int opt;
@@ -823,6 +2297,12 @@ int main(int argc, char **argv)
 	char **child_argv = NULL;
 	char *str = NULL;
 	char *cmdline = NULL;
+	char **options;
+	bool child = false;
+	int child_ready = -1;
+	pid_t child_pid;
+	struct supervised *sv;
+	struct probe probe;
 
 	applet = basename_c(argv[0]);
 	atexit(cleanup);
@@ -877,6 +2357,10 @@ int main(int argc, char **argv)
 		argc--;
 		argv++;
 	}
+	/* A shared supervisor runs the daemon with the options as given,
+	 * before getopt moves them about */
+	options = xmalloc(argc * sizeof(*options));
+	memcpy(options, argv + 1, argc * sizeof(*options));
 	while ((opt = getopt_long(argc, argv, getoptstring, longopts,
 		    (int *) 0)) != -1)
 		switch (opt) {
@@ -999,6 +2483,37 @@ int main(int argc, char **argv)
 				    applet, optarg);
 			break;
 
+		case LONGOPT_RESPAWN_DELAY_MAX:  /* --respawn-delay-max time */
+			n = sscanf(optarg, "%d", &respawn_delay_max);
+			if (n != 1 || respawn_delay_max < 1)
+				eerrorx("Invalid respawn-delay-max value '%s'", optarg);
+			break;
+
+		case LONGOPT_RESPAWN_JITTER:  /* --respawn-jitter percent */
+			n = sscanf(optarg, "%d", &respawn_jitter);
+			if (n != 1 || respawn_jitter < 0 || respawn_jitter > 100)
+				eerrorx("Invalid respawn-jitter value '%s'", optarg);
+			break;
+
+		case LONGOPT_RESPAWN_RESET:  /* --respawn-reset time */
+			n = sscanf(optarg, "%d", &respawn_reset);
+			if (n != 1 || respawn_reset < 1)
+				eerrorx("Invalid respawn-reset value '%s'", optarg);
+			break;
+
+		case LONGOPT_RESPAWN_PARK:  /* --respawn-park time */
+			n = sscanf(optarg, "%d", &respawn_park);
+			if (n != 1 || respawn_park < 1)
+				eerrorx("Invalid respawn-park value '%s'", optarg);
+			break;
+
+		case LONGOPT_HEALTHCHECK_PROBE:  /* --healthcheck-probe spec */
+			if (!probe_parse(&probe, optarg))
+				eerrorx("%s: invalid health check probe %s", applet, optarg);
+			probe_free(&probe);
+			healthcheck_probe = optarg;
+			break;
+
 		case 'm':  /* --respawn-max count */
 			n = sscanf(optarg, "%d", &respawn_max);
 			if (n	!= 1 || respawn_max < 0)
@@ -1080,6 +2595,16 @@ int main(int argc, char **argv)
 			ready = ready_parse(applet, optarg);
 			break;
 
+		case LONGOPT_SHARED:
+			shared = true;
+			break;
+
+		case LONGOPT_CHILD:  /* --child <respawn count>:<ready fd> */
+			if (sscanf(optarg, "%d:%d", &respawn_count, &child_ready) != 2)
+				eerrorx("%s: invalid child `%s'", applet, optarg);
+			child = true;
+			break;
+
 		case_RC_COMMON_GETOPT
 		}
 
@@ -1096,10 +2621,29 @@ int main(int argc, char **argv)
 		ch_root = expand_home(home, ch_root);
 
 	umask(numask);
+
+	/* Run the daemon for a shared supervisor, which has forked us and
+	 * looks after it from here */
+	if (child) {
+		if (!exec)
+			eerrorx("%s: nothing to start", applet);
+		if (*exec == '~')
+			exec = expand_home(home, exec);
+		devnull_fd = open("/dev/null", O_RDWR);
+		if (ready.type == READY_FD) {
+			close(ready.pipe[0]);
+			close(ready.pipe[1]);
+			ready.pipe[1] = child_ready != -1 ? child_ready : devnull_fd;
+		}
+		child_process(exec, argv);
+	}
+
 	if (!pidfile)
 		xasprintf(&pidfile, "%s/supervise-%s.pid", rc_is_user() ? getenv("XDG_RUNTIME_DIR") : "/var/run", svcname);
 	xasprintf(&fifopath, "%s/supervise-%s.ctl", rc_svcdir(), svcname);
-	if (mkfifo(fifopath, 0600) == -1 && errno != EEXIST)
+	xasprintf(&socketpath, "%s/supervise-daemon.sock", rc_svcdir());
+	if ((start || reexec) && !shared &&
+	    mkfifo(fifopath, 0600) == -1 && errno != EEXIST)
 		eerrorx("%s: unable to create control fifo: %s",
 				applet, strerror(errno));
 
@@ -1117,6 +2661,7 @@ int main(int argc, char **argv)
 		}
 		free(str);
 		str = rc_service_value_get(svcname, "child_pid");
+		child_pid = 0;
 		sscanf(str, "%d", &child_pid);
 		free(str);
 		exec = rc_service_value_get(svcname, "exec");
@@ -1132,7 +2677,16 @@ int main(int argc, char **argv)
 		sscanf(str, "%d", &respawn_delay);
 		str = rc_service_value_get(svcname, "respawn_max");
 		sscanf(str, "%d", &respawn_max);
-		supervisor(exec, child_argv);
+		for (x = 0; x < (int)ARRAY_SIZE(respawn_values); x++) {
+			str = rc_service_value_get(svcname, respawn_values[x].name);
+			if (str)
+				sscanf(str, "%d", respawn_values[x].value);
+			free(str);
+		}
+		sv = sv_local(exec, child_argv, retry, sig);
+		sv->child_pid = child_pid;
+		health_schedule(sv, healthcheckdelay ? healthcheckdelay : healthchecktimer);
+		supervisor();
 	} else if (start) {
 		if (exec) {
 			if (*exec == '~')
@@ -1210,9 +2764,30 @@ int main(int argc, char **argv)
 		xasprintf(&varbuf, "%i", respawn_max);
 		rc_service_value_set(svcname, "respawn_max", varbuf);
 		free(varbuf);
-		xasprintf(&varbuf, "%i", respawn_period);
-		rc_service_value_set(svcname, "respawn_period", varbuf);
+		for (x = 0; x < (int)ARRAY_SIZE(respawn_values); x++) {
+			xasprintf(&varbuf, "%i", *respawn_values[x].value);
+			rc_service_value_set(svcname, respawn_values[x].name, varbuf);
+			free(varbuf);
+		}
+		c = argv;
+		x = 0;
+		while (c && *c) {
+			varbuf = NULL;
+			xasprintf(&varbuf, "argv_%-d",x);
+			rc_service_value_set(svcname, varbuf, *c);
+			free(varbuf);
+			varbuf = NULL;
+			x++;
+			c++;
+		}
+		xasprintf(&varbuf, "%d", x);
+		rc_service_value_set(svcname, "argc", varbuf);
 		free(varbuf);
+		rc_service_value_set(svcname, "exec", exec);
+
+		if (shared)
+			shared_start(exec, argv, options, retry, sig);
+
 		child_pid = fork();
 		if (child_pid == -1)
 			eerrorx("%s: fork: %s", applet, strerror(errno));
@@ -1227,35 +2802,17 @@ int main(int argc, char **argv)
 		dup2(devnull_fd, STDOUT_FILENO);
 		dup2(devnull_fd, STDERR_FILENO);
 
-		if (ready.type == READY_FD)
+		sv = sv_local(exec, argv, retry, sig);
+		if (ready.type == READY_FD) {
 			close(ready.pipe[0]);
-
-		child_pid = fork();
-		if (child_pid == -1)
-			eerrorx("%s: fork: %s", applet, strerror(errno));
-		else if (child_pid != 0) {
-			if (ready.type == READY_FD)
-				close(ready.pipe[1]);
-			c = argv;
-			x = 0;
-			while (c && *c) {
-				varbuf = NULL;
-				xasprintf(&varbuf, "argv_%-d",x);
-				rc_service_value_set(svcname, varbuf, *c);
-				free(varbuf);
-				varbuf = NULL;
-				x++;
-				c++;
-			}
-			xasprintf(&varbuf, "%d", x);
-			rc_service_value_set(svcname, "argc", varbuf);
-			free(varbuf);
-			rc_service_value_set(svcname, "exec", exec);
-			supervisor(exec, argv);
-		} else
-			child_process(exec, argv);
+			sv->ready_fd = ready.pipe[1];
+		}
+		spawn_child(sv);
+		supervisor();
 	} else if (stop) {
-		pid = get_pid(applet, pidfile);
+		pid = -1;
+		if (!shared_command("stop", sig))
+			pid = get_pid(applet, pidfile);
 		if (pid != -1) {
 			i = kill(pid, SIGTERM);
 			if (i != 0)
@@ -1285,17 +2842,19 @@ int main(int argc, char **argv)
 		}
 		exit(EXIT_SUCCESS);
 	} else if (sendsig) {
+		if (shared_command("signal", sig))
+			exit(EXIT_SUCCESS);
 		fifo_fd = open(fifopath, O_WRONLY |O_NONBLOCK);
 		if (fifo_fd < 0)
 			eerrorx("%s: unable to open control fifo %s", applet, strerror(errno));
-		xasprintf(&str, "sig %d", sig);
-		x = write(fifo_fd, str, strlen(str));
+		x = xasprintf(&str, "sig %d\n", sig);
+		x = write(fifo_fd, str, x);
 		if (x == -1) {
-			free(tmp);
+			free(str);
 			eerrorx("%s: error writing to control fifo: %s", applet,
 					strerror(errno));
 		}
-		free(tmp);
+		free(str);
 		exit(EXIT_SUCCESS);
 	}
 }
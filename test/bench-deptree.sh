@@ -0,0 +1,49 @@
+#!/bin/sh
+# Benchmark dependency resolution over a synthetic deptree.
+# usage: bench-deptree.sh <number of services>
+#
+# Each service needs the one before it, uses one further back and is
+# ordered after a third, so resolving the last service walks the whole
+# tree. Every tenth service also needs the "net" virtual service, which a
+# few real services provide.
+
+top_srcdir=${SOURCE_ROOT:-..}
+. ${top_srcdir}/test/setup_env.sh
+
+count=${1:-1000}
+TMPDIR="${BUILD_ROOT}"/tmp-"$(basename "$0")"-${count}
+
+gen_deptree()
+{
+	awk -v n="$1" 'BEGIN {
+		for (i = 0; i < n; i++) {
+			printf("depinfo_%d_service='\''svc%d'\''\n", i, i)
+			if (i > 0)
+				printf("depinfo_%d_ineed_0='\''svc%d'\''\n", i, i - 1)
+			if (i % 10 == 9)
+				printf("depinfo_%d_ineed_1='\''net'\''\n", i)
+			if (i > 2)
+				printf("depinfo_%d_iuse_0='\''svc%d'\''\n", i, int(i / 2))
+			if (i > 3)
+				printf("depinfo_%d_iafter_0='\''svc%d'\''\n", i, i - 3)
+			if (i < 3)
+				printf("depinfo_%d_iprovide_0='\''net'\''\n", i)
+		}
+		printf("depinfo_%d_service='\''net'\''\n", n)
+		for (i = 0; i < 3 && i < n; i++)
+			printf("depinfo_%d_providedby_%d='\''svc%d'\''\n", n, i, i)
+	}'
+}
+
+rm -rf "${TMPDIR}"
+mkdir "${TMPDIR}"
+gen_deptree "${count}" > "${TMPDIR}"/deptree
+
+ebegin "Resolving dependencies of ${count} services"
+"${BUILD_ROOT}"/src/rc-depend/rc-depend -F "${TMPDIR}"/deptree \
+	-t ineed,iuse,iafter svc$((count - 1)) >/dev/null
+retval=$?
+eend ${retval}
+
+rm -rf "${TMPDIR}"
+exit ${retval}
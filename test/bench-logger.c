@@ -0,0 +1,221 @@
+/*
+ * bench-logger.c
+ * Benchmark how fast the rc logger strips escapes from console output,
+ * against the old loop which wrote each byte on its own.
+ * usage: bench-logger [transcript]
+ *
+ * Without a transcript we make one up from the sort of output einfo gives
+ * during boot.
+ */
+
+/*
+ * Copyright (c) 2007-2015 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/HEAD/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/HEAD/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rc-logger.h"
+#include "helpers.h"
+
+static bool old_in_escape = false;
+static bool old_in_term = false;
+
+/* write_log() as it was, one write per byte */
+static void
+old_write_log(int logfd, const char *buffer, size_t bytes)
+{
+	const char *p = buffer;
+
+	while ((size_t)(p - buffer) < bytes) {
+		switch (*p) {
+		case '\r':
+			goto cont;
+		case '\033':
+			old_in_escape = true;
+			old_in_term = false;
+			goto cont;
+		case '\n':
+			old_in_escape = old_in_term = false;
+			break;
+		case '[':
+			if (old_in_escape)
+				old_in_term = true;
+			break;
+		}
+
+		if (!old_in_escape) {
+			if (!isprint((int) *p) && *p != '\n')
+				goto cont;
+			if (write(logfd, p++, 1) == -1)
+				perror("write");
+			continue;
+		}
+
+		if (!old_in_term || isalpha((unsigned char)*p))
+			old_in_escape = old_in_term = false;
+cont:
+		p++;
+	}
+}
+
+static void
+new_write_log(int logfd, const char *buffer, size_t bytes)
+{
+	char out[BUFSIZ];
+	size_t n, len;
+
+	while (bytes > 0) {
+		n = bytes < sizeof(out) ? bytes : sizeof(out);
+		len = rc_logger_strip(out, buffer, n);
+		if (write(logfd, out, len) == -1)
+			perror("write");
+		buffer += n;
+		bytes -= n;
+	}
+}
+
+static char *
+make_transcript(size_t *len)
+{
+	static const char *const lines[] = {
+		"\033[32;01m*\033[0m Starting sshd ...\r\n",
+		"\033[A\033[74C \033[34;01m[ \033[32;01mok\033[34;01m ]\033[0m\r\n",
+		"\033[33;01m*\033[0m WARNING: netmount is already starting\r\n",
+		" \033[32;01m*\033[0m   Bringing up interface eth0\r\n",
+		"\033[31;01m*\033[0m ERROR: cupsd failed to start\r\n",
+	};
+	char *buffer = NULL;
+	size_t size = 0, l;
+	int i;
+
+	*len = 0;
+	for (i = 0; *len < 4 * 1024 * 1024; i++) {
+		l = strlen(lines[i % ARRAY_SIZE(lines)]);
+		if (size - *len < l) {
+			size += BUFSIZ * 16;
+			buffer = xrealloc(buffer, size);
+		}
+		memcpy(buffer + *len, lines[i % ARRAY_SIZE(lines)], l);
+		*len += l;
+	}
+	return buffer;
+}
+
+static char *
+read_transcript(const char *file, size_t *len)
+{
+	char *buffer = NULL;
+	size_t size = 0;
+	ssize_t r;
+	int fd;
+
+	if ((fd = open(file, O_RDONLY)) == -1) {
+		fprintf(stderr, "open `%s': %s\n", file, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	*len = 0;
+	do {
+		if (size - *len < BUFSIZ) {
+			size += BUFSIZ * 16;
+			buffer = xrealloc(buffer, size);
+		}
+		r = read(fd, buffer + *len, size - *len);
+		if (r > 0)
+			*len += r;
+	} while (r > 0);
+	close(fd);
+	return buffer;
+}
+
+/* Feed the transcript through in reads the size the logger uses */
+static double
+run(void (*write_log)(int, const char *, size_t), int fd,
+    const char *buffer, size_t len)
+{
+	struct timespec start, end;
+	size_t n;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n = 0; n < len; n += BUFSIZ)
+		write_log(fd, buffer + n, len - n < BUFSIZ ? len - n : BUFSIZ);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	timespecsub(&end, &start, &end);
+	return end.tv_sec * 1000.0 + end.tv_nsec / 1000000.0;
+}
+
+static char *
+slurp(FILE *fp, size_t *len)
+{
+	char *buffer;
+
+	*len = ftell(fp);
+	buffer = xmalloc(*len + 1);
+	rewind(fp);
+	if (fread(buffer, 1, *len, fp) != *len)
+		*len = 0;
+	return buffer;
+}
+
+int
+main(int argc, char **argv)
+{
+	FILE *old_fp, *new_fp;
+	char *buffer, *old_log, *new_log;
+	size_t len, old_len, new_len;
+	double old_ms, new_ms;
+	int null, retval = EXIT_SUCCESS;
+
+	if (argc > 1)
+		buffer = read_transcript(argv[1], &len);
+	else
+		buffer = make_transcript(&len);
+
+	/* Both paths must log the same thing */
+	old_fp = tmpfile();
+	new_fp = tmpfile();
+	if (!old_fp || !new_fp) {
+		perror("tmpfile");
+		return EXIT_FAILURE;
+	}
+	old_ms = run(old_write_log, fileno(old_fp), buffer, len);
+	new_ms = run(new_write_log, fileno(new_fp), buffer, len);
+	old_log = slurp(old_fp, &old_len);
+	new_log = slurp(new_fp, &new_len);
+	if (old_len != new_len || memcmp(old_log, new_log, old_len) != 0) {
+		fprintf(stderr, "logs differ: %zu bytes old, %zu bytes new\n",
+		    old_len, new_len);
+		retval = EXIT_FAILURE;
+	}
+	printf("%zu bytes logged as %zu, to a file: old %.1fms, new %.1fms\n",
+	    len, new_len, old_ms, new_ms);
+
+	if ((null = open("/dev/null", O_WRONLY)) != -1) {
+		old_ms = run(old_write_log, null, buffer, len);
+		new_ms = run(new_write_log, null, buffer, len);
+		printf("to /dev/null: old %.1fms, new %.1fms\n", old_ms, new_ms);
+		close(null);
+	}
+
+	fclose(old_fp);
+	fclose(new_fp);
+	free(old_log);
+	free(new_log);
+	free(buffer);
+	return retval;
+}
@@ -0,0 +1,245 @@
+/*
+ * bench-mtime.c
+ * Benchmark how fast rc_deptree_update_needed() finds the newest file the
+ * deptree is built from, against the old walk which rebuilt each path and
+ * stat()ed it.
+ * usage: bench-mtime [files]
+ *
+ * We make up a user mode tree with that many files, 10000 by default,
+ * spread over the init.d and conf.d directories it checks.
+ */
+
+/*
+ * Copyright (c) 2007-2015 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/HEAD/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/HEAD/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "queue.h"
+#include "rc.h"
+#include "helpers.h"
+
+#define RUNS 5
+
+/* deep_mtime_check() as it was */
+static bool
+old_deep_mtime_check(const char *target, time_t *rel, char *file)
+{
+	struct stat buf;
+	bool retval = true;
+	DIR *dp;
+	struct dirent *d;
+	char path[PATH_MAX];
+
+	if (stat(target, &buf) != 0)
+		return true;
+
+	if (*rel < buf.st_mtime) {
+		retval = false;
+		strcpy(file, target);
+		*rel = buf.st_mtime;
+	}
+
+	if (!(dp = opendir(target)))
+		return retval;
+
+	while ((d = readdir(dp))) {
+		if (d->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", target, d->d_name);
+		if (!old_deep_mtime_check(path, rel, file))
+			retval = false;
+	}
+	closedir(dp);
+	return retval;
+}
+
+/* What rc_deptree_update_needed() checks, in the same order */
+static RC_STRINGLIST *
+targets(void)
+{
+	RC_STRINGLIST *list = rc_stringlist_new();
+	char *path;
+
+	for (const char * const *dirs = rc_scriptdirs(); *dirs; dirs++) {
+		xasprintf(&path, "%s/init.d", *dirs);
+		rc_stringlist_add(list, path);
+		free(path);
+		xasprintf(&path, "%s/conf.d", *dirs);
+		rc_stringlist_add(list, path);
+		free(path);
+	}
+	xasprintf(&path, "%s/rc.conf", rc_sysconfdir());
+	rc_stringlist_add(list, path);
+	free(path);
+	xasprintf(&path, "%s/rc.conf", rc_usrconfdir());
+	rc_stringlist_add(list, path);
+	free(path);
+	return list;
+}
+
+static void
+make_dir(const char *path)
+{
+	if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+		fprintf(stderr, "mkdir `%s': %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void
+touch(const char *path, time_t mtime)
+{
+	struct timespec times[2] = { { mtime, 0 }, { mtime, 0 } };
+	int fd;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT, 0644)) != -1)
+		close(fd);
+	if (utimensat(AT_FDCWD, path, times, 0) != 0) {
+		fprintf(stderr, "utimensat `%s': %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Files go 100 to a directory, like conf.d/net would be, and a few of
+ * them are newer than the deptree so there is something to find */
+static void
+make_tree(const char *top, long count, time_t base)
+{
+	const char *dirs[] = { "cfg/rc/init.d", "cfg/rc/conf.d",
+		"run/openrc/init.d", "run/openrc/conf.d" };
+	char *path;
+	long i;
+
+	for (i = 0; i < count; i++) {
+		if (i % 100 == 0) {
+			xasprintf(&path, "%s/%s/dir%ld", top,
+			    dirs[(i / 100) % ARRAY_SIZE(dirs)], i / 100);
+			make_dir(path);
+			free(path);
+		}
+		xasprintf(&path, "%s/%s/dir%ld/file%ld", top,
+		    dirs[(i / 100) % ARRAY_SIZE(dirs)], i / 100, i);
+		/* Two share the newest time, so which is found depends on
+		 * the order they are looked at in */
+		touch(path, i == count / 3 || i == count / 2 ? base + 20 :
+		    i % 997 == 0 ? base + 10 : base);
+		free(path);
+	}
+	/* Adding the files made the directories new as well */
+	for (i = 0; i < (count + 99) / 100; i++) {
+		xasprintf(&path, "%s/%s/dir%ld", top,
+		    dirs[i % ARRAY_SIZE(dirs)], i);
+		touch(path, base);
+		free(path);
+	}
+	for (i = 0; i < (long)ARRAY_SIZE(dirs); i++) {
+		xasprintf(&path, "%s/%s", top, dirs[i]);
+		touch(path, base);
+		free(path);
+	}
+}
+
+static double
+elapsed(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	timespecsub(&end, start, &end);
+	return end.tv_sec * 1000.0 + end.tv_nsec / 1000000.0;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *root = getenv("BUILD_ROOT");
+	char top[PATH_MAX], old_file[PATH_MAX], new_file[PATH_MAX];
+	char *path, *cmd;
+	const char *subdirs[] = { "cfg", "cfg/rc", "cfg/rc/init.d",
+		"cfg/rc/conf.d", "run", "run/openrc", "run/openrc/init.d",
+		"run/openrc/conf.d" };
+	RC_STRINGLIST *list;
+	RC_STRING *s;
+	struct timespec start;
+	time_t base = time(NULL) - 3600, old_mtime = 0, new_mtime = 0;
+	double old_ms = 0, new_ms = 0;
+	long count = argc > 1 ? strtol(argv[1], NULL, 10) : 10000;
+	int i, retval = EXIT_SUCCESS;
+	size_t j;
+
+	snprintf(top, sizeof(top), "%s/bench-mtime.XXXXXX", root ? root : "/tmp");
+	if (!mkdtemp(top)) {
+		fprintf(stderr, "mkdtemp `%s': %s\n", top, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	for (j = 0; j < ARRAY_SIZE(subdirs); j++) {
+		xasprintf(&path, "%s/%s", top, subdirs[j]);
+		make_dir(path);
+		free(path);
+	}
+	make_tree(top, count, base);
+	xasprintf(&path, "%s/run/openrc/deptree", top);
+	touch(path, base);
+	free(path);
+
+	xasprintf(&path, "%s/cfg", top);
+	setenv("XDG_CONFIG_HOME", path, 1);
+	free(path);
+	xasprintf(&path, "%s/run", top);
+	setenv("XDG_RUNTIME_DIR", path, 1);
+	free(path);
+	setenv("RC_STATED", "NO", 1);
+	rc_set_user();
+
+	list = targets();
+	for (i = 0; i < RUNS; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		old_mtime = base;
+		TAILQ_FOREACH(s, list, entries)
+			old_deep_mtime_check(s->value, &old_mtime, old_file);
+		old_ms += elapsed(&start);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (!rc_deptree_update_needed(&new_mtime, new_file)) {
+			fprintf(stderr, "no newer file found\n");
+			retval = EXIT_FAILURE;
+			break;
+		}
+		new_ms += elapsed(&start);
+	}
+	rc_stringlist_free(list);
+
+	/* Both must find the same file */
+	if (retval == EXIT_SUCCESS &&
+	    (old_mtime != new_mtime || strcmp(old_file, new_file) != 0)) {
+		fprintf(stderr, "old found %s, new found %s\n", old_file, new_file);
+		retval = EXIT_FAILURE;
+	}
+	printf("%ld files, newest %s: old %.1fms, new %.1fms\n", count,
+	    new_file + strlen(top), old_ms / RUNS, new_ms / RUNS);
+
+	xasprintf(&cmd, "rm -rf '%s'", top);
+	if (system(cmd) != 0)
+		retval = EXIT_FAILURE;
+	free(cmd);
+	return retval;
+}
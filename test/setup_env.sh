@@ -19,3 +19,21 @@ elif ! . ${BUILD_ROOT}/sh/functions.sh; then
 fi
 
 PATH="${BUILD_ROOT}"/src/einfo:${PATH}
+
+# librc sources init scripts with the installed gendepends.sh, so set up
+# one in $1 which reads everything else from the build and source trees
+setup_gendepends()
+{
+	local dir="$1"/libexec
+
+	mkdir -p "${dir}"/sh "$1"/etc || return 1
+	ln -sf "${BUILD_ROOT}"/sh/functions.sh "${dir}"/sh/functions.sh
+	ln -sf "${SOURCE_ROOT}"/sh/rc-functions.sh "${dir}"/sh/rc-functions.sh
+	sed -e "s|@SHELL@|/bin/sh|" -e "s|@LIBEXECDIR@|${dir}|g" \
+		-e "s|@SYSCONFDIR@|$1/etc|g" \
+		"${SOURCE_ROOT}"/sh/gendepends.sh.in > "${dir}"/sh/gendepends.sh &&
+	chmod +x "${dir}"/sh/gendepends.sh || return 1
+	RC_GENDEPENDS="${dir}"/sh/gendepends.sh
+	PATH="${BUILD_ROOT}"/src/shell_var:${PATH}
+	export RC_GENDEPENDS
+}
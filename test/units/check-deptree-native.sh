@@ -0,0 +1,134 @@
+#!/bin/sh
+# Check that librc reading depend() itself gives the same deptree, byte
+# for byte, as sourcing every init script with gendepends.sh.
+
+top_srcdir=${SOURCE_ROOT:-..}
+. ${top_srcdir}/test/setup_env.sh
+
+RC_DEPEND="${BUILD_ROOT}"/src/rc-depend/rc-depend
+TMPDIR="${BUILD_ROOT}"/tmp-"$(basename "$0")"
+
+XDG_CONFIG_HOME="${TMPDIR}"/config
+XDG_RUNTIME_DIR="${TMPDIR}"/run
+export XDG_CONFIG_HOME XDG_RUNTIME_DIR
+
+make_script()
+{
+	local script="${XDG_CONFIG_HOME}"/rc/init.d/$1
+
+	{
+		printf "%s\n" "#!/sbin/openrc-run"
+		cat
+	} > "${script}"
+	chmod +x "${script}"
+}
+
+# Some of these librc reads itself, the rest it must leave to the shell
+make_scripts()
+{
+	mkdir -p "${XDG_CONFIG_HOME}"/rc/init.d "${XDG_CONFIG_HOME}"/rc/conf.d \
+		"${XDG_RUNTIME_DIR}"/openrc
+
+	make_script plain <<-'EOF'
+	description="A plain service"
+	depend() {
+		need net
+		use logger dns
+		after bootmisc
+		provide plain-provider
+		keyword -timeout
+	}
+	EOF
+	make_script oneline <<-'EOF'
+	depend() { need plain; }
+	EOF
+	make_script names <<-'EOF'
+	pidfile="/run/${RC_SVCNAME}.pid"
+	command_args="-p ${pidfile} ${foo:-bar}"
+	export FOO=bar
+	start_pre() {
+		checkpath -d /run/foo
+	}
+	depend() {
+		# a comment
+		need plain ; use oneline
+		before !net
+	}
+	EOF
+	make_script assign <<-'EOF'
+	x=${rc_need:=net}
+	depend() {
+		use foo
+	}
+	EOF
+	make_script assign-unset <<-'EOF'
+	x=${rc_need=net}
+	depend() {
+		use foo
+	}
+	EOF
+	make_script assign-nested <<-'EOF'
+	x="${foo:-${rc_after=plain}}"
+	depend() {
+		use foo
+	}
+	EOF
+	make_script assign-var <<-'EOF'
+	rc_use="plain"
+	depend() {
+		need net
+	}
+	EOF
+	make_script colon <<-'EOF'
+	: ${rc_want:=oneline}
+	depend() {
+		need net
+	}
+	EOF
+	make_script conditional <<-'EOF'
+	depend() {
+		[ -n "$RC_SVCNAME" ] && need plain
+		use net
+	}
+	EOF
+	make_script configured <<-'EOF'
+	depend() {
+		need net
+	}
+	EOF
+	printf "%s\n" 'rc_need="plain"' > "${XDG_CONFIG_HOME}"/rc/conf.d/configured
+}
+
+# An exported dependency variable makes librc leave every script to the
+# shell. This one names no service, so it adds nothing itself.
+update_deptree()
+{
+	local out="${TMPDIR}"/deptree.$1
+
+	if [ "$1" = shell ]; then
+		rc_nosuchservice_use= EINFO_VERBOSE=yes "${RC_DEPEND}" -U -u \
+			>/dev/null 2>"${out}".log || return 1
+	else
+		EINFO_VERBOSE=yes "${RC_DEPEND}" -U -u \
+			>/dev/null 2>"${out}".log || return 1
+	fi
+	cp "${XDG_RUNTIME_DIR}"/openrc/deptree "${out}"
+}
+
+run_test()
+{
+	make_scripts
+	update_deptree native || return 1
+	update_deptree shell || return 1
+	# Make sure each run really went the way it was meant to
+	grep -q ", 0 parsed" "${TMPDIR}"/deptree.native.log && return 1
+	grep -q ", 0 parsed" "${TMPDIR}"/deptree.shell.log || return 1
+	diff -u "${TMPDIR}"/deptree.shell "${TMPDIR}"/deptree.native
+}
+
+rm -rf "${TMPDIR}"
+mkdir "${TMPDIR}"
+setup_gendepends "${TMPDIR}" && run_test
+retval=$?
+rm -rf "${TMPDIR}"
+exit ${retval}
@@ -0,0 +1,64 @@
+#!/bin/sh
+# Check that sourcing init scripts with several gendepends.sh workers
+# gives the same deptree, byte for byte, as doing it with one.
+
+top_srcdir=${SOURCE_ROOT:-..}
+. ${top_srcdir}/test/setup_env.sh
+
+RC_DEPEND="${BUILD_ROOT}"/src/rc-depend/rc-depend
+TMPDIR="${BUILD_ROOT}"/tmp-"$(basename "$0")"
+
+XDG_CONFIG_HOME="${TMPDIR}"/config
+XDG_RUNTIME_DIR="${TMPDIR}"/run
+export XDG_CONFIG_HOME XDG_RUNTIME_DIR
+
+# Every other script has a conditional in depend(), so it has to be
+# sourced by the shell rather than parsed by librc.
+make_scripts()
+{
+	local i=0 script=
+
+	mkdir -p "${XDG_CONFIG_HOME}"/rc/init.d "${XDG_RUNTIME_DIR}"/openrc
+	while [ $i -lt 200 ]; do
+		script="${XDG_CONFIG_HOME}"/rc/init.d/svc$i
+		{
+			printf "%s\n" "#!/sbin/openrc-run" "depend() {"
+			[ $i -gt 0 ] && printf "\tneed svc%d\n" $((i - 1))
+			[ $((i % 2)) = 1 ] &&
+				printf "\t[ -n \"\$RC_SVCNAME\" ] && use svc%d\n" $((i / 2))
+			[ $((i % 3)) = 0 ] && printf "\tafter svc%d\n" $((i / 3))
+			[ $((i % 7)) = 2 ] && printf "\tprovide logger\n"
+			printf "%s\n" "}"
+		} > "${script}"
+		chmod +x "${script}"
+		i=$((i + 1))
+	done
+}
+
+update_deptree()
+{
+	printf "rc_depend_jobs=%s\n" "$1" > "${XDG_CONFIG_HOME}"/rc/rc.conf
+	"${RC_DEPEND}" -U -u >/dev/null || return 1
+	cp "${XDG_RUNTIME_DIR}"/openrc/deptree "${TMPDIR}"/deptree.$1
+}
+
+run_test()
+{
+	local jobs=
+
+	make_scripts
+	update_deptree 1 || return 1
+	# Only the shell finds the conditional uses
+	grep -q "_iuse_" "${TMPDIR}"/deptree.1 || return 1
+	for jobs in 2 3 8; do
+		update_deptree ${jobs} || return 1
+		cmp "${TMPDIR}"/deptree.1 "${TMPDIR}"/deptree.${jobs} || return 1
+	done
+}
+
+rm -rf "${TMPDIR}"
+mkdir "${TMPDIR}"
+setup_gendepends "${TMPDIR}" && run_test
+retval=$?
+rm -rf "${TMPDIR}"
+exit ${retval}